@@ -25,13 +25,29 @@
 #include "common/params.h"
 #include "common/swaglog.h"
 #include "common/timing.h"
+#include "common/aligned_buffer.h"
+#include "common/message_arena.h"
+#include "common/shm_ring.h"
+
+#include "can_stats.h"
+#include "bus_clock.h"
+#include "send_scheduler.h"
+#include "panda_transport.h"
+#include "sim_panda.h"
+#include "socketcan_transport.h"
 
 #include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
 
-// double the FIFO size
-#define RECV_SIZE (0x1000)
 #define TIMEOUT 0
 
+// how often the receive and send counters are logged
+#define STATS_INTERVAL_NS (10000000000ULL)
+// how often canStats is published
+#define CAN_STATS_INTERVAL_NS (1000000000ULL)
+
 #define SAFETY_NOOUTPUT  0
 #define SAFETY_HONDA 1
 #define SAFETY_TOYOTA 2
@@ -49,13 +65,97 @@
 #define SAFETY_ALLOUTPUT 0x1337
 #define SAFETY_ELM327 0xE327     // diagnostic only
 
+// src of the n-th panda's frames starts at n * PANDA_BUS_OFFSET
+#define MAX_PANDAS CAN_STATS_MAX_PANDAS
+#define PANDA_BUS_OFFSET 4
+
+// frames a panda's send queue holds while it's lost, about a second of
+// sendcan. past that the oldest are dropped
+#define MAX_TX_PENDING 1024
+
 namespace {
 
 volatile int do_exit = 0;
 
-libusb_context *ctx = NULL;
-libusb_device_handle *dev_handle;
-pthread_mutex_t usb_lock;
+// where each transfer starts in rx_pending and when it arrived
+struct RxMark {
+  size_t offset;
+  uint64_t time;
+};
+
+// a frame in panda usb format and when it's too late to send
+struct TxFrame {
+  uint32_t frame[4];
+  uint64_t deadline;
+};
+
+// One per panda. The first is the main panda, health, gps and ignition
+// come from it. BOARDD_PANDAS adds more, their buses show up in can with
+// src offset by bus_offset. Every panda has its own usb lock, a thread
+// that keeps it connected and one that sends to it, so a slow or lost
+// panda doesn't hold up the others.
+struct Panda {
+  Panda(int index, PandaTransport *transport);
+
+  const int index;
+  const uint8_t bus_offset;
+  PandaTransport *const transport;
+
+  // transfers hold usb_lock for reading so they can run concurrently,
+  // each connect attempt takes it for writing to reopen the panda
+  pthread_rwlock_t usb_lock;
+  // false until connected and while lost, threads that go over every
+  // panda skip it instead of waiting for it to come back
+  std::atomic<bool> connected;
+
+  // filled by the bulk IN stream on the usb event thread, drained by
+  // can_recv, under rx_lock
+  std::vector<uint32_t> rx_pending;
+  std::vector<RxMark> rx_pending_marks;
+  uint64_t rx_pending_time; // arrival of the oldest pending data
+  volatile bool rx_lost;
+
+  // only used by can_recv_thread, swapped with the pending ones
+  std::vector<uint32_t> rx_data;
+  std::vector<RxMark> rx_marks;
+  // busTime to nanos_since_boot, returned frames share their bus' clock
+  BusClock bus_clocks[4];
+
+  // frames for this panda from can_send, drained by its send thread. at
+  // most MAX_TX_PENDING, a lost panda doesn't collect a backlog
+  pthread_mutex_t tx_lock;
+  pthread_cond_t tx_cond; // CLOCK_MONOTONIC
+  std::vector<TxFrame> tx_pending;
+  // only used by its send thread
+  std::vector<TxFrame> tx_queue;
+  std::vector<uint32_t> tx_data;
+};
+
+std::vector<Panda*> pandas;
+Panda *main_panda = NULL;
+
+// wakes can_recv when any panda has data, guards every rx_pending
+pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rx_cond; // CLOCK_MONOTONIC, set up in main
+
+// BOARDD_RX_EVENT publishes as soon as a transfer completes instead of at
+// 100hz, BOARDD_RX_COALESCE_US then waits that long for more data first
+bool rx_event_driven = false;
+uint64_t rx_coalesce_ns = 0;
+
+// under rx_lock
+struct RxStats {
+  uint64_t overflows;
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t publishes;
+  uint64_t frames;
+  uint64_t latency_sum_ns; // oldest data arrival to publish
+  uint64_t latency_max_ns;
+} rx_stats = {0};
+
+// published as canStats by can_recv_thread
+CanStats can_stats;
 
 bool spoofing_started = false;
 bool fake_send = false;
@@ -64,12 +164,68 @@ cereal::HealthData::HwType hw_type = cereal::HealthData::HwType::UNKNOWN;
 bool is_pigeon = false;
 
 pthread_t safety_setter_thread_handle = -1;
+// the car's safety model once the safety setter has it, pandas besides the
+// main one get it when they connect and don't output before. the setting in
+// the high half and the param in the low one, so they're read together
+std::atomic<uint64_t> car_safety((uint64_t)SAFETY_NOOUTPUT << 32);
 pthread_t pigeon_thread_handle = -1;
 bool pigeon_needs_init;
 
 void pigeon_init();
 void *pigeon_thread(void *crap);
 
+// CLOCK_MONOTONIC condvars
+void cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// waits on cond until deadline in nanos_since_boot time, with lock held
+void cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline) {
+  uint64_t now = nanos_since_boot();
+  if (deadline <= now) return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t t = ts.tv_sec * 1000000000ULL + ts.tv_nsec + (deadline - now);
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  pthread_cond_timedwait(cond, lock, &ts);
+}
+
+Panda::Panda(int index, PandaTransport *transport)
+  : index(index), bus_offset(index * PANDA_BUS_OFFSET), transport(transport),
+    connected(false), rx_pending_time(0), rx_lost(false) {
+  pthread_rwlock_init(&usb_lock, NULL);
+  pthread_mutex_init(&tx_lock, NULL);
+  cond_init(&tx_cond);
+}
+
+int usb_control_transfer(Panda *p, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                         unsigned char *data, uint16_t length) {
+  pthread_rwlock_rdlock(&p->usb_lock);
+  int err = p->transport->control_transfer(request_type, request, value, index, data, length, TIMEOUT);
+  pthread_rwlock_unlock(&p->usb_lock);
+  return err;
+}
+
+int usb_bulk_transfer(Panda *p, unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+  pthread_rwlock_rdlock(&p->usb_lock);
+  int err = p->transport->bulk_transfer(endpoint, data, length, transferred, TIMEOUT);
+  pthread_rwlock_unlock(&p->usb_lock);
+  return err;
+}
+
+void set_safety(PandaTransport *panda, int setting, int param) {
+  // set if long_control is allowed by openpilot. Hardcoded to True for now
+  panda->control_transfer(0x40, 0xdf, 1, 0, NULL, 0, TIMEOUT);
+
+  panda->control_transfer(0x40, 0xdc, setting, param, NULL, 0, TIMEOUT);
+}
+
 void *safety_setter_thread(void *s) {
   char *value_vin;
   size_t value_vin_sz = 0;
@@ -87,12 +243,8 @@ void *safety_setter_thread(void *s) {
   }
   LOGW("got CarVin %s", value_vin);
 
-  pthread_mutex_lock(&usb_lock);
-
   // VIN qury done, stop listening to OBDII
-  libusb_control_transfer(dev_handle, 0x40, 0xdc, SAFETY_NOOUTPUT, 0, NULL, 0, TIMEOUT);
-
-  pthread_mutex_unlock(&usb_lock);
+  usb_control_transfer(main_panda, 0x40, 0xdc, SAFETY_NOOUTPUT, 0, NULL, 0);
 
   char *value;
   size_t value_sz = 0;
@@ -161,58 +313,77 @@ void *safety_setter_thread(void *s) {
     LOGE("unknown safety model: %d", safety_model);
   }
 
-  pthread_mutex_lock(&usb_lock);
+  pthread_rwlock_rdlock(&main_panda->usb_lock);
 
-  // set in the mutex to avoid race
+  // set in the lock to avoid racing a reconnect
   safety_setter_thread_handle = -1;
 
-  // set if long_control is allowed by openpilot. Hardcoded to True for now
-  libusb_control_transfer(dev_handle, 0x40, 0xdf, 1, 0, NULL, 0, TIMEOUT);
+  set_safety(main_panda->transport, safety_setting, safety_param);
 
-  libusb_control_transfer(dev_handle, 0x40, 0xdc, safety_setting, safety_param, NULL, 0, TIMEOUT);
+  pthread_rwlock_unlock(&main_panda->usb_lock);
 
-  pthread_mutex_unlock(&usb_lock);
+  // set before taking their locks, a panda that isn't connected yet or
+  // reconnects later picks it up itself
+  car_safety = ((uint64_t)(uint32_t)safety_setting << 32) | (uint32_t)safety_param;
+  for (Panda *p : pandas) {
+    if (p == main_panda) continue;
+    pthread_rwlock_rdlock(&p->usb_lock);
+    if (p->connected) {
+      set_safety(p->transport, safety_setting, safety_param);
+    }
+    pthread_rwlock_unlock(&p->usb_lock);
+  }
 
   return NULL;
 }
 
-// must be called before threads or with mutex
-bool usb_connect() {
-  int err;
-  unsigned char hw_query[1] = {0};
+// called on the panda's usb event thread for every bulk IN transfer with
+// can data, user is the Panda
+void can_recv_callback(void *user, const uint8_t *data, int len, int err) {
+  Panda *p = (Panda*)user;
 
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
-  if (dev_handle == NULL) { goto fail; }
+  if (err == LIBUSB_ERROR_OVERFLOW) { LOGE_100("overflow got 0x%x on panda %d", len, p->index); }
 
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
+  if (err == LIBUSB_ERROR_OVERFLOW) { can_stats.usb_overflows++; }
 
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
-
-  if (loopback_can) {
-    libusb_control_transfer(dev_handle, 0xc0, 0xe5, 1, 0, NULL, 0, TIMEOUT);
+  pthread_mutex_lock(&rx_lock);
+  if (err == LIBUSB_ERROR_OVERFLOW) { rx_stats.overflows++; }
+  if (err == LIBUSB_ERROR_NO_DEVICE) { p->rx_lost = true; }
+  if (len > 0) {
+    const uint64_t now = nanos_since_boot();
+    if (p->rx_pending.empty()) {
+      p->rx_pending_time = now;
+    }
+    p->rx_pending_marks.push_back((RxMark){p->rx_pending.size(), now});
+    p->rx_pending.insert(p->rx_pending.end(), (const uint32_t*)data, (const uint32_t*)(data + len));
+    rx_stats.transfers++;
+    rx_stats.bytes += len;
   }
+  pthread_cond_signal(&rx_cond);
+  pthread_mutex_unlock(&rx_lock);
+}
 
-  // power off ESP
-  libusb_control_transfer(dev_handle, 0xc0, 0xd9, 0, 0, NULL, 0, TIMEOUT);
+// charging, safety and gps, only the main panda does these
+void main_panda_setup(PandaTransport *panda) {
+  int err;
+  unsigned char hw_query[1] = {0};
 
   // power on charging (may trigger a reconnection, should be okay)
   #ifndef __x86_64__
-    libusb_control_transfer(dev_handle, 0xc0, 0xe6, 1, 0, NULL, 0, TIMEOUT);
+    panda->control_transfer(0xc0, 0xe6, 1, 0, NULL, 0, TIMEOUT);
   #else
     LOGW("not enabling charging on x86_64");
   #endif
 
   // diagnostic only is the default, needed for VIN query
-  libusb_control_transfer(dev_handle, 0x40, 0xdc, SAFETY_ELM327, 0, NULL, 0, TIMEOUT);
+  panda->control_transfer(0x40, 0xdc, SAFETY_ELM327, 0, NULL, 0, TIMEOUT);
 
   if (safety_setter_thread_handle == -1) {
     err = pthread_create(&safety_setter_thread_handle, NULL, safety_setter_thread, NULL);
     assert(err == 0);
   }
 
-  libusb_control_transfer(dev_handle, 0xc0, 0xc1, 0, 0, hw_query, 1, TIMEOUT);
+  panda->control_transfer(0xc0, 0xc1, 0, 0, hw_query, 1, TIMEOUT);
 
   hw_type = (cereal::HealthData::HwType)(hw_query[0]);
   is_pigeon = (hw_type == cereal::HealthData::HwType::GREY_PANDA) || (hw_type == cereal::HealthData::HwType::BLACK_PANDA);
@@ -224,85 +395,188 @@ bool usb_connect() {
       assert(err == 0);
     }
   }
+}
+
+// with the panda's usb_lock held for writing
+bool usb_connect(Panda *p) {
+  int err;
+  PandaTransport *panda = p->transport;
+
+  if (!panda->open()) { goto fail; }
+
+  if (loopback_can) {
+    panda->control_transfer(0xc0, 0xe5, 1, 0, NULL, 0, TIMEOUT);
+  }
+
+  // power off ESP
+  panda->control_transfer(0xc0, 0xd9, 0, 0, NULL, 0, TIMEOUT);
+
+  if (p == main_panda) {
+    main_panda_setup(panda);
+  } else {
+    const uint64_t safety = car_safety.load();
+    set_safety(panda, (int)(safety >> 32), (int32_t)(safety & 0xFFFFFFFF));
+  }
+
+  // keep the panda drained, can_recv publishes what came in
+  p->rx_lost = false;
+  err = panda->start_can_recv(can_recv_callback, p);
+  if (err != 0) { goto fail; }
 
   return true;
 fail:
+  panda->close();
   return false;
 }
 
-void usb_retry_connect() {
-  LOG("attempting to connect");
-  while (!usb_connect()) { usleep(100*1000); }
-  LOGW("connected to board");
+// usb_lock is only held for writing during each attempt, transfers to the
+// panda fail in between instead of waiting for it to come back
+void usb_retry_connect(Panda *p) {
+  LOG("attempting to connect to panda %d", p->index);
+  while (!do_exit) {
+    pthread_rwlock_wrlock(&p->usb_lock);
+    if (usb_connect(p)) {
+      p->connected = true;
+    }
+    pthread_rwlock_unlock(&p->usb_lock);
+
+    if (p->connected) {
+      LOGW("connected to board %d", p->index);
+      break;
+    }
+    usleep(100*1000);
+  }
 }
 
-void handle_usb_issue(int err, const char func[]) {
+void handle_usb_issue(Panda *p, int err, const char func[]) {
   LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
   if (err == -4) {
-    LOGE("lost connection");
-    usb_retry_connect();
+    LOGE("lost connection to panda %d", p->index);
+
+    // every thread using the panda sees the error, only the first one to
+    // find it gone reconnects and the others wait for it
+    bool lost = false;
+    pthread_rwlock_wrlock(&p->usb_lock);
+    unsigned char hw_query[1] = {0};
+    if (p->connected && p->transport->control_transfer(0xc0, 0xc1, 0, 0, hw_query, 1, TIMEOUT) != 1) {
+      p->connected = false;
+      p->transport->close();
+      lost = true;
+    }
+    pthread_rwlock_unlock(&p->usb_lock);
+
+    if (lost) {
+      usb_retry_connect(p);
+    }
+    while (!p->connected && !do_exit) { usleep(10*1000); }
   }
   // TODO: check other errors, is simply retrying okay?
 }
 
-void can_recv(void *s) {
-  int err;
-  uint32_t data[RECV_SIZE/4];
-  int recv;
-  uint32_t f1, f2;
+// can events, grows to the busiest one so far
+MessageArena can_arena(4096);
 
-  uint64_t start_time = nanos_since_boot();
+// with rx_lock held, arrival of the oldest data any panda has pending or 0
+uint64_t rx_oldest_pending() {
+  uint64_t oldest = 0;
+  for (Panda *p : pandas) {
+    if (!p->rx_pending.empty() && (oldest == 0 || p->rx_pending_time < oldest)) {
+      oldest = p->rx_pending_time;
+    }
+  }
+  return oldest;
+}
 
-  // do recv
-  pthread_mutex_lock(&usb_lock);
+// merges what every panda received since the last call into one can event,
+// a lost panda is reconnected by its own thread
+void can_recv(void *s, ShmRingWriter &ring) {
+  pthread_mutex_lock(&rx_lock);
 
-  do {
-    err = libusb_bulk_transfer(dev_handle, 0x81, (uint8_t*)data, RECV_SIZE, &recv, TIMEOUT);
-    if (err != 0) { handle_usb_issue(err, __func__); }
-    if (err == -8) { LOGE_100("overflow got 0x%x", recv); };
+  if (rx_event_driven) {
+    // wake up now and then to notice do_exit
+    while (rx_oldest_pending() == 0 && !do_exit) {
+      cond_wait_until(&rx_cond, &rx_lock, nanos_since_boot() + 100000000ULL);
+    }
+    if (rx_coalesce_ns > 0 && rx_oldest_pending() != 0) {
+      const uint64_t deadline = rx_oldest_pending() + rx_coalesce_ns;
+      while (!do_exit && nanos_since_boot() < deadline) {
+        cond_wait_until(&rx_cond, &rx_lock, deadline);
+      }
+    }
+  }
 
-    // timeout is okay to exit, recv still happened
-    if (err == -7) { break; }
-  } while(err != 0);
+  // take everything the bulk IN streams received since the last call
+  const uint64_t arrival_time = rx_oldest_pending();
+  size_t num_msg = 0;
+  for (Panda *p : pandas) {
+    p->rx_data.clear();
+    p->rx_marks.clear();
+    p->rx_data.swap(p->rx_pending);
+    p->rx_marks.swap(p->rx_pending_marks);
+    num_msg += p->rx_data.size() / 4;
+  }
 
-  pthread_mutex_unlock(&usb_lock);
+  const uint64_t pub_time = nanos_since_boot();
+  const uint64_t latency = pub_time - arrival_time;
+  if (num_msg > 0) {
+    rx_stats.publishes++;
+    rx_stats.frames += num_msg;
+    rx_stats.latency_sum_ns += latency;
+    rx_stats.latency_max_ns = std::max(rx_stats.latency_max_ns, latency);
+  }
+
+  pthread_mutex_unlock(&rx_lock);
 
   // return if length is 0
-  if (recv <= 0) {
+  if (num_msg == 0) {
     return;
   }
 
-  // create message
-  capnp::MallocMessageBuilder msg;
+  can_stats.add_publish(latency);
+
+  // create message, stamped with when the data came off the bus
+  capnp::MallocMessageBuilder msg(can_arena.segment());
   cereal::Event::Builder event = msg.initRoot<cereal::Event>();
-  event.setLogMonoTime(start_time);
-  size_t num_msg = recv / 0x10;
+  event.setLogMonoTime(arrival_time);
 
   auto canData = event.initCan(num_msg);
 
-  // populate message
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
-    } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
+  // populate message, panda by panda
+  int i = 0;
+  for (Panda *p : pandas) {
+    const uint32_t *data = p->rx_data.data();
+    const int count = p->rx_data.size() / 4;
+
+    size_t mark = 0;
+    for (int j = 0; j < count; j++, i++) {
+      while (mark + 1 < p->rx_marks.size() && p->rx_marks[mark + 1].offset <= j*4) mark++;
+
+      if (data[j*4] & 4) {
+        // extended
+        canData[i].setAddress(data[j*4] >> 3);
+        //printf("got extended: %x\n", data[j*4] >> 3);
+      } else {
+        // normal
+        canData[i].setAddress(data[j*4] >> 21);
+      }
+      const uint16_t bus_time = data[j*4+1] >> 16;
+      const uint8_t src = (data[j*4+1] >> 4) & 0xff;
+      canData[i].setBusTime(bus_time);
+      int len = data[j*4+1]&0xF;
+      canData[i].setDat(kj::arrayPtr((uint8_t*)&data[j*4+2], len));
+      // keeps the returned flag, bus numbers stay below it
+      canData[i].setSrc(src + p->bus_offset);
+      canData[i].setMonoTime(p->bus_clocks[src & 3].update(bus_time, p->rx_marks[mark].time));
+
+      can_stats.add_frame(src + p->bus_offset, len, bus_time, pub_time);
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
   }
 
   // send to can
-  auto words = capnp::messageToFlatArray(msg);
-  auto bytes = words.asBytes();
-  zmq_send(s, bytes.begin(), bytes.size(), 0);
+  can_arena.publish(s, ring, msg);
 }
 
-void can_health(void *s) {
+void can_health(void *s, ShmRingWriter &ring) {
   int cnt;
 
   // copied from board/main.c
@@ -319,16 +593,14 @@ void can_health(void *s) {
   } health;
 
   // recv from board
-  pthread_mutex_lock(&usb_lock);
-
   do {
-    cnt = libusb_control_transfer(dev_handle, 0xc0, 0xd2, 0, 0, (unsigned char*)&health, sizeof(health), TIMEOUT);
+    cnt = usb_control_transfer(main_panda, 0xc0, 0xd2, 0, 0, (unsigned char*)&health, sizeof(health));
     if (cnt != sizeof(health)) {
-      handle_usb_issue(cnt, __func__);
+      handle_usb_issue(main_panda, cnt, __func__);
     }
   } while(cnt != sizeof(health));
 
-  pthread_mutex_unlock(&usb_lock);
+  can_stats.panda_can_send_errs[main_panda->index] = health.can_send_errs;
 
   // create message
   capnp::MallocMessageBuilder msg;
@@ -355,77 +627,128 @@ void can_health(void *s) {
   // send to health
   auto words = capnp::messageToFlatArray(msg);
   auto bytes = words.asBytes();
+  if (ring.is_open()) ring.write(bytes.begin(), bytes.size());
   zmq_send(s, bytes.begin(), bytes.size(), 0);
 
-  pthread_mutex_lock(&usb_lock);
-
   // send heartbeat back to panda
-  libusb_control_transfer(dev_handle, 0x40, 0xf3, 1, 0, NULL, 0, TIMEOUT);
+  usb_control_transfer(main_panda, 0x40, 0xf3, 1, 0, NULL, 0);
+
+  // the others only count rx drops, their own threads reconnect them
+  for (Panda *p : pandas) {
+    if (p == main_panda || !p->connected) continue;
 
-  pthread_mutex_unlock(&usb_lock);
+    cnt = usb_control_transfer(p, 0xc0, 0xd2, 0, 0, (unsigned char*)&health, sizeof(health));
+    if (cnt == sizeof(health)) {
+      can_stats.panda_can_send_errs[p->index] = health.can_send_errs;
+    }
+    usb_control_transfer(p, 0x40, 0xf3, 1, 0, NULL, 0);
+  }
 }
 
 
-void can_send(void *s) {
-  int err;
+// panda usb wire format, 16 bytes per frame:
+// word 0: address << 21 | 1 (standard) or address << 3 | 5 (extended)
+// word 1: len | bus << 4
+// words 2-3: data, zero padded
+inline void can_frame_encode(uint32_t *out, uint32_t address, const uint8_t *dat, size_t len, uint8_t bus) {
+  out[0] = address >= 0x800 ? (address << 3) | 5 : (address << 21) | 1;
+  out[1] = len | (bus << 4);
+  out[2] = 0;
+  out[3] = 0;
+  memcpy(&out[2], dat, len);
+}
 
-  // recv from sendcan
+// only used by can_send_thread
+AlignedBuffer can_send_buf;
+SendScheduler send_scheduler;
+// send order of every panda's frames and their deadlines, only grow so
+// steady state sends don't allocate
+std::vector<uint32_t> can_send_frames;
+std::vector<uint64_t> can_send_deadlines;
+
+struct TxStats {
+  uint64_t events;
+  uint64_t frames;
+  uint64_t stale; // frames dropped for missing their deadline
+  uint64_t overflows; // frames dropped from a full panda send queue
+} tx_stats = {0};
+
+// from every panda's send thread
+std::atomic<uint64_t> tx_usb_errors(0);
+// frames that missed their deadline in a panda's send queue
+std::atomic<uint64_t> tx_expired(0);
+
+// queues the frames of one sendcan event, false if there was none
+bool can_send_queue(void *s, int flags) {
   zmq_msg_t msg;
   zmq_msg_init(&msg);
-  err = zmq_msg_recv(&msg, s, 0);
-  assert(err >= 0);
-
-  // format for board, make copy due to alignment issues, will be freed on out of scope
-  auto amsg = kj::heapArray<capnp::word>((zmq_msg_size(&msg) / sizeof(capnp::word)) + 1);
-  memcpy(amsg.begin(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-
-  capnp::FlatArrayMessageReader cmsg(amsg);
-  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-  if (nanos_since_boot() - event.getLogMonoTime() > 1e9) {
-    //Older than 1 second. Dont send.
+  int err = zmq_msg_recv(&msg, s, flags);
+  if (err < 0) {
     zmq_msg_close(&msg);
-    return;
+    return false;
   }
-  int msg_count = event.getCan().size();
 
-  uint32_t *send = (uint32_t*)malloc(msg_count*0x10);
-  memset(send, 0, msg_count*0x10);
+  // read in place, copies only if the zmq buffer is misaligned
+  capnp::FlatArrayMessageReader cmsg(can_send_buf.align(zmq_msg_data(&msg), zmq_msg_size(&msg)));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+  const uint64_t created = event.getLogMonoTime();
+  auto sendcan = event.getSendcan();
+  int msg_count = sendcan.size();
 
-  printf("---------------Giden Adresler!--------------------\n");
   for (int i = 0; i < msg_count; i++) {
-    auto cmsg = event.getSendcan()[i];
-    printf("%d\n",cmsg.getAddress());
-    if (cmsg.getAddress() >= 0x800) {
-      // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
-    } else {
-      // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
-    }
-    assert(cmsg.getDat().size() <= 8);
-    send[i*4+1] = cmsg.getDat().size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], cmsg.getDat().begin(), cmsg.getDat().size());
+    auto cmsg = sendcan[i];
+    auto dat = cmsg.getDat();
+    assert(dat.size() <= 8);
+    uint32_t frame[4];
+    can_frame_encode(frame, cmsg.getAddress(), dat.begin(), dat.size(), cmsg.getSrc());
+    send_scheduler.push(cmsg.getAddress(), frame, created);
   }
-  printf("-----------------------------------\n");
 
   // release msg
   zmq_msg_close(&msg);
 
-  // send to board
-  int sent;
-  pthread_mutex_lock(&usb_lock);
+  tx_stats.events++;
+  tx_stats.frames += msg_count;
+  return true;
+}
 
-  if (!fake_send) {
-    do {
-      err = libusb_bulk_transfer(dev_handle, 3, (uint8_t*)send, msg_count*0x10, &sent, TIMEOUT);
-      if (err != 0 || msg_count*0x10 != sent) { handle_usb_issue(err, __func__); }
-    } while(err != 0);
+void can_send(void *s) {
+  // wait for an event, then merge everything else that queued up meanwhile
+  if (!can_send_queue(s, 0)) {
+    return;
+  }
+  while (can_send_queue(s, ZMQ_DONTWAIT)) {}
+
+  can_send_frames.clear();
+  can_send_deadlines.clear();
+  tx_stats.stale += send_scheduler.pop_all(can_send_frames, nanos_since_boot(), &can_send_deadlines);
+
+  // hand every panda the frames for its buses, in send order. frames for
+  // buses no panda has are dropped, like a panda drops them
+  for (Panda *p : pandas) {
+    pthread_mutex_lock(&p->tx_lock);
+    const size_t queued = p->tx_pending.size();
+    for (size_t i = 0; i < can_send_frames.size(); i += 4) {
+      const uint32_t *frame = &can_send_frames[i];
+      const uint8_t bus = (frame[1] >> 4) & 0xff;
+      if (bus / PANDA_BUS_OFFSET != p->index) continue;
+
+      TxFrame tx;
+      memcpy(tx.frame, frame, sizeof(tx.frame));
+      tx.frame[1] = (frame[1] & 0xF) | ((bus - p->bus_offset) << 4);
+      tx.deadline = can_send_deadlines[i / 4];
+      p->tx_pending.push_back(tx);
+    }
+    if (p->tx_pending.size() > MAX_TX_PENDING) {
+      const size_t drop = p->tx_pending.size() - MAX_TX_PENDING;
+      p->tx_pending.erase(p->tx_pending.begin(), p->tx_pending.begin() + drop);
+      tx_stats.overflows += drop;
+    }
+    if (p->tx_pending.size() > queued) {
+      pthread_cond_signal(&p->tx_cond);
+    }
+    pthread_mutex_unlock(&p->tx_lock);
   }
-
-  pthread_mutex_unlock(&usb_lock);
-
-  // done
-  free(send);
 }
 
 // **** threads ****
@@ -446,8 +769,88 @@ void *can_send_thread(void *crap) {
   }
 
   // run as fast as messages come in
+  uint64_t next_stats_time = nanos_since_boot() + STATS_INTERVAL_NS;
   while (!do_exit) {
     can_send(subscriber);
+
+    uint64_t cur_time = nanos_since_boot();
+    if (cur_time >= next_stats_time) {
+      LOG("can send: %llu events %llu frames %llu stale %llu expired %llu overflows %llu usb errors",
+          (unsigned long long)tx_stats.events, (unsigned long long)tx_stats.frames,
+          (unsigned long long)tx_stats.stale, (unsigned long long)tx_expired.exchange(0),
+          (unsigned long long)tx_stats.overflows, (unsigned long long)tx_usb_errors.exchange(0));
+      tx_stats = (TxStats){0};
+      next_stats_time = cur_time + STATS_INTERVAL_NS;
+    }
+  }
+  return NULL;
+}
+
+// sends what can_send queued for one panda
+void *panda_send_thread(void *arg) {
+  Panda *p = (Panda*)arg;
+  int err, sent;
+
+  while (!do_exit) {
+    pthread_mutex_lock(&p->tx_lock);
+    // wake up now and then to notice do_exit
+    while (p->tx_pending.empty() && !do_exit) {
+      cond_wait_until(&p->tx_cond, &p->tx_lock, nanos_since_boot() + 100000000ULL);
+    }
+    p->tx_queue.clear();
+    p->tx_queue.swap(p->tx_pending);
+    pthread_mutex_unlock(&p->tx_lock);
+
+    if (fake_send) continue;
+
+    // send to board, what missed its deadline meanwhile, like while the
+    // panda was being reconnected, isn't sent anymore
+    do {
+      const uint64_t now = nanos_since_boot();
+      auto expired = std::remove_if(p->tx_queue.begin(), p->tx_queue.end(),
+                                    [now](const TxFrame &tx) { return tx.deadline < now; });
+      tx_expired += p->tx_queue.end() - expired;
+      p->tx_queue.erase(expired, p->tx_queue.end());
+      if (p->tx_queue.empty()) break;
+
+      // held until the panda is back or they expire
+      if (!p->connected) {
+        usleep(10*1000);
+        err = LIBUSB_ERROR_NO_DEVICE;
+        continue;
+      }
+
+      p->tx_data.clear();
+      for (const TxFrame &tx : p->tx_queue) {
+        p->tx_data.insert(p->tx_data.end(), tx.frame, tx.frame + 4);
+      }
+
+      const int size = p->tx_data.size() * sizeof(uint32_t);
+      err = usb_bulk_transfer(p, 3, (uint8_t*)p->tx_data.data(), size, &sent);
+      if (err != 0 || size != sent) {
+        tx_usb_errors++;
+        handle_usb_issue(p, err, __func__);
+      }
+    } while(err != 0 && !do_exit);
+  }
+  return NULL;
+}
+
+// connects a panda other than the main one, which is connected before any
+// thread starts, and reconnects when its bulk IN stream loses it. the
+// stream itself runs on the panda's usb event thread
+void *panda_connect_thread(void *arg) {
+  Panda *p = (Panda*)arg;
+
+  if (p != main_panda) {
+    usb_retry_connect(p);
+  }
+
+  while (!do_exit) {
+    if (p->rx_lost) {
+      handle_usb_issue(p, LIBUSB_ERROR_NO_DEVICE, __func__);
+    }
+    usleep(10*1000);
   }
   return NULL;
 }
@@ -460,14 +863,56 @@ void *can_recv_thread(void *crap) {
   void *publisher = zmq_socket(context, ZMQ_PUB);
   zmq_bind(publisher, "tcp://*:8006");
 
-  // run at 100hz
+  // canStats = 8072
+  void *stats_publisher = zmq_socket(context, ZMQ_PUB);
+  zmq_bind(stats_publisher, "tcp://*:8072");
+
+  // loggerd reads these from shared memory when it can
+  ShmRingWriter can_ring, stats_ring;
+  can_ring.open("can");
+  stats_ring.open("canStats", 64*1024);
+
+  // run at 100hz, unless publishing as data arrives
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
+  uint64_t next_stats_time = nanos_since_boot() + STATS_INTERVAL_NS;
+  uint64_t next_can_stats_time = nanos_since_boot() + CAN_STATS_INTERVAL_NS;
 
   while (!do_exit) {
-    can_recv(publisher);
+    can_recv(publisher, can_ring);
 
     uint64_t cur_time = nanos_since_boot();
+    if (cur_time >= next_can_stats_time) {
+      capnp::MallocMessageBuilder msg;
+      cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+      event.setLogMonoTime(cur_time);
+      can_stats.build(event.initCanStats(), cur_time);
+
+      auto words = capnp::messageToFlatArray(msg);
+      auto bytes = words.asBytes();
+      if (stats_ring.is_open()) stats_ring.write(bytes.begin(), bytes.size());
+      zmq_send(stats_publisher, bytes.begin(), bytes.size(), 0);
+      next_can_stats_time = cur_time + CAN_STATS_INTERVAL_NS;
+    }
+
+    if (cur_time >= next_stats_time) {
+      pthread_mutex_lock(&rx_lock);
+      RxStats stats = rx_stats;
+      rx_stats = (RxStats){0};
+      pthread_mutex_unlock(&rx_lock);
+
+      LOG("can recv: %llu publishes %llu frames %llu transfers %llu bytes %llu overflows, "
+          "latency avg %.3f ms max %.3f ms",
+          (unsigned long long)stats.publishes, (unsigned long long)stats.frames,
+          (unsigned long long)stats.transfers, (unsigned long long)stats.bytes,
+          (unsigned long long)stats.overflows,
+          stats.publishes > 0 ? stats.latency_sum_ns / 1e6 / stats.publishes : 0.0,
+          stats.latency_max_ns / 1e6);
+      next_stats_time = cur_time + STATS_INTERVAL_NS;
+    }
+
+    if (rx_event_driven) continue;
+
     int64_t remaining = next_frame_time - cur_time;
     if (remaining > 0){
       useconds_t sleep = remaining / 1000;
@@ -490,9 +935,12 @@ void *can_health_thread(void *crap) {
   void *publisher = zmq_socket(context, ZMQ_PUB);
   zmq_bind(publisher, "tcp://*:8011");
 
+  ShmRingWriter ring;
+  ring.open("health", 64*1024);
+
   // run at 2hz
   while (!do_exit) {
-    can_health(publisher);
+    can_health(publisher, ring);
     usleep(500*1000);
   }
   return NULL;
@@ -516,31 +964,25 @@ void _pigeon_send(const char *dat, int len) {
   for (int i=0; i<len; i+=0x20) {
     int ll = std::min(0x20, len-i);
     memcpy(&a[1], &dat[i], ll);
-    pthread_mutex_lock(&usb_lock);
-    err = libusb_bulk_transfer(dev_handle, 2, a, ll+1, &sent, TIMEOUT);
-    if (err < 0) { handle_usb_issue(err, __func__); }
+    err = usb_bulk_transfer(main_panda, 2, a, ll+1, &sent);
+    if (err < 0) { handle_usb_issue(main_panda, err, __func__); }
     /*assert(err == 0);
     assert(sent == ll+1);*/
     //hexdump(a, ll+1);
-    pthread_mutex_unlock(&usb_lock);
   }
 }
 
 void pigeon_set_power(int power) {
-  pthread_mutex_lock(&usb_lock);
-  int err = libusb_control_transfer(dev_handle, 0xc0, 0xd9, power, 0, NULL, 0, TIMEOUT);
-  if (err < 0) { handle_usb_issue(err, __func__); }
-  pthread_mutex_unlock(&usb_lock);
+  int err = usb_control_transfer(main_panda, 0xc0, 0xd9, power, 0, NULL, 0);
+  if (err < 0) { handle_usb_issue(main_panda, err, __func__); }
 }
 
 void pigeon_set_baud(int baud) {
   int err;
-  pthread_mutex_lock(&usb_lock);
-  err = libusb_control_transfer(dev_handle, 0xc0, 0xe2, 1, 0, NULL, 0, TIMEOUT);
-  if (err < 0) { handle_usb_issue(err, __func__); }
-  err = libusb_control_transfer(dev_handle, 0xc0, 0xe4, 1, baud/300, NULL, 0, TIMEOUT);
-  if (err < 0) { handle_usb_issue(err, __func__); }
-  pthread_mutex_unlock(&usb_lock);
+  err = usb_control_transfer(main_panda, 0xc0, 0xe2, 1, 0, NULL, 0);
+  if (err < 0) { handle_usb_issue(main_panda, err, __func__); }
+  err = usb_control_transfer(main_panda, 0xc0, 0xe4, 1, baud/300, NULL, 0);
+  if (err < 0) { handle_usb_issue(main_panda, err, __func__); }
 }
 
 void pigeon_init() {
@@ -620,10 +1062,8 @@ void *pigeon_thread(void *crap) {
     }
     int alen = 0;
     while (alen < 0xfc0) {
-      pthread_mutex_lock(&usb_lock);
-      int len = libusb_control_transfer(dev_handle, 0xc0, 0xe0, 1, 0, dat+alen, 0x40, TIMEOUT);
-      if (len < 0) { handle_usb_issue(len, __func__); }
-      pthread_mutex_unlock(&usb_lock);
+      int len = usb_control_transfer(main_panda, 0xc0, 0xe0, 1, 0, dat+alen, 0x40);
+      if (len < 0) { handle_usb_issue(main_panda, len, __func__); }
       if (len <= 0) break;
 
       //printf("got %d\n", len);
@@ -677,14 +1117,77 @@ int main() {
     loopback_can = true;
   }
 
-  // init libusb
-  err = libusb_init(&ctx);
-  assert(err == 0);
-  libusb_set_debug(ctx, 3);
+  if (getenv("BOARDD_RX_EVENT")) {
+    rx_event_driven = true;
+  }
+
+  // BOARDD_SEND_PRIORITY overrides the send order and deadline of
+  // addresses, see SendScheduler::configure
+  if (getenv("BOARDD_SEND_PRIORITY") && !send_scheduler.configure(getenv("BOARDD_SEND_PRIORITY"))) {
+    LOGE("bad BOARDD_SEND_PRIORITY, using the defaults");
+  }
+
+  if (getenv("BOARDD_RX_COALESCE_US")) {
+    rx_coalesce_ns = strtoull(getenv("BOARDD_RX_COALESCE_US"), NULL, 10) * 1000ULL;
+  }
+
+  cond_init(&rx_cond);
+
+  // BOARDD_SIM replaces the panda with a simulated one carrying synthetic
+  // traffic, BOARDD_SIM_* tune it
+  if (getenv("BOARDD_SIM")) {
+    SimPanda::Config config = {
+      .num_buses = 3,
+      .rate = 1000,
+      .num_addresses = 100,
+      .bitrate = 500000,
+      .usb_bytes_per_sec = 1000000,
+    };
+    if (getenv("BOARDD_SIM_BUSES")) { config.num_buses = std::min(3, atoi(getenv("BOARDD_SIM_BUSES"))); }
+    if (getenv("BOARDD_SIM_RATE")) { config.rate = atof(getenv("BOARDD_SIM_RATE")); }
+    if (getenv("BOARDD_SIM_ADDRESSES")) { config.num_addresses = std::max(1, atoi(getenv("BOARDD_SIM_ADDRESSES"))); }
+    if (getenv("BOARDD_SIM_BITRATE")) { config.bitrate = std::max(1, atoi(getenv("BOARDD_SIM_BITRATE"))); }
+    LOGW("simulating panda: %d buses, %.0f frames/s each", config.num_buses, config.rate);
+    pandas.push_back(new Panda(0, new SimPanda(config)));
+  } else if (getenv("BOARDD_SOCKETCAN")) {
+    // SocketCAN interfaces in bus order, like "can0,can1,can2" for the
+    // panda kernel driver or "vcan0" for testing
+    LOGW("using socketcan: %s", getenv("BOARDD_SOCKETCAN"));
+    pandas.push_back(new Panda(0, new SocketCanTransport(getenv("BOARDD_SOCKETCAN"))));
+  } else if (getenv("BOARDD_PANDAS")) {
+    // usb serials like "serial0,serial1", the first is the main panda
+    for (const std::string &serial : UsbTransport::list_serials()) {
+      LOGW("found panda %s", serial.c_str());
+    }
+
+    std::string serials = getenv("BOARDD_PANDAS");
+    size_t start = 0;
+    while (start <= serials.size() && pandas.size() < MAX_PANDAS) {
+      size_t end = serials.find(',', start);
+      if (end == std::string::npos) end = serials.size();
+      LOGW("using panda %s as %d", serials.substr(start, end - start).c_str(), (int)pandas.size());
+      pandas.push_back(new Panda(pandas.size(), new UsbTransport(serials.substr(start, end - start))));
+      start = end + 1;
+    }
+  } else {
+    pandas.push_back(new Panda(0, new UsbTransport()));
+  }
+  main_panda = pandas[0];
+
+  // connect to the main board, the others connect on their own threads
+  usb_retry_connect(main_panda);
 
-  // connect to the board
-  usb_retry_connect();
+  std::vector<pthread_t> panda_thread_handles;
+  for (Panda *p : pandas) {
+    pthread_t handle;
+    err = pthread_create(&handle, NULL, panda_connect_thread, p);
+    assert(err == 0);
+    panda_thread_handles.push_back(handle);
 
+    err = pthread_create(&handle, NULL, panda_send_thread, p);
+    assert(err == 0);
+    panda_thread_handles.push_back(handle);
+  }
 
   // create threads
   pthread_t can_health_thread_handle;
@@ -713,10 +1216,16 @@ int main() {
   err = pthread_join(can_health_thread_handle, NULL);
   assert(err == 0);
 
-  //while (!do_exit) usleep(1000);
+  for (pthread_t handle : panda_thread_handles) {
+    err = pthread_join(handle, NULL);
+    assert(err == 0);
+  }
 
-  // destruct libusb
+  //while (!do_exit) usleep(1000);
 
-  libusb_close(dev_handle);
-  libusb_exit(ctx);
+  // closes the pandas and libusb
+  for (Panda *p : pandas) {
+    delete p->transport;
+    delete p;
+  }
 }
@@ -5,7 +5,8 @@ from libcpp cimport bool
 
 cdef struct can_frame:
   long address
-  string dat
+  const char* dat
+  size_t dat_len
   long busTime
   long src
 
@@ -14,10 +15,17 @@ cdef extern void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, st
 def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   cdef vector[can_frame] can_list
   cdef can_frame f
+  cdef bytes dat
+  # frames point into dat, keep converted ones alive until the message is built
+  converted = []
   for can_msg in can_msgs:
+    dat = can_msg[2] if type(can_msg[2]) is bytes else bytes(can_msg[2])
+    if dat is not can_msg[2]:
+      converted.append(dat)
     f.address = can_msg[0]
     f.busTime = can_msg[1]
-    f.dat = can_msg[2]
+    f.dat = dat
+    f.dat_len = len(dat)
     f.src = can_msg[3]
     can_list.push_back(f)
   cdef string out
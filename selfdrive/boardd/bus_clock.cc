@@ -0,0 +1,98 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "bus_clock.h"
+
+// how often the fit is re-anchored and the drift updated
+#define WINDOW_NS 1000000000ULL
+#define DRIFT_GAIN 0.1
+#define MAX_DRIFT_PPM 1000.0
+
+// frames a bit older than the newest one seen, like a returned send
+// stamped before a receive that was queued first
+#define MAX_BACKWARDS_TICKS 4096
+
+BusClock::BusClock(int bitrate) : nominal_period_ns(1e9 / bitrate), period_ns(1e9 / bitrate) {}
+
+double BusClock::to_host(int64_t t) const {
+  return anchor_host + (t - anchor_ticks) * period_ns;
+}
+
+int64_t BusClock::unwrap(uint16_t bus_time, uint64_t arrival_ns) {
+  if (!has_ticks) {
+    has_ticks = true;
+    ticks = bus_time;
+    last_arrival = arrival_ns;
+    return ticks;
+  }
+
+  const uint16_t d = bus_time - (uint16_t)ticks;
+
+  // a quiet bus can wrap the counter more than once, count the wraps from
+  // how much host time went by
+  const double elapsed = arrival_ns > last_arrival ? (arrival_ns - last_arrival) / period_ns : 0;
+  const int64_t wraps = std::max(0LL, llround((elapsed - d) / 65536.0));
+  last_arrival = std::max(last_arrival, arrival_ns);
+
+  if (wraps == 0 && (int16_t)d < 0 && (int16_t)d > -MAX_BACKWARDS_TICKS) {
+    return ticks + (int16_t)d;
+  }
+
+  ticks += d + wraps * 65536;
+  return ticks;
+}
+
+uint64_t BusClock::update(uint16_t bus_time, uint64_t arrival_ns) {
+  const int64_t t = unwrap(bus_time, arrival_ns);
+
+  if (!synced) {
+    synced = true;
+    anchor_ticks = t;
+    anchor_host = arrival_ns;
+    window_start = arrival_ns;
+    window_ticks = t;
+  }
+
+  double host = to_host(t);
+  if (host > arrival_ns) {
+    // arrived sooner after the bus than the fit allows, so the fit is late
+    anchor_ticks = t;
+    anchor_host = arrival_ns;
+    host = arrival_ns;
+  }
+
+  // compared against a line that stays put for the whole window, the anchor
+  // can move in the meantime
+  const double window_delay = arrival_ns - window_start - (t - window_ticks) * period_ns;
+  if (!has_window_min || window_delay < window_min_delay) {
+    has_window_min = true;
+    window_min_delay = window_delay;
+    window_min_ticks = t;
+    window_min_host = arrival_ns;
+  }
+
+  if ((int64_t)(arrival_ns - window_start) >= (int64_t)WINDOW_NS) {
+    // the best frames of two windows should have about the same delay, so
+    // the slope between them is the real period. they can end up next to
+    // each other around the window edge, that says nothing about the slope
+    if (has_last_min && (window_min_ticks - last_min_ticks) * period_ns > WINDOW_NS / 2) {
+      const double slope = (double)(int64_t)(window_min_host - last_min_host) / (window_min_ticks - last_min_ticks);
+      period_ns += DRIFT_GAIN * (slope - period_ns);
+      period_ns = std::min(std::max(period_ns, nominal_period_ns * (1 - MAX_DRIFT_PPM * 1e-6)),
+                           nominal_period_ns * (1 + MAX_DRIFT_PPM * 1e-6));
+    }
+    has_last_min = true;
+    last_min_ticks = window_min_ticks;
+    last_min_host = window_min_host;
+
+    anchor_ticks = window_min_ticks;
+    anchor_host = window_min_host;
+
+    window_start = arrival_ns;
+    window_ticks = t;
+    has_window_min = false;
+  }
+
+  return llround(host);
+}
@@ -0,0 +1,54 @@
+#ifndef BOARDD_BUS_CLOCK_H
+#define BOARDD_BUS_CLOCK_H
+
+#include <stdint.h>
+
+// Maps a panda can timestamp (busTime, a 16 bit counter of bit times) to
+// nanos_since_boot. The counter is unwrapped to 64 bits, then fitted as
+// host = anchor_host + (ticks - anchor_ticks) * period.
+//
+// Every frame reaches the host some time after it was on the bus, so the
+// usb arrival time is an upper bound. The frame with the smallest delay in
+// each window anchors the fit, and the slope between successive anchors
+// tracks the drift between the two clocks.
+class BusClock {
+ public:
+  BusClock(int bitrate = 500000);
+
+  // frame with busTime bus_time that came off usb at arrival_ns, returns its
+  // time in nanos_since_boot. The first frame anchors the fit at its arrival,
+  // so until the first window is done results can be late by its usb delay
+  uint64_t update(uint16_t bus_time, uint64_t arrival_ns);
+
+  double drift_ppm() const { return (period_ns / nominal_period_ns - 1.0) * 1e6; }
+
+ private:
+  int64_t unwrap(uint16_t bus_time, uint64_t arrival_ns);
+  double to_host(int64_t ticks) const;
+
+  const double nominal_period_ns;
+  double period_ns;
+
+  bool has_ticks = false;
+  int64_t ticks = 0;
+  uint64_t last_arrival = 0;
+
+  bool synced = false;
+  int64_t anchor_ticks = 0;
+  uint64_t anchor_host = 0;
+
+  // lowest delay frame of the current window
+  uint64_t window_start = 0;
+  int64_t window_ticks = 0;
+  bool has_window_min = false;
+  double window_min_delay = 0;
+  int64_t window_min_ticks = 0;
+  uint64_t window_min_host = 0;
+
+  // lowest delay frame of the previous window
+  bool has_last_min = false;
+  int64_t last_min_ticks = 0;
+  uint64_t last_min_host = 0;
+};
+
+#endif
@@ -2,13 +2,15 @@
 #include <tuple>
 #include <string>
 #include "common/timing.h"
+#include "common/message_arena.h"
 #include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
 #include "cereal/gen/cpp/car.capnp.h"
 
 typedef struct {
 	long address;
-	std::string dat;
+	const char *dat; // points into the caller's bytes
+	size_t dat_len;
 	long busTime;
 	long src;
 } can_frame;
@@ -16,7 +18,10 @@ typedef struct {
 extern "C" {
 
 void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid) {
-  capnp::MallocMessageBuilder msg;
+  // callers hold the GIL, so one arena is enough
+  static MessageArena arena;
+
+  capnp::MallocMessageBuilder msg(arena.segment());
   cereal::Event::Builder event = msg.initRoot<cereal::Event>();
   event.setLogMonoTime(nanos_since_boot());
   event.setValid(valid);
@@ -26,12 +31,10 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
   for (auto it = can_list.begin(); it != can_list.end(); it++, j++) {
     canData[j].setAddress(it->address);
     canData[j].setBusTime(it->busTime);
-    canData[j].setDat(kj::arrayPtr((uint8_t*)it->dat.data(), it->dat.size()));
+    canData[j].setDat(kj::arrayPtr((const uint8_t*)it->dat, it->dat_len));
     canData[j].setSrc(it->src);
   }
-  auto words = capnp::messageToFlatArray(msg);
-  auto bytes = words.asBytes();
-  out.append((const char *)bytes.begin(), bytes.size());
+  arena.append(msg, out);
 }
 
 }
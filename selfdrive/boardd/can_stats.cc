@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "can_stats.h"
+
+CanStats::CanStats() : usb_overflows(0), interval_start(0) {
+  memset(buses, 0, sizeof(buses));
+  memset(usb_hist, 0, sizeof(usb_hist));
+  for (int i = 0; i < CAN_STATS_MAX_PANDAS; i++) {
+    panda_can_send_errs[i] = 0;
+    last_can_send_errs[i] = 0;
+  }
+}
+
+void CanStats::hist_add(uint32_t *hist, uint64_t us) {
+  int i = 0;
+  while (us > 1 && i < CAN_STATS_HIST_SIZE - 1) {
+    us >>= 1;
+    i++;
+  }
+  hist[i]++;
+}
+
+void CanStats::add_frame(uint8_t src, uint8_t len, uint16_t bus_time, uint64_t pub_ns) {
+  Bus &bus = buses[src & (NUM_BUSES - 1)];
+  if (src & 0x80) {
+    bus.returned++;
+    return;
+  }
+
+  bus.frames++;
+  bus.bytes += len;
+
+  // bit times between the frame on the bus and now, modulo the 16 bit timer
+  const uint16_t pub_time = (pub_ns / 1000) * (bitrate / 1000) / 1000;
+  const uint16_t delay = pub_time - bus_time;
+  if (bus.frames == 1 || delay < bus.min_delay) {
+    bus.min_delay = delay;
+  }
+
+  if (bus.has_last_min_delay) {
+    const int16_t latency = delay - bus.last_min_delay;
+    hist_add(bus.latency_hist, latency > 0 ? latency * 1000000ULL / bitrate : 0);
+  }
+}
+
+void CanStats::add_publish(uint64_t latency_ns) {
+  hist_add(usb_hist, latency_ns / 1000);
+}
+
+void CanStats::build(cereal::CanStats::Builder stats, uint64_t now) {
+  const uint64_t interval = interval_start > 0 ? now - interval_start : 0;
+  const double secs = interval > 0 ? interval / 1e9 : 1.0;
+  stats.setIntervalNanos(interval);
+
+  int num_buses = 0;
+  for (int i = 0; i < NUM_BUSES; i++) {
+    num_buses += buses[i].frames > 0 || buses[i].returned > 0;
+  }
+
+  auto stats_buses = stats.initBuses(num_buses);
+  int j = 0;
+  for (int i = 0; i < NUM_BUSES; i++) {
+    Bus &bus = buses[i];
+    if (bus.frames > 0 || bus.returned > 0) {
+      auto b = stats_buses[j++];
+      b.setBus(i);
+      b.setFrames(bus.frames);
+      b.setBytes(bus.bytes);
+      b.setFramesPerSec(bus.frames / secs);
+      b.setBytesPerSec(bus.bytes / secs);
+      b.setReturned(bus.returned);
+      auto hist = b.initBusLatency(CAN_STATS_HIST_SIZE);
+      for (int k = 0; k < CAN_STATS_HIST_SIZE; k++) {
+        hist.set(k, bus.latency_hist[k]);
+      }
+    }
+
+    // the fastest frame of this interval is the baseline for the next
+    const bool seen = bus.frames > 0;
+    const uint16_t min_delay = bus.min_delay;
+    memset(&bus, 0, sizeof(bus));
+    bus.last_min_delay = min_delay;
+    bus.has_last_min_delay = seen;
+  }
+
+  auto hist = stats.initUsbLatency(CAN_STATS_HIST_SIZE);
+  for (int k = 0; k < CAN_STATS_HIST_SIZE; k++) {
+    hist.set(k, usb_hist[k]);
+  }
+  memset(usb_hist, 0, sizeof(usb_hist));
+
+  stats.setUsbOverflows(usb_overflows.exchange(0));
+
+  // a panda's counter starts over when it resets
+  uint32_t rx_drops = 0;
+  for (int i = 0; i < CAN_STATS_MAX_PANDAS; i++) {
+    const uint32_t can_send_errs = panda_can_send_errs[i];
+    rx_drops += can_send_errs >= last_can_send_errs[i] ? can_send_errs - last_can_send_errs[i] : can_send_errs;
+    last_can_send_errs[i] = can_send_errs;
+  }
+  stats.setPandaRxDrops(rx_drops);
+
+  interval_start = now;
+}
@@ -0,0 +1,58 @@
+#ifndef BOARDD_CAN_STATS_H
+#define BOARDD_CAN_STATS_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// log2 microsecond buckets, see CanStats in log.capnp
+#define CAN_STATS_HIST_SIZE 20
+// pandas with 4 buses each
+#define CAN_STATS_MAX_PANDAS 4
+
+// Per bus receive counters for the canStats service. Everything except
+// the atomics is only touched by the thread that publishes can, so the
+// receive path doesn't take any locks.
+class CanStats {
+ public:
+  CanStats();
+
+  // per received frame, pub_ns is when its can event goes out
+  void add_frame(uint8_t src, uint8_t len, uint16_t bus_time, uint64_t pub_ns);
+  // per published can event, oldest usb data to publish
+  void add_publish(uint64_t latency_ns);
+
+  // from other threads
+  std::atomic<uint32_t> usb_overflows;
+  std::atomic<uint32_t> panda_can_send_errs[CAN_STATS_MAX_PANDAS]; // latest from health
+
+  // fills in everything since the last call and starts a new interval
+  void build(cereal::CanStats::Builder stats, uint64_t now);
+
+ private:
+  struct Bus {
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t returned;
+    uint32_t latency_hist[CAN_STATS_HIST_SIZE];
+    // busTime offset of the fastest frame, this and last interval
+    uint16_t min_delay;
+    uint16_t last_min_delay;
+    bool has_last_min_delay;
+  };
+
+  static const int NUM_BUSES = 4 * CAN_STATS_MAX_PANDAS;
+
+  static void hist_add(uint32_t *hist, uint64_t us);
+
+  // busTime counts bit times, every bus runs at the panda's default speed
+  const int bitrate = 500000;
+  uint64_t interval_start;
+  Bus buses[NUM_BUSES];
+  uint32_t usb_hist[CAN_STATS_HIST_SIZE];
+  uint32_t last_can_send_errs[CAN_STATS_MAX_PANDAS];
+};
+
+#endif
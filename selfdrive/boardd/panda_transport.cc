@@ -0,0 +1,129 @@
+#include <assert.h>
+
+#include "panda_transport.h"
+
+// double the FIFO size
+#define RECV_SIZE (0x1000)
+
+// bulk IN transfers kept in flight for can receive, and how long an empty
+// one waits before asking the panda again
+#define RECV_TRANSFERS 4
+#define RECV_IDLE_POLL_US 1000
+// a transfer that overflows doubles its buffer up to this
+#define RECV_MAX_SIZE (0x10000)
+
+#define PANDA_VID 0xbbaa
+#define PANDA_PID 0xddcc
+
+UsbTransport::UsbTransport(const std::string &serial) : serial(serial) {
+  int err = libusb_init(&ctx);
+  assert(err == 0);
+  libusb_set_debug(ctx, 3);
+
+  // all usb traffic completes on the engine's event thread
+  engine = new UsbEngine(ctx);
+  engine->start();
+}
+
+UsbTransport::~UsbTransport() {
+  close();
+  delete engine;
+  libusb_exit(ctx);
+}
+
+std::string UsbTransport::read_serial(libusb_device_handle *handle) {
+  libusb_device_descriptor desc;
+  unsigned char buf[0x40];
+
+  if (libusb_get_device_descriptor(libusb_get_device(handle), &desc) != 0) return "";
+  int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, buf, sizeof(buf));
+  return len > 0 ? std::string((char*)buf, len) : "";
+}
+
+std::vector<std::string> UsbTransport::list_serials() {
+  std::vector<std::string> serials;
+  libusb_context *ctx = NULL;
+  libusb_device **list = NULL;
+
+  if (libusb_init(&ctx) != 0) return serials;
+
+  ssize_t n = libusb_get_device_list(ctx, &list);
+  for (ssize_t i = 0; i < n; i++) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) != 0) continue;
+    if (desc.idVendor != PANDA_VID || desc.idProduct != PANDA_PID) continue;
+
+    libusb_device_handle *handle = NULL;
+    if (libusb_open(list[i], &handle) != 0) continue;
+    serials.push_back(read_serial(handle));
+    libusb_close(handle);
+  }
+
+  if (list) libusb_free_device_list(list, 1);
+  libusb_exit(ctx);
+  return serials;
+}
+
+bool UsbTransport::open() {
+  int err;
+
+  if (serial.empty()) {
+    dev_handle = libusb_open_device_with_vid_pid(ctx, PANDA_VID, PANDA_PID);
+  } else {
+    libusb_device **list = NULL;
+    ssize_t n = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < n && dev_handle == NULL; i++) {
+      libusb_device_descriptor desc;
+      if (libusb_get_device_descriptor(list[i], &desc) != 0) continue;
+      if (desc.idVendor != PANDA_VID || desc.idProduct != PANDA_PID) continue;
+
+      if (libusb_open(list[i], &dev_handle) != 0) {
+        dev_handle = NULL;
+        continue;
+      }
+      if (read_serial(dev_handle) != serial) {
+        libusb_close(dev_handle);
+        dev_handle = NULL;
+      }
+    }
+    if (list) libusb_free_device_list(list, 1);
+  }
+  if (dev_handle == NULL) { goto fail; }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  engine->set_device(dev_handle);
+  return true;
+fail:
+  close();
+  return false;
+}
+
+void UsbTransport::close() {
+  if (dev_handle == NULL) return;
+
+  engine->stop_bulk_in();
+  libusb_close(dev_handle);
+  dev_handle = NULL;
+}
+
+int UsbTransport::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                   unsigned char *data, uint16_t length, unsigned int timeout) {
+  if (dev_handle == NULL) return LIBUSB_ERROR_NO_DEVICE;
+  return engine->control_transfer(request_type, request, value, index, data, length, timeout);
+}
+
+int UsbTransport::bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                                int *transferred, unsigned int timeout) {
+  if (dev_handle == NULL) return LIBUSB_ERROR_NO_DEVICE;
+  return engine->bulk_transfer(endpoint, data, length, transferred, timeout);
+}
+
+int UsbTransport::start_can_recv(RecvCallback cb, void *user) {
+  if (dev_handle == NULL) return LIBUSB_ERROR_NO_DEVICE;
+  return engine->start_bulk_in(0x81, RECV_TRANSFERS, RECV_SIZE, RECV_MAX_SIZE, RECV_IDLE_POLL_US, cb, user);
+}
@@ -0,0 +1,67 @@
+#ifndef BOARDD_PANDA_TRANSPORT_H
+#define BOARDD_PANDA_TRANSPORT_H
+
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include <string>
+#include <vector>
+
+#include "usb_engine.h"
+
+// How boardd reaches a panda. Every transport speaks the panda's usb
+// protocol: the same control requests, bulk endpoints and 16 byte can
+// frames, with libusb return values and error codes.
+class PandaTransport {
+ public:
+  // same contract as UsbEngine::RecvCallback
+  typedef UsbEngine::RecvCallback RecvCallback;
+
+  virtual ~PandaTransport() {}
+
+  // false if there's no panda (yet)
+  virtual bool open() = 0;
+  // stops can receive and releases the panda, transfers fail with
+  // LIBUSB_ERROR_NO_DEVICE until the next open
+  virtual void close() = 0;
+
+  virtual int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                               unsigned char *data, uint16_t length, unsigned int timeout) = 0;
+  virtual int bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                            int *transferred, unsigned int timeout) = 0;
+
+  // streams can frames from endpoint 0x81 to cb until close
+  virtual int start_can_recv(RecvCallback cb, void *user) = 0;
+};
+
+// a panda on usb, all transfers go through a UsbEngine
+class UsbTransport : public PandaTransport {
+ public:
+  // the panda with this usb serial number, any panda if empty
+  UsbTransport(const std::string &serial = "");
+  ~UsbTransport();
+
+  // serial numbers of the pandas plugged in
+  static std::vector<std::string> list_serials();
+
+  bool open();
+  void close();
+
+  int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                    int *transferred, unsigned int timeout);
+
+  int start_can_recv(RecvCallback cb, void *user);
+
+ private:
+  static std::string read_serial(libusb_device_handle *handle);
+
+  const std::string serial;
+  libusb_context *ctx = NULL;
+  libusb_device_handle *dev_handle = NULL;
+  UsbEngine *engine = NULL;
+};
+
+#endif
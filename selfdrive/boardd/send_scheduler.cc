@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "send_scheduler.h"
+
+// controls runs at 100hz, a command this late has long been replaced
+#define CONTROL_DEADLINE_NS 100000000ULL
+// what boardd always allowed before
+#define DEFAULT_DEADLINE_NS 1000000000ULL
+
+namespace {
+
+struct DefaultRule {
+  uint32_t address;
+  int priority;
+  uint64_t deadline_ns;
+};
+
+// commands and HUD messages of the supported cars, from opendbc
+const DefaultRule default_rules[] = {
+  // toyota
+  {0x2e4, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // STEERING_LKA
+  {0x266, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // STEERING_IPAS
+  {0x191, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // STEERING_LTA
+  {0x343, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ACC_CONTROL
+  {0x200, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // GAS_COMMAND
+  {0x411, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // ACC_HUD
+  {0x412, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // LKAS_HUD
+  // honda
+  {0xe4, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS},  // STEERING_CONTROL
+  {0x194, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // STEERING_CONTROL
+  {0x1fa, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // BRAKE_COMMAND
+  {0x1df, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ACC_CONTROL
+  {0x30c, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // ACC_HUD
+  {0x33d, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // LKAS_HUD
+  {0x39f, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // RADAR_HUD
+  // gm
+  {0x180, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ASCMLKASteeringCmd
+  {0x152, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ASCMLKASteeringCmd
+  {0x2cb, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ASCMGasRegenCmd
+  {0x315, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // EBCMFrictionBrakeCmd
+  {0x370, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // ASCMActiveCruiseControlStatus
+  // hyundai
+  {0x340, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // LKAS11
+  // chrysler
+  {0x292, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // LKAS_COMMAND
+  {0x2a6, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // LKAS_HUD
+  // subaru
+  {0x122, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ES_LKAS
+  {0x164, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // ES_LKAS
+  {0x322, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // ES_LKAS_State
+  // ford
+  {0x3ca, SendScheduler::PRIORITY_CONTROL, CONTROL_DEADLINE_NS}, // Lane_Keep_Assist_Control
+  {0x3d8, SendScheduler::PRIORITY_HUD, DEFAULT_DEADLINE_NS},     // Lane_Keep_Assist_Ui
+};
+
+}
+
+SendScheduler::SendScheduler() : default_rule((Rule){PRIORITY_DEFAULT, DEFAULT_DEADLINE_NS}) {
+  for (const DefaultRule &r : default_rules) {
+    rules[r.address] = (Rule){r.priority, r.deadline_ns};
+  }
+}
+
+bool SendScheduler::configure(const char *spec) {
+  std::unordered_map<uint32_t, Rule> parsed;
+
+  const char *p = spec;
+  while (*p) {
+    char *end;
+    const unsigned long address = strtoul(p, &end, 0);
+    if (end == p || *end != ':') return false;
+    p = end + 1;
+
+    const long priority = strtol(p, &end, 10);
+    if (end == p || *end != ':' || priority < 0 || priority >= NUM_PRIORITIES) return false;
+    p = end + 1;
+
+    const unsigned long deadline_ms = strtoul(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0')) return false;
+    p = *end ? end + 1 : end;
+
+    parsed[address] = (Rule){(int)priority, deadline_ms * 1000000ULL};
+  }
+
+  for (const auto &r : parsed) {
+    rules[r.first] = r.second;
+  }
+  return true;
+}
+
+const SendScheduler::Rule &SendScheduler::rule(uint32_t address) const {
+  auto it = rules.find(address);
+  return it != rules.end() ? it->second : default_rule;
+}
+
+void SendScheduler::push(uint32_t address, const uint32_t *frame, uint64_t created) {
+  const Rule &r = rule(address);
+
+  Entry e;
+  e.priority = r.priority;
+  e.deadline = created + r.deadline_ns;
+  e.seq = seq++;
+  memcpy(e.frame, frame, sizeof(e.frame));
+  queue.push_back(e);
+}
+
+size_t SendScheduler::pop_all(std::vector<uint32_t> &out, uint64_t now, std::vector<uint64_t> *deadlines) {
+  std::sort(queue.begin(), queue.end());
+
+  size_t expired = 0;
+  for (const Entry &e : queue) {
+    if (e.deadline < now) {
+      expired++;
+      continue;
+    }
+    out.insert(out.end(), e.frame, e.frame + 4);
+    if (deadlines) deadlines->push_back(e.deadline);
+  }
+
+  // keeps its capacity, steady state sends don't allocate
+  queue.clear();
+  return expired;
+}
@@ -0,0 +1,68 @@
+#ifndef BOARDD_SEND_SCHEDULER_H
+#define BOARDD_SEND_SCHEDULER_H
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Queue for outgoing can frames. Frames from every sendcan event read in
+// one go are merged and sent in priority order, earliest deadline first
+// within a priority, so a steering command doesn't wait in the panda's tx
+// queue behind HUD messages. A frame whose deadline passed before it went
+// out is dropped, the car would only act on a stale command.
+//
+// Only used by can_send_thread.
+class SendScheduler {
+ public:
+  enum Priority {
+    PRIORITY_CONTROL = 0, // steering, brake and gas commands
+    PRIORITY_DEFAULT,
+    PRIORITY_HUD,
+    NUM_PRIORITIES
+  };
+
+  SendScheduler();
+
+  // overrides per address, "address:priority:deadline_ms" separated by
+  // commas. returns false without changing anything on a bad spec
+  bool configure(const char *spec);
+
+  // frame in panda usb format, created is the logMonoTime of its event
+  void push(uint32_t address, const uint32_t *frame, uint64_t created);
+
+  // appends everything still in time to out in send order and empties the
+  // queue, returns how many frames were dropped for missing their deadline.
+  // the deadline of each frame goes to deadlines if given
+  size_t pop_all(std::vector<uint32_t> &out, uint64_t now, std::vector<uint64_t> *deadlines = NULL);
+
+  bool empty() const { return queue.empty(); }
+
+ private:
+  struct Rule {
+    int priority;
+    uint64_t deadline_ns; // after creation
+  };
+
+  struct Entry {
+    int priority;
+    uint64_t deadline;
+    uint64_t seq; // keeps frames of one address in order
+    uint32_t frame[4];
+
+    bool operator<(const Entry &other) const {
+      if (priority != other.priority) return priority < other.priority;
+      if (deadline != other.deadline) return deadline < other.deadline;
+      return seq < other.seq;
+    }
+  };
+
+  const Rule &rule(uint32_t address) const;
+
+  std::unordered_map<uint32_t, Rule> rules;
+  const Rule default_rule;
+  std::vector<Entry> queue;
+  uint64_t seq = 0;
+};
+
+#endif
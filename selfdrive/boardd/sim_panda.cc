@@ -0,0 +1,312 @@
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common/timing.h"
+
+#include "sim_safety.h"
+#include "sim_panda.h"
+
+// queue sizes and flags from panda/board/drivers/can.h
+#define RX_Q_SIZE 0x1000
+#define TX_Q_SIZE 0x100
+#define CAN_BUS_RET_FLAG 0x80U
+#define CAN_BUS_NUM_MASK 0x7FU
+
+// what the panda fills a bulk IN with, boardd asks for this much
+#define RECV_SIZE (0x1000)
+
+#define BUS_TICK_US 100
+
+namespace {
+
+// copied from board/main.c
+struct __attribute__((packed)) health {
+  uint32_t voltage;
+  uint32_t current;
+  uint32_t can_send_errs;
+  uint32_t can_fwd_errs;
+  uint32_t gmlan_send_errs;
+  uint8_t started;
+  uint8_t controls_allowed;
+  uint8_t gas_interceptor_detected;
+  uint8_t car_harness_status_pkt;
+};
+
+}
+
+bool SimPanda::Ring::push(const Frame &f) {
+  uint32_t next_w_ptr = (w_ptr + 1) == elems.size() ? 0 : w_ptr + 1;
+  if (next_w_ptr == r_ptr) return false;
+  elems[w_ptr] = f;
+  w_ptr = next_w_ptr;
+  return true;
+}
+
+bool SimPanda::Ring::pop(Frame &f) {
+  if (w_ptr == r_ptr) return false;
+  f = elems[r_ptr];
+  r_ptr = (r_ptr + 1) == elems.size() ? 0 : r_ptr + 1;
+  return true;
+}
+
+SimPanda::SimPanda(const Config &config) : config(config), rx_q(RX_Q_SIZE), tx_q(3, Ring(TX_Q_SIZE)) {
+  assert(config.num_buses <= 3);
+  assert(config.bitrate > 0 && config.usb_bytes_per_sec > 0);
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&rx_cond, NULL);
+
+  const uint64_t now = nanos_since_boot();
+  for (auto &bus : buses) {
+    bus = (Bus){ .busy_until = now, .next_gen = now, .seq = 0 };
+  }
+
+  sim_safety_set_mode(0, 0);
+
+  int err = pthread_create(&bus_thread_handle, NULL, bus_thread, this);
+  assert(err == 0);
+}
+
+SimPanda::~SimPanda() {
+  close();
+  running = false;
+  pthread_join(bus_thread_handle, NULL);
+}
+
+bool SimPanda::open() {
+  pthread_mutex_lock(&lock);
+  is_open = true;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+void SimPanda::close() {
+  stop_can_recv();
+  pthread_mutex_lock(&lock);
+  is_open = false;
+  pthread_mutex_unlock(&lock);
+}
+
+// the panda's can timestamps count bit times
+uint32_t SimPanda::bus_ticks(uint64_t ns) const {
+  return ((ns / 1000) * (config.bitrate / 1000) / 1000) & 0xFFFF;
+}
+
+// 11 bit id frame without stuff bits, 29 bit ids take 20 more
+uint64_t SimPanda::frame_ns(const Frame &f) const {
+  const int bits = ((f.w[0] & 4) ? 67 : 47) + 8 * (f.w[1] & 0xF);
+  return bits * 1000000000ULL / config.bitrate;
+}
+
+// can_rx in board/drivers/can.h, called with lock held
+void SimPanda::receive(const Frame &f, int bus_num, uint64_t now) {
+  sim_safety_set_timer(now / 1000);
+
+  int bus_fwd = sim_safety_fwd(bus_num, f.w);
+  if (bus_fwd >= 0 && bus_fwd < (int)tx_q.size()) {
+    Frame fwd = f;
+    fwd.w[1] &= 0xF;
+    can_fwd_errs += !tx_q[bus_fwd].push(fwd);
+  }
+
+  sim_safety_rx(f.w);
+  can_send_errs += !rx_q.push(f);
+}
+
+// puts frames on the bus while it's free, queued sends go first
+void SimPanda::step_bus(int bus_num, uint64_t now) {
+  Bus &bus = buses[bus_num];
+
+  // busy_until is when the bus is next free
+  while (bus.busy_until <= now) {
+    Frame f;
+
+    if (tx_q[bus_num].pop(f)) {
+      const uint64_t start = bus.busy_until;
+      const uint32_t bus_time = bus_ticks(start);
+      bus.busy_until = start + frame_ns(f);
+
+      // sends come back marked as returned, and again as received on loopback
+      Frame ret = f;
+      ret.w[1] = (f.w[1] & 0xF) | (bus_time << 16) | ((CAN_BUS_RET_FLAG | bus_num) << 4);
+      can_send_errs += !rx_q.push(ret);
+      if (loopback) {
+        Frame rx = f;
+        rx.w[1] = (f.w[1] & 0xF) | (bus_time << 16) | (bus_num << 4);
+        receive(rx, bus_num, start);
+      }
+    } else if (bus_num < config.num_buses && config.rate > 0 && bus.next_gen <= now) {
+      // traffic beyond what the bus can carry queues up back to back
+      const uint64_t start = std::max(bus.busy_until, bus.next_gen);
+      const uint32_t bus_time = bus_ticks(start);
+      const uint32_t address = 0x100 + bus.seq % config.num_addresses;
+      f.w[0] = address << 21;
+      f.w[1] = 8 | (bus_time << 16) | (bus_num << 4);
+      f.w[2] = bus.seq;
+      f.w[3] = ~bus.seq;
+      bus.seq++;
+
+      bus.busy_until = start + frame_ns(f);
+      bus.next_gen += 1e9 / config.rate;
+      receive(f, bus_num, start);
+    } else {
+      // idle until the next tick
+      bus.busy_until = now + 1;
+    }
+  }
+}
+
+void *SimPanda::bus_thread(void *arg) {
+  SimPanda *panda = (SimPanda*)arg;
+
+  while (panda->running) {
+    const uint64_t now = nanos_since_boot();
+
+    pthread_mutex_lock(&panda->lock);
+    for (int i = 0; i < (int)panda->tx_q.size(); i++) {
+      panda->step_bus(i, now);
+    }
+    if (!panda->rx_q.empty()) {
+      pthread_cond_signal(&panda->rx_cond);
+    }
+    pthread_mutex_unlock(&panda->lock);
+
+    usleep(BUS_TICK_US);
+  }
+  return NULL;
+}
+
+// the usb side of the bulk IN stream, like usb_cb_ep1_in in board/main.c
+void *SimPanda::recv_thread(void *arg) {
+  SimPanda *panda = (SimPanda*)arg;
+  std::vector<Frame> buf(RECV_SIZE / sizeof(Frame));
+
+  while (panda->recv_running) {
+    size_t n = 0;
+
+    pthread_mutex_lock(&panda->lock);
+    while (panda->recv_running && panda->rx_q.empty()) {
+      pthread_cond_wait(&panda->rx_cond, &panda->lock);
+    }
+    while (n < buf.size() && panda->rx_q.pop(buf[n])) {
+      n++;
+    }
+    pthread_mutex_unlock(&panda->lock);
+
+    if (n == 0) continue;
+
+    const int len = n * sizeof(Frame);
+    usleep(len * 1000000ULL / panda->config.usb_bytes_per_sec);
+    panda->recv_cb(panda->recv_user, (const uint8_t*)buf.data(), len, 0);
+  }
+  return NULL;
+}
+
+int SimPanda::start_can_recv(RecvCallback cb, void *user) {
+  if (!is_open) return LIBUSB_ERROR_NO_DEVICE;
+  assert(!recv_running);
+
+  recv_cb = cb;
+  recv_user = user;
+  recv_running = true;
+  return pthread_create(&recv_thread_handle, NULL, recv_thread, this) == 0 ? 0 : LIBUSB_ERROR_OTHER;
+}
+
+void SimPanda::stop_can_recv() {
+  if (!recv_running) return;
+
+  pthread_mutex_lock(&lock);
+  recv_running = false;
+  pthread_cond_broadcast(&rx_cond);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(recv_thread_handle, NULL);
+}
+
+int SimPanda::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                               unsigned char *data, uint16_t length, unsigned int timeout) {
+  int ret = 0;
+
+  pthread_mutex_lock(&lock);
+  if (!is_open) {
+    pthread_mutex_unlock(&lock);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  switch (request) {
+  // hw type, always a white panda so boardd doesn't look for a gps
+  case 0xc1:
+    if (length >= 1) {
+      data[0] = 1;
+      ret = 1;
+    }
+    break;
+  // health
+  case 0xd2: {
+    struct health h = {
+      .voltage = 12000,
+      .current = 0,
+      .can_send_errs = can_send_errs,
+      .can_fwd_errs = can_fwd_errs,
+      .gmlan_send_errs = 0,
+      .started = 0,
+      .controls_allowed = sim_safety_controls_allowed(),
+      .gas_interceptor_detected = sim_safety_gas_interceptor_detected(),
+      .car_harness_status_pkt = 0,
+    };
+    ret = std::min((int)sizeof(h), (int)length);
+    memcpy(data, &h, ret);
+    break;
+  }
+  // safety mode
+  case 0xdc:
+    sim_safety_set_mode(value, (int16_t)index);
+    break;
+  // long control allowed
+  case 0xdf:
+    sim_safety_set_long_controls_allowed(value & 1);
+    break;
+  // can loopback
+  case 0xe5:
+    loopback = value != 0;
+    break;
+  // esp power, charging, heartbeat, uart: accepted and ignored
+  default:
+    break;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+int SimPanda::bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                            int *transferred, unsigned int timeout) {
+  pthread_mutex_lock(&lock);
+  if (!is_open) {
+    pthread_mutex_unlock(&lock);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  // can send, usb_cb_ep3_out and can_send in the firmware
+  if (endpoint == 3) {
+    sim_safety_set_timer(nanos_since_boot() / 1000);
+    for (int i = 0; i + (int)sizeof(Frame) <= length; i += sizeof(Frame)) {
+      Frame f;
+      memcpy(f.w, &data[i], sizeof(Frame));
+
+      const uint8_t bus_num = (f.w[1] >> 4) & CAN_BUS_NUM_MASK;
+      if (sim_safety_tx(f.w) != 0 && bus_num < tx_q.size()) {
+        f.w[1] &= 0xF;
+        can_fwd_errs += !tx_q[bus_num].push(f);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  if (transferred) *transferred = length;
+  return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef BOARDD_SIM_PANDA_H
+#define BOARDD_SIM_PANDA_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "panda_transport.h"
+
+// In-process panda for load testing boardd without a car. Models the
+// firmware's rx_q and per bus tx queues (panda/board/drivers/can.h), the
+// time frames take on the bus and over usb, and runs the real safety hooks.
+// Every bus carries synthetic traffic at a configurable rate. Frames that
+// don't fit in a full queue are dropped and counted like on a panda.
+class SimPanda : public PandaTransport {
+ public:
+  struct Config {
+    int num_buses;         // buses with synthetic traffic, at most 3
+    double rate;           // synthetic frames per second on each bus
+    int num_addresses;     // distinct addresses per bus, from 0x100
+    int bitrate;           // bits per second on every bus
+    int usb_bytes_per_sec; // bulk IN bandwidth
+  };
+
+  SimPanda(const Config &config);
+  ~SimPanda();
+
+  bool open();
+  void close();
+
+  int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                    int *transferred, unsigned int timeout);
+
+  int start_can_recv(RecvCallback cb, void *user);
+
+ private:
+  struct Frame {
+    uint32_t w[4]; // RIR, RDTR, RDLR, RDHR
+  };
+
+  // can_ring from the firmware, one slot is always left empty
+  struct Ring {
+    std::vector<Frame> elems;
+    uint32_t w_ptr;
+    uint32_t r_ptr;
+
+    Ring(size_t size) : elems(size), w_ptr(0), r_ptr(0) {}
+    bool push(const Frame &f);
+    bool pop(Frame &f);
+    bool empty() const { return w_ptr == r_ptr; }
+  };
+
+  struct Bus {
+    uint64_t busy_until; // end of the frame on the wire
+    uint64_t next_gen;   // when the next synthetic frame is due
+    uint32_t seq;
+  };
+
+  static void *bus_thread(void *arg);
+  static void *recv_thread(void *arg);
+
+  void step_bus(int bus_num, uint64_t now);
+  void receive(const Frame &f, int bus_num, uint64_t now);
+  uint64_t frame_ns(const Frame &f) const;
+  uint32_t bus_ticks(uint64_t ns) const;
+  void stop_can_recv();
+
+  const Config config;
+
+  // stands in for the firmware's critical sections
+  pthread_mutex_t lock;
+  pthread_cond_t rx_cond;
+
+  Ring rx_q;
+  std::vector<Ring> tx_q;
+  Bus buses[3];
+  bool loopback = false;
+  uint32_t can_send_errs = 0;
+  uint32_t can_fwd_errs = 0;
+
+  bool is_open = false;
+  volatile bool running = true;
+  pthread_t bus_thread_handle;
+
+  volatile bool recv_running = false;
+  pthread_t recv_thread_handle;
+  RecvCallback recv_cb = NULL;
+  void *recv_user = NULL;
+};
+
+#endif
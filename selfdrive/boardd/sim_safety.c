@@ -0,0 +1,113 @@
+// Shims for what safety.h expects from the panda firmware, matching
+// panda/tests/safety/test.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "sim_safety.h"
+
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+typedef struct {
+  uint32_t CNT;
+} TIM_TypeDef;
+
+static TIM_TypeDef timer;
+TIM_TypeDef *TIM2 = &timer;
+
+// from config.h
+#define MIN(a,b)                                \
+  ({ __typeof__ (a) _a = (a);                   \
+    __typeof__ (b) _b = (b);                    \
+    _a < _b ? _a : _b; })
+
+#define MAX(a,b)                                \
+  ({ __typeof__ (a) _a = (a);                   \
+    __typeof__ (b) _b = (b);                    \
+    _a > _b ? _a : _b; })
+
+// from llcan.h
+#define GET_BUS(msg) (((msg)->RDTR >> 4) & 0xFF)
+#define GET_LEN(msg) ((msg)->RDTR & 0xf)
+#define GET_ADDR(msg) ((((msg)->RIR & 4) != 0) ? ((msg)->RIR >> 3) : ((msg)->RIR >> 21))
+#define GET_BYTE(msg, b) (((int)(b) > 3) ? (((msg)->RDHR >> (8U * ((unsigned int)(b) % 4U))) & 0XFFU) : (((msg)->RDLR >> (8U * (unsigned int)(b))) & 0xFFU))
+#define GET_BYTES_04(msg) ((msg)->RDLR)
+#define GET_BYTES_48(msg) ((msg)->RDHR)
+
+// from board_declarations.h
+#define HW_TYPE_UNKNOWN 0U
+#define HW_TYPE_WHITE_PANDA 1U
+#define HW_TYPE_GREY_PANDA 2U
+#define HW_TYPE_BLACK_PANDA 3U
+#define HW_TYPE_PEDAL 4U
+
+// from main_declarations.h
+uint8_t hw_type = HW_TYPE_WHITE_PANDA;
+
+#define UNUSED(x) (void)(x)
+
+#define PANDA
+#include "safety.h"
+
+// no gmlan on the simulated panda
+void set_gmlan_digital_output(int to_set) {
+  UNUSED(to_set);
+}
+
+void reset_gmlan_switch_timeout(void) {
+}
+
+void gmlan_switch_init(int timeout_enable) {
+  UNUSED(timeout_enable);
+}
+
+static CAN_FIFOMailBox_TypeDef to_mailbox(const uint32_t *frame) {
+  CAN_FIFOMailBox_TypeDef msg = {
+    .RIR = frame[0],
+    .RDTR = frame[1],
+    .RDLR = frame[2],
+    .RDHR = frame[3],
+  };
+  return msg;
+}
+
+int sim_safety_set_mode(uint16_t mode, int16_t param) {
+  return safety_set_mode(mode, param);
+}
+
+void sim_safety_set_long_controls_allowed(bool allowed) {
+  long_controls_allowed = allowed;
+}
+
+void sim_safety_set_timer(uint32_t us) {
+  timer.CNT = us;
+}
+
+void sim_safety_rx(const uint32_t *frame) {
+  CAN_FIFOMailBox_TypeDef msg = to_mailbox(frame);
+  safety_rx_hook(&msg);
+}
+
+int sim_safety_tx(const uint32_t *frame) {
+  CAN_FIFOMailBox_TypeDef msg = to_mailbox(frame);
+  return safety_tx_hook(&msg);
+}
+
+int sim_safety_fwd(int bus, const uint32_t *frame) {
+  CAN_FIFOMailBox_TypeDef msg = to_mailbox(frame);
+  return safety_fwd_hook(bus, &msg);
+}
+
+bool sim_safety_controls_allowed(void) {
+  return controls_allowed;
+}
+
+bool sim_safety_gas_interceptor_detected(void) {
+  return gas_interceptor_detected;
+}
@@ -0,0 +1,32 @@
+#ifndef BOARDD_SIM_SAFETY_H
+#define BOARDD_SIM_SAFETY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The panda's safety hooks (panda/board/safety.h) built for the host, for
+// the simulated panda and SocketCAN. Frames are the panda's 4 word mailbox
+// layout, the same as the usb wire format. Not thread safe, callers
+// serialize.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int sim_safety_set_mode(uint16_t mode, int16_t param);
+void sim_safety_set_long_controls_allowed(bool allowed);
+// microsecond timer the hooks use for rate limits
+void sim_safety_set_timer(uint32_t us);
+
+void sim_safety_rx(const uint32_t *frame);
+int sim_safety_tx(const uint32_t *frame);
+int sim_safety_fwd(int bus, const uint32_t *frame);
+
+bool sim_safety_controls_allowed(void);
+bool sim_safety_gas_interceptor_detected(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,410 @@
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+
+#include <algorithm>
+
+#include "common/timing.h"
+
+#include "sim_safety.h"
+#include "socketcan_transport.h"
+
+// frames per recvmmsg and sendmmsg
+#define BATCH 64
+// what the panda fills a bulk IN with at most
+#define RECV_SIZE (0x1000)
+#define RECV_POLL_MS 100
+
+#define CAN_BUS_RET_FLAG 0x80U
+#define CAN_BUS_NUM_MASK 0x7FU
+
+// busTime counts bit times at the panda's default speed
+#define BUSTIME_BITRATE 500000
+
+// SO_TIMESTAMPING gives software, legacy and raw hardware stamps
+#define CONTROL_SIZE (CMSG_SPACE(3 * sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+namespace {
+
+// copied from board/main.c
+struct __attribute__((packed)) health {
+  uint32_t voltage;
+  uint32_t current;
+  uint32_t can_send_errs;
+  uint32_t can_fwd_errs;
+  uint32_t gmlan_send_errs;
+  uint8_t started;
+  uint8_t controls_allowed;
+  uint8_t gas_interceptor_detected;
+  uint8_t car_harness_status_pkt;
+};
+
+uint32_t bus_ticks(uint64_t ns) {
+  return ((ns / 1000) * (BUSTIME_BITRATE / 1000) / 1000) & 0xFFFF;
+}
+
+// kernel timestamps are on CLOCK_REALTIME, so is a frame without one
+uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+}
+
+void SocketCanTransport::Batch::init(int size) {
+  frames.resize(size);
+  iovs.resize(size);
+  msgs.resize(size);
+  controls.resize(size * CONTROL_SIZE);
+
+  memset(msgs.data(), 0, msgs.size() * sizeof(struct mmsghdr));
+  for (int i = 0; i < size; i++) {
+    iovs[i].iov_base = &frames[i];
+    iovs[i].iov_len = sizeof(struct can_frame);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+SocketCanTransport::SocketCanTransport(const char *interfaces) {
+  const char *p = interfaces;
+  while (ifnames.size() < MAX_BUSES) {
+    const char *end = strchr(p, ',');
+    ifnames.push_back(end ? std::string(p, end - p) : std::string(p));
+    if (!end) break;
+    p = end + 1;
+  }
+
+  for (int i = 0; i < MAX_BUSES; i++) {
+    socks[i] = -1;
+    rx_drops[i] = 0;
+  }
+
+  pthread_mutex_init(&lock, NULL);
+  send_batch.init(BATCH);
+  recv_batch.init(BATCH);
+
+  sim_safety_set_mode(0, 0);
+}
+
+SocketCanTransport::~SocketCanTransport() {
+  close();
+}
+
+int SocketCanTransport::open_socket(const std::string &ifname) {
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  const int one = 1;
+  const int timestamping = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                           SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) return -1;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+  if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) { goto fail; }
+
+  // sends come back like returned frames from a panda
+  setsockopt(fd, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &one, sizeof(one));
+  // frames the kernel dropped, like a full rx_q on the panda
+  setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+  // without timestamps frames get the time they were read
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { goto fail; }
+
+  return fd;
+fail:
+  ::close(fd);
+  return -1;
+}
+
+bool SocketCanTransport::open() {
+  bool any = false;
+  for (int i = 0; i < (int)ifnames.size(); i++) {
+    if (ifnames[i].empty()) continue;
+
+    socks[i] = open_socket(ifnames[i]);
+    if (socks[i] < 0) {
+      close();
+      return false;
+    }
+    any = true;
+  }
+  if (!any) return false;
+
+  pthread_mutex_lock(&lock);
+  is_open = true;
+  lost = false;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+void SocketCanTransport::close() {
+  stop_can_recv();
+
+  pthread_mutex_lock(&lock);
+  is_open = false;
+  for (int i = 0; i < MAX_BUSES; i++) {
+    if (socks[i] >= 0) ::close(socks[i]);
+    socks[i] = -1;
+    rx_drops[i] = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void SocketCanTransport::recv_bus(int bus, std::vector<uint32_t> &out) {
+  Batch &b = recv_batch;
+  for (int i = 0; i < BATCH; i++) {
+    b.msgs[i].msg_hdr.msg_control = &b.controls[i * CONTROL_SIZE];
+    b.msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    b.msgs[i].msg_hdr.msg_flags = 0;
+  }
+
+  const int n = recvmmsg(socks[bus], b.msgs.data(), BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) lost = true;
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  sim_safety_set_timer(nanos_since_boot() / 1000);
+
+  for (int i = 0; i < n; i++) {
+    struct msghdr &hdr = b.msgs[i].msg_hdr;
+    const struct can_frame &cf = b.frames[i];
+    if (b.msgs[i].msg_len < sizeof(struct can_frame) || (cf.can_id & CAN_ERR_FLAG)) continue;
+
+    // raw hardware stamp if there is one, otherwise software
+    uint64_t ts_ns = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET) continue;
+
+      if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+        struct timespec ts[3];
+        memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+        const struct timespec &t = (ts[2].tv_sec || ts[2].tv_nsec) ? ts[2] : ts[0];
+        ts_ns = t.tv_sec * 1000000000ULL + t.tv_nsec;
+      } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+        can_send_errs += drops - rx_drops[bus];
+        rx_drops[bus] = drops;
+      }
+    }
+    if (ts_ns == 0) ts_ns = realtime_ns();
+
+    uint32_t w[4] = {0};
+    if (cf.can_id & CAN_EFF_FLAG) {
+      w[0] = ((cf.can_id & CAN_EFF_MASK) << 3) | 4;
+    } else {
+      w[0] = (cf.can_id & CAN_SFF_MASK) << 21;
+    }
+    const int len = std::min((int)cf.can_dlc, 8);
+    w[1] = len | (bus_ticks(ts_ns) << 16);
+    memcpy(&w[2], cf.data, len);
+
+    // our own sends, also received on loopback like on a panda
+    if (hdr.msg_flags & MSG_CONFIRM) {
+      const uint32_t ret[4] = {w[0], w[1] | ((CAN_BUS_RET_FLAG | bus) << 4), w[2], w[3]};
+      out.insert(out.end(), ret, ret + 4);
+      if (!loopback) continue;
+    }
+
+    w[1] |= bus << 4;
+    sim_safety_rx(w);
+    out.insert(out.end(), w, w + 4);
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+void *SocketCanTransport::recv_thread(void *arg) {
+  SocketCanTransport *t = (SocketCanTransport*)arg;
+  std::vector<uint32_t> buf;
+  buf.reserve(RECV_SIZE / sizeof(uint32_t));
+
+  struct pollfd fds[MAX_BUSES];
+  int buses[MAX_BUSES];
+  int nfds = 0;
+  for (int i = 0; i < MAX_BUSES; i++) {
+    if (t->socks[i] < 0) continue;
+    fds[nfds] = (struct pollfd){ .fd = t->socks[i], .events = POLLIN, .revents = 0 };
+    buses[nfds] = i;
+    nfds++;
+  }
+
+  // wake up now and then to notice stop_can_recv
+  while (t->recv_running && !t->lost) {
+    if (poll(fds, nfds, RECV_POLL_MS) <= 0) continue;
+
+    buf.clear();
+    for (int i = 0; i < nfds; i++) {
+      if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        t->lost = true;
+      } else if (fds[i].revents & POLLIN) {
+        t->recv_bus(buses[i], buf);
+      }
+    }
+
+    // in pieces no bigger than the panda's
+    for (size_t i = 0; i < buf.size(); i += RECV_SIZE / sizeof(uint32_t)) {
+      const size_t n = std::min(buf.size() - i, RECV_SIZE / sizeof(uint32_t));
+      t->recv_cb(t->recv_user, (const uint8_t*)&buf[i], n * sizeof(uint32_t), 0);
+    }
+  }
+
+  if (t->lost) {
+    t->recv_cb(t->recv_user, NULL, 0, LIBUSB_ERROR_NO_DEVICE);
+  }
+  return NULL;
+}
+
+int SocketCanTransport::start_can_recv(RecvCallback cb, void *user) {
+  if (!is_open) return LIBUSB_ERROR_NO_DEVICE;
+  assert(!recv_running);
+
+  recv_cb = cb;
+  recv_user = user;
+  recv_running = true;
+  return pthread_create(&recv_thread_handle, NULL, recv_thread, this) == 0 ? 0 : LIBUSB_ERROR_OTHER;
+}
+
+void SocketCanTransport::stop_can_recv() {
+  if (!recv_running) return;
+
+  recv_running = false;
+  pthread_join(recv_thread_handle, NULL);
+}
+
+int SocketCanTransport::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                         unsigned char *data, uint16_t length, unsigned int timeout) {
+  int ret = 0;
+
+  pthread_mutex_lock(&lock);
+  if (!is_open || lost) {
+    pthread_mutex_unlock(&lock);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  switch (request) {
+  // hw type, a white panda has no gps to look for
+  case 0xc1:
+    if (length >= 1) {
+      data[0] = 1;
+      ret = 1;
+    }
+    break;
+  // health, the kernel driver doesn't report voltage or ignition
+  case 0xd2: {
+    struct health h = {
+      .voltage = 12000,
+      .current = 0,
+      .can_send_errs = can_send_errs,
+      .can_fwd_errs = can_fwd_errs,
+      .gmlan_send_errs = 0,
+      .started = 0,
+      .controls_allowed = sim_safety_controls_allowed(),
+      .gas_interceptor_detected = sim_safety_gas_interceptor_detected(),
+      .car_harness_status_pkt = 0,
+    };
+    ret = std::min((int)sizeof(h), (int)length);
+    memcpy(data, &h, ret);
+    break;
+  }
+  // safety mode
+  case 0xdc:
+    sim_safety_set_mode(value, (int16_t)index);
+    break;
+  // long control allowed
+  case 0xdf:
+    sim_safety_set_long_controls_allowed(value & 1);
+    break;
+  // can loopback
+  case 0xe5:
+    loopback = value != 0;
+    break;
+  // esp power, charging, heartbeat, uart: nothing to do
+  default:
+    break;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+// with lock held, sends the first count frames of send_batch
+void SocketCanTransport::send_bus(int bus, int count) {
+  int sent = 0;
+  while (sent < count) {
+    const int n = sendmmsg(socks[bus], &send_batch.msgs[sent], count - sent, MSG_DONTWAIT);
+    if (n <= 0) {
+      if (errno == ENETDOWN || errno == ENODEV) lost = true;
+      // a full tx queue drops the rest, like the panda's
+      can_fwd_errs += count - sent;
+      break;
+    }
+    sent += n;
+  }
+}
+
+int SocketCanTransport::bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                                      int *transferred, unsigned int timeout) {
+  // only can send, usb_cb_ep3_out in the firmware
+  if (endpoint != 3) return LIBUSB_ERROR_NOT_SUPPORTED;
+
+  pthread_mutex_lock(&lock);
+  if (!is_open || lost) {
+    pthread_mutex_unlock(&lock);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  sim_safety_set_timer(nanos_since_boot() / 1000);
+
+  // one sendmmsg per bus and batch, frames of a bus keep their order
+  for (int bus = 0; bus < MAX_BUSES; bus++) {
+    if (socks[bus] < 0) continue;
+
+    int count = 0;
+    for (int i = 0; i + 16 <= length; i += 16) {
+      uint32_t w[4];
+      memcpy(w, &data[i], sizeof(w));
+      if ((int)((w[1] >> 4) & CAN_BUS_NUM_MASK) != bus || !sim_safety_tx(w)) continue;
+
+      struct can_frame &cf = send_batch.frames[count];
+      memset(&cf, 0, sizeof(cf));
+      if (w[0] & 4) {
+        cf.can_id = ((w[0] >> 3) & CAN_EFF_MASK) | CAN_EFF_FLAG;
+      } else {
+        cf.can_id = (w[0] >> 21) & CAN_SFF_MASK;
+      }
+      cf.can_dlc = std::min(w[1] & 0xF, 8U);
+      memcpy(cf.data, &w[2], cf.can_dlc);
+
+      if (++count == BATCH) {
+        send_bus(bus, count);
+        count = 0;
+      }
+    }
+    if (count > 0) send_bus(bus, count);
+  }
+
+  const bool ok = !lost;
+  pthread_mutex_unlock(&lock);
+
+  if (!ok) return LIBUSB_ERROR_NO_DEVICE;
+  if (transferred) *transferred = length;
+  return 0;
+}
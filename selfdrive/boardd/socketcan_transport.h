@@ -0,0 +1,85 @@
+#ifndef BOARDD_SOCKETCAN_TRANSPORT_H
+#define BOARDD_SOCKETCAN_TRANSPORT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+#include <string>
+#include <vector>
+
+#include "panda_transport.h"
+
+// Can over SocketCAN raw sockets, for a panda behind the kernel driver
+// (panda/drivers/linux) or vcan interfaces without any hardware. Frames
+// are read and written in batches with recvmmsg and sendmmsg and
+// translated to the panda's usb format.
+//
+// The kernel driver doesn't give access to the panda's control requests,
+// so the safety hooks run here on the host, on the mode boardd asks for.
+// busTime comes from the kernel timestamps, hardware if the interface
+// has them, in bit times at 500 kbps like on a panda.
+class SocketCanTransport : public PandaTransport {
+ public:
+  // interfaces in bus order, like "can0,can1,can2", an empty name skips a bus
+  SocketCanTransport(const char *interfaces);
+  ~SocketCanTransport();
+
+  bool open();
+  void close();
+
+  int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                    int *transferred, unsigned int timeout);
+
+  int start_can_recv(RecvCallback cb, void *user);
+
+ private:
+  static const int MAX_BUSES = 3;
+
+  // recvmmsg and sendmmsg buffers for up to BATCH frames
+  struct Batch {
+    std::vector<struct can_frame> frames;
+    std::vector<struct iovec> iovs;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<char> controls;
+
+    void init(int size);
+  };
+
+  static void *recv_thread(void *arg);
+
+  int open_socket(const std::string &ifname);
+  // appends what's waiting on the bus' socket to out in usb format
+  void recv_bus(int bus, std::vector<uint32_t> &out);
+  // with lock held
+  void send_bus(int bus, int count);
+  void stop_can_recv();
+
+  std::vector<std::string> ifnames;
+  int socks[MAX_BUSES];
+  // kernel SO_RXQ_OVFL count per socket, counted as can_send_errs
+  uint32_t rx_drops[MAX_BUSES];
+
+  // safety hooks, counters and the send batch
+  pthread_mutex_t lock;
+  Batch send_batch;
+  bool loopback = false;
+  uint32_t can_send_errs = 0;
+  uint32_t can_fwd_errs = 0;
+
+  // only used by the recv thread
+  Batch recv_batch;
+
+  bool is_open = false;
+  // an interface went away, transfers fail until reopened
+  volatile bool lost = false;
+  volatile bool recv_running = false;
+  pthread_t recv_thread_handle;
+  RecvCallback recv_cb = NULL;
+  void *recv_user = NULL;
+};
+
+#endif
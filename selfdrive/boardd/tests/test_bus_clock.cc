@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cassert>
+#include <cmath>
+
+#include "bus_clock.h"
+
+// a panda on a 500kbit bus whose bit time is drift_ppm off in host time,
+// frames reach the host 100-400us after they were on the bus
+struct Bus {
+  double period_ns;
+  double ticks = 12345;
+  uint64_t base = 1000000000ULL;
+
+  Bus(double drift_ppm) : period_ns(2000.0 * (1 + drift_ppm * 1e-6)) {}
+
+  double host(double t) const { return base + t * period_ns; }
+  uint16_t bus_time(double t) const { return (uint64_t)t & 0xFFFF; }
+  uint64_t arrival(double t) const { return host(t) + 100000 + rand() % 300000; }
+};
+
+// results are never after the arrival, and no earlier than the frame was on
+// the bus give or take the drift the fit hasn't caught up with
+void check(BusClock &clock, const Bus &bus, double t, double max_error_ns) {
+  const uint64_t arrival = bus.arrival(t);
+  const uint64_t r = clock.update(bus.bus_time(t), arrival);
+  assert(r <= arrival);
+  assert(fabs((double)r - bus.host(t)) < max_error_ns);
+}
+
+void test_wraps() {
+  srand(1);
+  BusClock clock;
+  Bus bus(0);
+
+  // a frame every 10ms is 5000 ticks, 10s is about 75 wraps
+  for (int i = 0; i < 1000; i++, bus.ticks += 5000) {
+    check(clock, bus, bus.ticks, 500000);
+  }
+
+  // a quiet bus, several wraps between two frames
+  const double gaps[] = {65536 * 3 + 100, 65536 * 7 - 100, 65536 * 2, 65536 * 10 + 30000};
+  for (double gap : gaps) {
+    bus.ticks += gap;
+    for (int i = 0; i < 200; i++, bus.ticks += 5000) {
+      check(clock, bus, bus.ticks, 500000);
+    }
+  }
+}
+
+void test_backwards() {
+  srand(2);
+  BusClock clock;
+  Bus bus(0);
+
+  for (int i = 0; i < 300; i++, bus.ticks += 5000) {
+    check(clock, bus, bus.ticks, 500000);
+    // a returned send stamped before the frame just received, then one
+    // stamped a bit before a counter wrap. neither moves the clock back
+    if (i % 10 == 0) {
+      check(clock, bus, bus.ticks - 1000, 500000);
+    }
+  }
+
+  bus.ticks = ceil(bus.ticks / 65536) * 65536 + 100;
+  check(clock, bus, bus.ticks, 500000);
+  check(clock, bus, bus.ticks - 300, 500000);
+  for (int i = 0; i < 100; i++) {
+    bus.ticks += 5000;
+    check(clock, bus, bus.ticks, 500000);
+  }
+}
+
+void test_drift(double drift_ppm, double expected_ppm) {
+  srand(3);
+  BusClock clock;
+  Bus bus(drift_ppm);
+
+  // the slope between windows converges slowly, give it two minutes
+  for (int i = 0; i < 12000; i++, bus.ticks += 5000) {
+    const uint64_t arrival = bus.arrival(bus.ticks);
+    const uint64_t r = clock.update(bus.bus_time(bus.ticks), arrival);
+    assert(r <= arrival);
+  }
+  printf("  drift %.0f ppm, estimated %.1f ppm\n", drift_ppm, clock.drift_ppm());
+  assert(fabs(clock.drift_ppm() - expected_ppm) < 20);
+
+  // caught up, the results are good to the usb delay again
+  if (drift_ppm == expected_ppm) {
+    for (int i = 0; i < 100; i++, bus.ticks += 5000) {
+      check(clock, bus, bus.ticks, 500000);
+    }
+  }
+}
+
+int main() {
+  test_wraps();
+  test_backwards();
+  test_drift(0, 0);
+  test_drift(200, 200);
+  test_drift(-300, -300);
+  // the panda clock isn't that far off, the fit stays within 1000ppm
+  test_drift(3000, 1000);
+  test_drift(-3000, -1000);
+  printf("bus clock ok\n");
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <cstdint>
+#include <cassert>
+
+#include <vector>
+
+#include "send_scheduler.h"
+
+#define MS 1000000ULL
+
+// frames carry an id in their second word to check the send order
+void push(SendScheduler &s, uint32_t address, uint32_t id, uint64_t created) {
+  const uint32_t frame[4] = {address << 21, id, 0, 0};
+  s.push(address, frame, created);
+}
+
+std::vector<uint32_t> pop_ids(SendScheduler &s, uint64_t now, size_t *expired = NULL) {
+  std::vector<uint32_t> out;
+  const size_t n = s.pop_all(out, now);
+  if (expired) *expired = n;
+  assert(s.empty());
+
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < out.size(); i += 4) {
+    ids.push_back(out[i + 1]);
+  }
+  return ids;
+}
+
+void test_order() {
+  SendScheduler s;
+  const uint64_t t = 1000 * MS;
+
+  // 0x2e4 is control, 0x412 HUD and 0x123 default, with default deadlines.
+  // control goes first however late it was pushed, then by deadline, then
+  // in the order pushed
+  push(s, 0x412, 1, t);
+  push(s, 0x123, 2, t + 5 * MS);
+  push(s, 0x123, 3, t);
+  push(s, 0x2e4, 4, t + 20 * MS);
+  push(s, 0x123, 5, t);
+  push(s, 0x2e4, 6, t + 10 * MS);
+  push(s, 0x2e4, 7, t + 10 * MS);
+
+  const std::vector<uint32_t> ids = pop_ids(s, t + 20 * MS);
+  const std::vector<uint32_t> expected = {6, 7, 4, 3, 5, 2, 1};
+  assert(ids == expected);
+}
+
+void test_expiry() {
+  SendScheduler s;
+  const uint64_t t = 1000 * MS;
+
+  // control frames have 100ms, everything else 1s
+  push(s, 0x2e4, 1, t);
+  push(s, 0x2e4, 2, t + 50 * MS);
+  push(s, 0x123, 3, t);
+  push(s, 0x412, 4, t - 900 * MS);
+
+  size_t expired;
+  std::vector<uint32_t> ids = pop_ids(s, t + 120 * MS, &expired);
+  assert(expired == 2);
+  assert(ids == std::vector<uint32_t>({2, 3}));
+
+  // right at the deadline is still in time
+  push(s, 0x2e4, 5, t);
+  ids = pop_ids(s, t + 100 * MS, &expired);
+  assert(expired == 0 && ids == std::vector<uint32_t>({5}));
+
+  ids = pop_ids(s, t, &expired);
+  assert(expired == 0 && ids.empty());
+
+  // deadlines come out in send order
+  push(s, 0x123, 6, t);
+  push(s, 0x2e4, 7, t);
+  std::vector<uint32_t> out;
+  std::vector<uint64_t> deadlines;
+  s.pop_all(out, t, &deadlines);
+  assert(out.size() == 8 && out[1] == 7 && out[5] == 6);
+  assert(deadlines == std::vector<uint64_t>({t + 100 * MS, t + 1000 * MS}));
+}
+
+void test_configure() {
+  const uint64_t t = 1000 * MS;
+
+  SendScheduler s;
+  assert(s.configure(""));
+  assert(s.configure("0x123:0:10,300:2:500"));
+  push(s, 0x123, 1, t);
+  push(s, 300, 2, t);
+  push(s, 0x2e4, 3, t);
+  push(s, 0x124, 4, t);
+  size_t expired;
+  std::vector<uint32_t> ids = pop_ids(s, t + 5 * MS, &expired);
+  assert(expired == 0 && ids == std::vector<uint32_t>({1, 3, 4, 2}));
+
+  // 10ms deadline
+  push(s, 0x123, 1, t);
+  ids = pop_ids(s, t + 11 * MS, &expired);
+  assert(expired == 1 && ids.empty());
+
+  // a trailing comma is fine
+  assert(s.configure("0x124:0:10,"));
+  push(s, 0x412, 1, t);
+  push(s, 0x124, 2, t);
+  assert(pop_ids(s, t) == std::vector<uint32_t>({2, 1}));
+
+  // a bad spec changes nothing, not even the entries before the bad one
+  const char *bad[] = {
+    "0x412:0:10,0x2e4:2",
+    "0x412:0:10,0x2e4:3:10",
+    "0x412:0:10,0x2e4:-1:10",
+    "0x412:0:10,x:0:10",
+    "0x412:0:10,0x2e4:0:10ms",
+    "0x412:0:10,,",
+    "0x412:0:10;0x2e4:2:10",
+    ",",
+  };
+  for (const char *spec : bad) {
+    assert(!s.configure(spec));
+    push(s, 0x412, 1, t);
+    push(s, 0x2e4, 2, t);
+    ids = pop_ids(s, t + 50 * MS, &expired);
+    assert(expired == 0 && ids == std::vector<uint32_t>({2, 1}));
+  }
+}
+
+int main() {
+  test_order();
+  test_expiry();
+  test_configure();
+  printf("send scheduler ok\n");
+  return 0;
+}
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include <algorithm>
+
+#include "common/timing.h"
+
+#include "usb_engine.h"
+
+namespace {
+
+// libusb_*_transfer style error for a finished async transfer
+int transfer_error(const libusb_transfer *transfer) {
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return 0;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:
+    return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return LIBUSB_ERROR_OVERFLOW;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return LIBUSB_ERROR_INTERRUPTED;
+  default:
+    return LIBUSB_ERROR_IO;
+  }
+}
+
+}
+
+UsbEngine::UsbEngine(libusb_context *ctx) : ctx(ctx) {
+  pthread_mutex_init(&sync_lock, NULL);
+  pthread_cond_init(&sync_cond, NULL);
+  pthread_mutex_init(&stream_lock, NULL);
+  pthread_cond_init(&stream_cond, NULL);
+
+  for (auto &ep : endpoints) {
+    ep.engine = this;
+    pthread_mutex_init(&ep.lock, NULL);
+    ep.transfer = NULL;
+    ep.done = false;
+  }
+}
+
+UsbEngine::~UsbEngine() {
+  stop_bulk_in();
+  stop();
+
+  for (auto &ep : endpoints) {
+    if (ep.transfer) libusb_free_transfer(ep.transfer);
+    pthread_mutex_destroy(&ep.lock);
+  }
+  for (auto t : stream_transfers) {
+    libusb_free_transfer(t);
+  }
+}
+
+void UsbEngine::start() {
+  if (running) return;
+  running = true;
+  int err = pthread_create(&thread_handle, NULL, event_thread, this);
+  assert(err == 0);
+}
+
+void UsbEngine::stop() {
+  if (!running) return;
+  running = false;
+  pthread_join(thread_handle, NULL);
+}
+
+void UsbEngine::set_device(libusb_device_handle *handle) {
+  dev_handle = handle;
+}
+
+void *UsbEngine::event_thread(void *arg) {
+  UsbEngine *engine = (UsbEngine*)arg;
+
+  while (engine->running) {
+    // wake up often enough to resubmit parked stream transfers in time
+    int timeout_us = 100*1000;
+    if (engine->idle_poll_us > 0 && engine->idle_poll_us < timeout_us) {
+      timeout_us = engine->idle_poll_us;
+    }
+    struct timeval tv = {0, timeout_us};
+    libusb_handle_events_timeout_completed(engine->ctx, &tv, NULL);
+
+    engine->resubmit_parked();
+  }
+  return NULL;
+}
+
+UsbEngine::Endpoint &UsbEngine::endpoint(unsigned char address) {
+  return endpoints[(address & 0x0F) | ((address & 0x80) >> 3)];
+}
+
+void UsbEngine::sync_callback(libusb_transfer *transfer) {
+  Endpoint *ep = (Endpoint*)transfer->user_data;
+  UsbEngine *engine = ep->engine;
+
+  pthread_mutex_lock(&engine->sync_lock);
+  ep->done = true;
+  pthread_cond_broadcast(&engine->sync_cond);
+  pthread_mutex_unlock(&engine->sync_lock);
+}
+
+// called with ep.lock held and ep.transfer filled in
+int UsbEngine::submit_and_wait(Endpoint &ep) {
+  ep.done = false;
+  int err = libusb_submit_transfer(ep.transfer);
+  if (err != 0) return err;
+
+  pthread_mutex_lock(&sync_lock);
+  while (!ep.done) {
+    pthread_cond_wait(&sync_cond, &sync_lock);
+  }
+  pthread_mutex_unlock(&sync_lock);
+
+  return transfer_error(ep.transfer);
+}
+
+int UsbEngine::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                unsigned char *data, uint16_t length, unsigned int timeout) {
+  // all control transfers share endpoint 0
+  Endpoint &ep = endpoints[0];
+  pthread_mutex_lock(&ep.lock);
+
+  if (ep.transfer == NULL) {
+    ep.transfer = libusb_alloc_transfer(0);
+  }
+  const size_t size = LIBUSB_CONTROL_SETUP_SIZE + length;
+  if (ep.buf.size() < size) {
+    ep.buf.resize(size);
+  }
+
+  const bool is_in = (request_type & LIBUSB_ENDPOINT_IN) != 0;
+  libusb_fill_control_setup(ep.buf.data(), request_type, request, value, index, length);
+  if (!is_in && length > 0) {
+    memcpy(ep.buf.data() + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+  }
+  libusb_fill_control_transfer(ep.transfer, dev_handle, ep.buf.data(), sync_callback, &ep, timeout);
+
+  int err = submit_and_wait(ep);
+  if (err == 0) {
+    err = ep.transfer->actual_length;
+    if (is_in && err > 0) {
+      memcpy(data, libusb_control_transfer_get_data(ep.transfer), err);
+    }
+  }
+
+  pthread_mutex_unlock(&ep.lock);
+  return err;
+}
+
+int UsbEngine::bulk_transfer(unsigned char endpoint_address, unsigned char *data, int length,
+                             int *transferred, unsigned int timeout) {
+  Endpoint &ep = endpoint(endpoint_address);
+  pthread_mutex_lock(&ep.lock);
+
+  if (ep.transfer == NULL) {
+    ep.transfer = libusb_alloc_transfer(0);
+  }
+  libusb_fill_bulk_transfer(ep.transfer, dev_handle, endpoint_address, data, length, sync_callback, &ep, timeout);
+
+  int err = submit_and_wait(ep);
+  if (transferred) {
+    *transferred = ep.transfer->actual_length;
+  }
+
+  pthread_mutex_unlock(&ep.lock);
+  return err;
+}
+
+int UsbEngine::start_bulk_in(unsigned char endpoint_address, int num_transfers, int size, int max,
+                             int idle_poll, RecvCallback cb, void *user) {
+  pthread_mutex_lock(&stream_lock);
+  assert(in_flight == 0 && parked.empty());
+
+  recv_cb = cb;
+  recv_user = user;
+  idle_poll_us = idle_poll;
+  max_size = std::max(size, max);
+  stopping = false;
+
+  while (stream_transfers.size() < (size_t)num_transfers) {
+    stream_transfers.push_back(libusb_alloc_transfer(0));
+  }
+  // buffers that grew on a previous connection are kept
+  stream_bufs.resize(num_transfers);
+  parked.reserve(num_transfers);
+
+  int err = 0;
+  for (int i = 0; i < num_transfers; i++) {
+    libusb_transfer *t = stream_transfers[i];
+    std::vector<uint8_t> &buf = stream_bufs[i];
+    if (buf.size() < (size_t)size) {
+      buf.resize(size);
+    }
+    libusb_fill_bulk_transfer(t, dev_handle, endpoint_address, buf.data(), buf.size(),
+                              bulk_in_callback, this, 0);
+    err = libusb_submit_transfer(t);
+    if (err != 0) break;
+    in_flight++;
+  }
+
+  pthread_mutex_unlock(&stream_lock);
+  return err;
+}
+
+void UsbEngine::stop_bulk_in() {
+  pthread_mutex_lock(&stream_lock);
+  stopping = true;
+  parked.clear();
+  for (auto t : stream_transfers) {
+    // transfers that aren't in flight just return an error
+    libusb_cancel_transfer(t);
+  }
+  while (in_flight > 0) {
+    pthread_cond_wait(&stream_cond, &stream_lock);
+  }
+  idle_poll_us = 0;
+  pthread_mutex_unlock(&stream_lock);
+}
+
+void UsbEngine::bulk_in_callback(libusb_transfer *transfer) {
+  UsbEngine *engine = (UsbEngine*)transfer->user_data;
+  engine->on_bulk_in(transfer);
+}
+
+void UsbEngine::on_bulk_in(libusb_transfer *transfer) {
+  const int err = transfer_error(transfer);
+  const bool cancelled = transfer->status == LIBUSB_TRANSFER_CANCELLED;
+  const bool lost = transfer->status == LIBUSB_TRANSFER_NO_DEVICE;
+  const bool got_data = transfer->actual_length > 0 && (err == 0 || err == LIBUSB_ERROR_OVERFLOW);
+
+  if (got_data) {
+    recv_cb(recv_user, transfer->buffer, transfer->actual_length, err);
+  } else if (err != 0 && !cancelled) {
+    recv_cb(recv_user, NULL, 0, err);
+  }
+
+  if (err == LIBUSB_ERROR_OVERFLOW && transfer->length < max_size) {
+    // the device had more queued than fit, so give this transfer more room
+    // for the next burst. it isn't in flight so its buffer can move
+    for (size_t i = 0; i < stream_transfers.size(); i++) {
+      if (stream_transfers[i] != transfer) continue;
+      std::vector<uint8_t> &buf = stream_bufs[i];
+      buf.resize(std::min((size_t)transfer->length * 2, (size_t)max_size));
+      transfer->buffer = buf.data();
+      transfer->length = buf.size();
+    }
+  }
+
+  pthread_mutex_lock(&stream_lock);
+  in_flight--;
+  if (stopping || cancelled || lost) {
+    pthread_cond_broadcast(&stream_cond);
+  } else if (got_data && libusb_submit_transfer(transfer) == 0) {
+    // more data is likely waiting, ask again right away
+    in_flight++;
+  } else {
+    parked.push_back((Parked){ .transfer = transfer, .since = nanos_since_boot() });
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
+
+void UsbEngine::resubmit_parked() {
+  pthread_mutex_lock(&stream_lock);
+  if (!stopping && !parked.empty()) {
+    const uint64_t now = nanos_since_boot();
+    size_t kept = 0;
+    for (size_t i = 0; i < parked.size(); i++) {
+      if (now - parked[i].since >= (uint64_t)idle_poll_us * 1000 && libusb_submit_transfer(parked[i].transfer) == 0) {
+        in_flight++;
+      } else {
+        parked[kept++] = parked[i];
+      }
+    }
+    parked.resize(kept);
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
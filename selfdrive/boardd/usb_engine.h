@@ -0,0 +1,95 @@
+#ifndef BOARDD_USB_ENGINE_H
+#define BOARDD_USB_ENGINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+// Asynchronous libusb transfers driven by a dedicated event thread.
+// The synchronous calls are built on the async API and only serialize
+// against other calls on the same endpoint, so a slow control transfer
+// can't hold up bulk traffic. A bulk IN stream keeps several transfers in
+// flight so the device is drained continuously.
+class UsbEngine {
+ public:
+  // called on the event thread for every IN transfer that returned data.
+  // err is 0, or LIBUSB_ERROR_OVERFLOW if the device had more than fit.
+  // len is 0 with a libusb error when the stream stops on its own
+  typedef void (*RecvCallback)(void *user, const uint8_t *data, int len, int err);
+
+  UsbEngine(libusb_context *ctx);
+  ~UsbEngine();
+
+  void start();
+  void stop();
+
+  // device used by new transfers, nothing may be in flight when it changes
+  void set_device(libusb_device_handle *dev_handle);
+
+  // same return values as libusb_control_transfer and libusb_bulk_transfer
+  int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length, unsigned int timeout);
+  int bulk_transfer(unsigned char endpoint, unsigned char *data, int length,
+                    int *transferred, unsigned int timeout);
+
+  // keeps num_transfers bulk IN transfers of size bytes in flight. transfers
+  // that come back empty are resubmitted after idle_poll_us, the device
+  // answers immediately when it has nothing to send. a transfer that
+  // overflows has its buffer doubled, up to max_size
+  int start_bulk_in(unsigned char endpoint, int num_transfers, int size, int max_size, int idle_poll_us,
+                    RecvCallback cb, void *user);
+  // cancels the stream and waits until all its transfers are back
+  void stop_bulk_in();
+
+ private:
+  struct Endpoint {
+    UsbEngine *engine;
+    pthread_mutex_t lock; // one synchronous transfer at a time
+    libusb_transfer *transfer;
+    std::vector<unsigned char> buf; // control setup and data
+    bool done;
+  };
+
+  struct Parked {
+    libusb_transfer *transfer;
+    uint64_t since;
+  };
+
+  static void *event_thread(void *arg);
+  static void sync_callback(libusb_transfer *transfer);
+  static void bulk_in_callback(libusb_transfer *transfer);
+
+  Endpoint &endpoint(unsigned char address);
+  int submit_and_wait(Endpoint &ep);
+  void on_bulk_in(libusb_transfer *transfer);
+  void resubmit_parked();
+
+  libusb_context *ctx;
+  libusb_device_handle *dev_handle = NULL;
+
+  pthread_t thread_handle;
+  volatile bool running = false;
+
+  // completion of synchronous transfers
+  pthread_mutex_t sync_lock;
+  pthread_cond_t sync_cond;
+  Endpoint endpoints[32];
+
+  // bulk IN stream, only touched on the event thread or under stream_lock
+  pthread_mutex_t stream_lock;
+  pthread_cond_t stream_cond;
+  std::vector<libusb_transfer*> stream_transfers;
+  std::vector<std::vector<uint8_t> > stream_bufs;
+  std::vector<Parked> parked;
+  int in_flight = 0;
+  bool stopping = false;
+  int idle_poll_us = 0;
+  int max_size = 0;
+  RecvCallback recv_cb = NULL;
+  void *recv_user = NULL;
+};
+
+#endif
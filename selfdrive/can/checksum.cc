@@ -0,0 +1,117 @@
+#include <cassert>
+#include <cstdint>
+
+#include "common.h"
+
+// All checksums take the message as a big endian word, with the message
+// bytes in the top l bytes and the checksum in the last byte (or nibble).
+
+namespace {
+
+struct Crc8Table {
+  uint8_t t[256];
+
+  Crc8Table(uint8_t poly) {
+    for (int i = 0; i < 256; i++) {
+      uint8_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        if ((crc & 0x80) != 0) {
+          crc = (uint8_t)((crc << 1) ^ poly);
+        } else {
+          crc <<= 1;
+        }
+      }
+      t[i] = crc;
+    }
+  }
+};
+
+const Crc8Table pedal_crc_table(0xD5); // standard crc8
+const Crc8Table j1850_crc_table(0x1D); // SAE J1850
+
+// sum of all nibbles, at most 16*15 so it fits in the top byte of the multiply
+inline unsigned int nibble_sum(uint64_t x) {
+  x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// sum of all bytes, at most 8*255 so it fits in the top 16 bits of the multiply
+inline unsigned int byte_sum(uint64_t x) {
+  x = (x & 0x00FF00FF00FF00FFULL) + ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  return (x * 0x0001000100010001ULL) >> 48;
+}
+
+std::vector<ChecksumFunc>& get_checksums() {
+  static std::vector<ChecksumFunc> vec;
+  return vec;
+}
+
+}
+
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 4; // remove checksum
+
+  int s = nibble_sum(address) + nibble_sum(d);
+  s = 8-s;
+  s &= 0xF;
+
+  return s;
+}
+
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  unsigned int s = l + byte_sum(address) + byte_sum(d);
+
+  return s & 0xFF;
+}
+
+unsigned int pedal_checksum(unsigned int address, uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  // bytes are processed starting from the least significant one
+  for (int i = 0; i < l - 1; i++) {
+    crc = pedal_crc_table.t[crc ^ (uint8_t)(d >> (i*8))];
+  }
+  return crc;
+}
+
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  // message order, first byte is the most significant one
+  for (int i = l - 2; i >= 0; i--) {
+    crc = j1850_crc_table.t[crc ^ (uint8_t)(d >> (i*8))];
+  }
+  return crc ^ 0xFF;
+}
+
+ChecksumFunc checksum_lookup(SignalType type) {
+  const auto& checksums = get_checksums();
+  if (type < checksums.size()) {
+    return checksums[type];
+  }
+  return NULL;
+}
+
+void checksum_register(SignalType type, ChecksumFunc func) {
+  auto& checksums = get_checksums();
+  if (checksums.size() <= type) {
+    checksums.resize(type + 1, NULL);
+  }
+  assert(checksums[type] == NULL);
+  checksums[type] = func;
+}
+
+checksum_init(SignalType::HONDA_CHECKSUM, honda_checksum)
+checksum_init(SignalType::TOYOTA_CHECKSUM, toyota_checksum)
+checksum_init(SignalType::PEDAL_CHECKSUM, pedal_checksum)
+checksum_init(SignalType::CHRYSLER_CHECKSUM, chrysler_checksum)
@@ -4,6 +4,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
 
@@ -11,6 +12,29 @@
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
 unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
 unsigned int pedal_checksum(unsigned int address, uint64_t d, int l);
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
+
+inline uint64_t read_u64_be(const uint8_t* v) {
+  return (((uint64_t)v[0] << 56)
+          | ((uint64_t)v[1] << 48)
+          | ((uint64_t)v[2] << 40)
+          | ((uint64_t)v[3] << 32)
+          | ((uint64_t)v[4] << 24)
+          | ((uint64_t)v[5] << 16)
+          | ((uint64_t)v[6] << 8)
+          | (uint64_t)v[7]);
+}
+
+inline uint64_t read_u64_le(const uint8_t* v) {
+  return ((uint64_t)v[0]
+          | ((uint64_t)v[1] << 8)
+          | ((uint64_t)v[2] << 16)
+          | ((uint64_t)v[3] << 24)
+          | ((uint64_t)v[4] << 32)
+          | ((uint64_t)v[5] << 40)
+          | ((uint64_t)v[6] << 48)
+          | ((uint64_t)v[7] << 56));
+}
 
 struct SignalPackValue {
   const char* name;
@@ -36,6 +60,18 @@ struct SignalValue {
   double value;
 };
 
+struct MessageTimestamp {
+  uint32_t address;
+  uint16_t ts;
+  uint64_t seen;
+};
+
+struct MessageTimeout {
+  uint32_t address;
+  uint64_t seen;    // 0 if never received
+  uint64_t missing; // ns since it was last received, or since the first update
+};
+
 
 enum SignalType {
   DEFAULT,
@@ -44,6 +80,7 @@ enum SignalType {
   TOYOTA_CHECKSUM,
   PEDAL_CHECKSUM,
   PEDAL_COUNTER,
+  CHRYSLER_CHECKSUM,
 };
 
 struct Signal {
@@ -70,12 +107,23 @@ struct Val {
   const Signal *sigs;
 };
 
+// Specialized decode/encode for one message, generated by
+// process_dbc.py --codegen. Signals are in Msg::sigs order.
+struct MsgCodec {
+  // decodes every signal of the message, false on a checksum mismatch
+  bool (*decode)(const uint8_t *dat, double *vals);
+  // packs the signals selected by sig_mask (bit i is Msg::sigs[i]), then
+  // COUNTER if counter >= 0, then CHECKSUM. returns the big endian word
+  uint64_t (*encode)(const double *vals, uint64_t sig_mask, int counter);
+};
+
 struct DBC {
   const char* name;
   size_t num_msgs;
   const Msg *msgs;
   const Val *vals;
   size_t num_vals;
+  const MsgCodec *codecs; // parallel to msgs, NULL without codegen
 };
 
 const DBC* dbc_lookup(const std::string& dbc_name);
@@ -87,4 +135,17 @@ static void __attribute__((constructor)) do_dbc_init_ ## dbc(void) { \
   dbc_register(&dbc); \
 }
 
+// checksum over the big endian message word, l is the message size in bytes
+typedef unsigned int (*ChecksumFunc)(unsigned int address, uint64_t d, int l);
+
+// returns NULL if no checksum is registered for the signal type
+ChecksumFunc checksum_lookup(SignalType type);
+
+void checksum_register(SignalType type, ChecksumFunc func);
+
+#define checksum_init(type, func) \
+static void __attribute__((constructor)) do_checksum_init_ ## func(void) { \
+  checksum_register(type, func); \
+}
+
 #endif
@@ -1,18 +1,35 @@
 #include <cstdint>
+{% if codegen %}
+#include <cmath>
+{% endif %}
 
 #include "common.h"
 
+{% macro sig_b1(sig) %}{{sig.start_bit if sig.is_little_endian else (sig.start_bit//8)*8 + (-sig.start_bit-1) % 8}}{% endmacro %}
+{% macro sig_type(address, sig) %}
+  {%- if checksum_type == "honda" and sig.name == "CHECKSUM" -%}
+    HONDA_CHECKSUM
+  {%- elif checksum_type == "honda" and sig.name == "COUNTER" -%}
+    HONDA_COUNTER
+  {%- elif checksum_type == "toyota" and sig.name == "CHECKSUM" -%}
+    TOYOTA_CHECKSUM
+  {%- elif checksum_type == "chrysler" and sig.name == "CHECKSUM" -%}
+    CHRYSLER_CHECKSUM
+  {%- elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" -%}
+    PEDAL_CHECKSUM
+  {%- elif address in [512, 513] and sig.name == "COUNTER_PEDAL" -%}
+    PEDAL_COUNTER
+  {%- else -%}
+    DEFAULT
+  {%- endif -%}
+{% endmacro %}
 namespace {
 
 {% for address, msg_name, msg_size, sigs in msgs %}
 const Signal sigs_{{address}}[] = {
   {% for sig in sigs %}
     {
-      {% if sig.is_little_endian %}
-        {% set b1 = sig.start_bit %}
-      {% else %}
-        {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
-      {% endif %}
+      {% set b1 = sig_b1(sig)|int %}
       .name = "{{sig.name}}",
       .b1 = {{b1}},
       .b2 = {{sig.size}},
@@ -21,19 +38,7 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{sig_type(address, sig)}},
     },
   {% endfor %}
 };
@@ -52,6 +57,92 @@ const Msg msgs[] = {
 {% endfor %}
 };
 
+{% if codegen %}
+{% set checksum_funcs = {
+  "HONDA_CHECKSUM": "honda_checksum",
+  "TOYOTA_CHECKSUM": "toyota_checksum",
+  "PEDAL_CHECKSUM": "pedal_checksum",
+  "CHRYSLER_CHECKSUM": "chrysler_checksum",
+} %}
+{# writes value into a field of the big endian word ret #}
+{% macro set_field(sig, value) %}
+  {% set b1 = sig_b1(sig)|int %}
+  {% set shift = b1 if sig.is_little_endian else 64 - (b1 + sig.size) %}
+  {% set field = "(0x%XULL << %d)" % (2**sig.size - 1, shift) %}
+  {% set bits = "(((uint64_t)(%s) & 0x%XULL) << %d)" % (value, 2**sig.size - 1, shift) %}
+  {% if sig.is_little_endian %}
+  ret = (ret & ~__builtin_bswap64({{field}})) | __builtin_bswap64({{bits}});
+  {% else %}
+  ret = (ret & ~{{field}}) | {{bits}};
+  {% endif %}
+{% endmacro %}
+{% for address, msg_name, msg_size, sigs in msgs %}
+bool decode_{{address}}(const uint8_t *dat, double *vals) {
+  const uint64_t le = read_u64_le(dat);
+  const uint64_t be = read_u64_be(dat);
+  int64_t tmp;
+  bool ok = true;
+
+  {% for sig in sigs %}
+    {% set b1 = sig_b1(sig)|int %}
+    {% set shift = b1 if sig.is_little_endian else 64 - (b1 + sig.size) %}
+    {% if shift < 0 %}
+  tmp = 0; // {{sig.name}} extends past the end of the frame
+    {% else %}
+  tmp = ({{"le" if sig.is_little_endian else "be"}} >> {{shift}}) & 0x{{"%X" % (2**sig.size - 1)}}ULL;
+    {% endif %}
+    {% if sig.is_signed %}
+  tmp = (tmp ^ 0x{{"%X" % 2**(sig.size - 1)}}ULL) - 0x{{"%X" % 2**(sig.size - 1)}}ULL;
+    {% endif %}
+  vals[{{loop.index0}}] = (double)tmp * {{sig.factor}} + {{sig.offset}};
+    {% set func = checksum_funcs.get(sig_type(address, sig)) %}
+    {% if func %}
+  ok = ok && {{func}}({{address}}, be, {{msg_size}}) == tmp;
+    {% endif %}
+  {% endfor %}
+
+  (void)le; (void)be;
+  return ok;
+}
+
+uint64_t encode_{{address}}(const double *vals, uint64_t sig_mask, int counter) {
+  uint64_t words[2] = {0, 0}; // little endian word, big endian word
+
+  {% for sig in sigs %}
+    {% set b1 = sig_b1(sig)|int %}
+    {% set shift = b1 if sig.is_little_endian else 64 - (b1 + sig.size) %}
+    {% if shift >= 0 %}
+  if (sig_mask & (1ULL << {{loop.index0}})) {
+    const int64_t ival = (int64_t)(round((vals[{{loop.index0}}] - {{sig.offset}}) / {{sig.factor}}));
+    uint64_t& w = words[{{0 if sig.is_little_endian else 1}}];
+    w = (w & ~(0x{{"%X" % (2**sig.size - 1)}}ULL << {{shift}})) | ((ival & 0x{{"%X" % (2**sig.size - 1)}}ULL) << {{shift}});
+  }
+    {% endif %}
+  {% endfor %}
+
+  uint64_t ret = words[1] | __builtin_bswap64(words[0]);
+  {% for sig in sigs if sig.name == "COUNTER" %}
+  if (counter >= 0) {
+  {{set_field(sig, "counter")}}
+  }
+  {% endfor %}
+  {% for sig in sigs if sig.name == "CHECKSUM" and checksum_funcs.get(sig_type(address, sig)) %}
+  {{set_field(sig, "%s(%d, ret, %d)" % (checksum_funcs[sig_type(address, sig)], address, msg_size))}}
+  {% endfor %}
+  return ret;
+}
+
+{% endfor %}
+const MsgCodec codecs[] = {
+{% for address, msg_name, msg_size, sigs in msgs %}
+  {
+    .decode = decode_{{address}},
+    .encode = encode_{{address}},
+  },
+{% endfor %}
+};
+{% endif %}
+
 const Val vals[] = {
 {% for address, sig in def_vals %}
   {% for sg_name, def_val in sig %}
@@ -74,6 +165,9 @@ const DBC {{dbc.name}} = {
   .msgs = msgs,
   .vals = vals,
   .num_vals = ARRAYSIZE(vals),
+{% if codegen %}
+  .codecs = codecs,
+{% endif %}
 };
 
 dbc_init({{dbc.name}})
@@ -33,6 +33,18 @@ typedef struct {
   double value;
 } SignalValue;
 
+typedef struct {
+  uint32_t address;
+  uint16_t ts;
+  uint64_t seen;
+} MessageTimestamp;
+
+typedef struct {
+  uint32_t address;
+  uint64_t seen;
+  uint64_t missing;
+} MessageTimeout;
+
 
 typedef enum {
   DEFAULT,
@@ -41,6 +53,7 @@ typedef enum {
   TOYOTA_CHECKSUM,
   PEDAL_CHECKSUM,
   PEDAL_COUNTER,
+  CHRYSLER_CHECKSUM,
 } SignalType;
 
 typedef struct {
@@ -72,6 +85,7 @@ typedef struct {
   const Msg *msgs;
   const Val *vals;
   size_t num_vals;
+  const void *codecs;
 } DBC;
 
 
@@ -84,11 +98,23 @@ int can_update(void* can, uint64_t sec, bool wait);
 
 size_t can_query_latest(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
 
+void can_update_strings(void *can, size_t num_strings, const char** dats, const size_t* lens);
+
+void can_query_changed(void* can, bool *out_can_valid,
+                       const SignalValue **out_values, size_t *out_num_values,
+                       const MessageTimestamp **out_msgs, size_t *out_num_msgs);
+
+void can_query_timeouts(void* can, const MessageTimeout **out_timeouts, size_t *out_num_timeouts);
+
 const DBC* dbc_lookup(const char* dbc_name);
 
 void* canpack_init(const char* dbc_name);
 
 uint64_t canpack_pack(void* inst, uint32_t address, size_t num_vals, const SignalPackValue *vals, int counter);
+
+int canpack_compile(void* inst, uint32_t address, size_t num_sigs, const char* const* sig_names);
+
+uint64_t canpack_pack_handle(void* inst, int handle, const double *values, int counter);
 """)
 
 libdbc = ffi.dlopen(libdbc_fn)
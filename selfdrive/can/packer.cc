@@ -1,10 +1,12 @@
 #include <cassert>
+#include <cstdlib>
 #include <string>
 #include <vector>
 #include <utility>
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <cstring>
 
 #include "common.h"
 
@@ -26,8 +28,9 @@ namespace {
 
   uint64_t set_value(uint64_t ret, Signal sig, int64_t ival){
     int shift = sig.is_little_endian? sig.b1 : sig.bo;
-    uint64_t mask = ((1ULL << sig.b2)-1) << shift;
-    uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
+    uint64_t value_mask = sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1;
+    uint64_t mask = value_mask << shift;
+    uint64_t dat = (ival & value_mask) << shift;
     if (sig.is_little_endian) {
       dat = ReverseBytes(dat);
       mask = ReverseBytes(mask);
@@ -37,15 +40,46 @@ namespace {
     return ret;
   }
 
+  // A signal resolved for packing. Little endian signals are assembled in a
+  // separate byte reversed word so only one ReverseBytes is needed per message.
+  struct PackSignal {
+    uint64_t mask; // value mask, before shifting
+    uint8_t shift;
+    uint8_t word;  // 0 = little endian, 1 = big endian
+    double factor, offset;
+  };
+
+  // (address, signal names) resolved once by CANPacker::compile
+  struct PackPlan {
+    uint32_t address;
+    unsigned int size;
+    std::vector<PackSignal> sigs;
+    bool has_counter;
+    Signal counter;
+    ChecksumFunc checksum;
+    Signal checksum_sig;
+
+    // generated encoder, if the dbc was built with codegen. values are
+    // scattered into codec_vals at codec_index, codec_mask selects them
+    const MsgCodec *codec;
+    std::vector<uint8_t> codec_index;
+    std::vector<double> codec_vals;
+    uint64_t codec_mask;
+  };
+
   class CANPacker {
   public:
     CANPacker(const std::string& dbc_name) {
       dbc = dbc_lookup(dbc_name);
       assert(dbc);
 
+      const bool use_codecs = dbc->codecs && !getenv("DBC_NO_CODEGEN");
       for (int i=0; i<dbc->num_msgs; i++) {
         const Msg* msg = &dbc->msgs[i];
         message_lookup[msg->address] = *msg;
+        if (use_codecs) {
+          codec_lookup[msg->address] = &dbc->codecs[i];
+        }
         for (int j=0; j<msg->num_sigs; j++) {
           const Signal* sig = &msg->sigs[j];
           signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
@@ -92,12 +126,9 @@ namespace {
       auto sig_it = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
       if (sig_it != signal_lookup.end()) {
         auto sig = sig_it->second;
-        if (sig.type == SignalType::HONDA_CHECKSUM){
-          unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-          ret = set_value(ret, sig, chksm);
-        }
-        else if (sig.type == SignalType::TOYOTA_CHECKSUM){
-          unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
+        ChecksumFunc checksum = checksum_lookup(sig.type);
+        if (checksum) {
+          unsigned int chksm = checksum(address, ret, message_lookup[address].size);
           ret = set_value(ret, sig, chksm);
         } else {
           //WARN("CHECKSUM signal type not valid\n");
@@ -107,12 +138,121 @@ namespace {
       return ret;
     }
 
+    // Resolves the signal names once so pack_plan can work from an array of
+    // values in the same order. Unknown signals are ignored when packing.
+    int compile(uint32_t address, size_t num_sigs, const char* const* sig_names) {
+      PackPlan plan = {};
+      plan.address = address;
+
+      const Msg *msg = NULL;
+      auto msg_it = message_lookup.find(address);
+      if (msg_it == message_lookup.end()) {
+        WARN("undefined message %d\n", address);
+      } else {
+        msg = &msg_it->second;
+        plan.size = msg->size;
+
+        auto codec_it = codec_lookup.find(address);
+        if (codec_it != codec_lookup.end()) {
+          plan.codec = codec_it->second;
+          // one spare slot for signals that aren't in the message
+          plan.codec_vals.resize(msg->num_sigs + 1);
+        }
+      }
+
+      for (size_t i = 0; i < num_sigs; i++) {
+        PackSignal ps = {};
+        ps.factor = 1.0;
+
+        auto sig_it = signal_lookup.find(std::make_pair(address, std::string(sig_names[i])));
+        if (sig_it == signal_lookup.end()) {
+          WARN("undefined signal %s - %d\n", sig_names[i], address);
+        } else {
+          const Signal& sig = sig_it->second;
+          ps.mask = sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1;
+          ps.shift = sig.is_little_endian ? sig.b1 : sig.bo;
+          ps.word = sig.is_little_endian ? 0 : 1;
+          ps.factor = sig.factor;
+          ps.offset = sig.offset;
+        }
+        plan.sigs.push_back(ps);
+
+        if (plan.codec) {
+          // last match, like signal_lookup for duplicate signal names
+          int index = msg->num_sigs;
+          for (int j = 0; j < msg->num_sigs; j++) {
+            if (strcmp(msg->sigs[j].name, sig_names[i]) == 0) {
+              index = j;
+            }
+          }
+          if (index < msg->num_sigs) {
+            plan.codec_mask |= 1ULL << index;
+          }
+          plan.codec_index.push_back(index);
+        }
+      }
+
+      auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
+      if (sig_it != signal_lookup.end()) {
+        plan.has_counter = true;
+        plan.counter = sig_it->second;
+        if (plan.counter.type != SignalType::HONDA_COUNTER){
+          WARN("COUNTER signal type not valid\n");
+        }
+      }
+
+      sig_it = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
+      if (sig_it != signal_lookup.end()) {
+        plan.checksum = checksum_lookup(sig_it->second.type);
+        plan.checksum_sig = sig_it->second;
+      }
+
+      plans.push_back(plan);
+      return plans.size() - 1;
+    }
+
+    uint64_t pack_plan(int handle, const double *values, int counter) {
+      PackPlan& plan = plans[handle];
+
+      // messages without a COUNTER take the generic path so it can warn
+      if (plan.codec && (counter < 0 || plan.has_counter)) {
+        for (size_t i = 0; i < plan.codec_index.size(); i++) {
+          plan.codec_vals[plan.codec_index[i]] = values[i];
+        }
+        return plan.codec->encode(plan.codec_vals.data(), plan.codec_mask, counter);
+      }
+
+      uint64_t words[2] = {0, 0};
+      for (size_t i = 0; i < plan.sigs.size(); i++) {
+        const PackSignal& ps = plan.sigs[i];
+        int64_t ival = (int64_t)(round((values[i] - ps.offset) / ps.factor));
+        uint64_t& w = words[ps.word];
+        w = (w & ~(ps.mask << ps.shift)) | ((ival & ps.mask) << ps.shift);
+      }
+      uint64_t ret = words[1] | ReverseBytes(words[0]);
+
+      if (counter >= 0){
+        if (!plan.has_counter) {
+          WARN("COUNTER not defined\n");
+          return ret;
+        }
+        ret = set_value(ret, plan.counter, counter);
+      }
+
+      if (plan.checksum) {
+        unsigned int chksm = plan.checksum(plan.address, ret, plan.size);
+        ret = set_value(ret, plan.checksum_sig, chksm);
+      }
 
+      return ret;
+    }
 
   private:
     const DBC *dbc = NULL;
     std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
     std::map<uint32_t, Msg> message_lookup;
+    std::map<uint32_t, const MsgCodec*> codec_lookup;
+    std::vector<PackPlan> plans;
   };
 
 }
@@ -133,4 +273,14 @@ extern "C" {
     CANPacker *cp = (CANPacker*)inst;
     return cp->pack(address, signals, counter);
   }
+
+  int canpack_compile(void* inst, uint32_t address, size_t num_sigs, const char* const* sig_names) {
+    CANPacker *cp = (CANPacker*)inst;
+    return cp->compile(address, num_sigs, sig_names);
+  }
+
+  uint64_t canpack_pack_handle(void* inst, int handle, const double *values, int counter) {
+    CANPacker *cp = (CANPacker*)inst;
+    return cp->pack_plan(handle, values, counter);
+  }
 }
@@ -18,7 +18,8 @@ ctypedef enum SignalType:
   HONDA_COUNTER,
   TOYOTA_CHECKSUM,
   PEDAL_CHECKSUM,
-  PEDAL_COUNTER
+  PEDAL_COUNTER,
+  CHRYSLER_CHECKSUM
 
 cdef struct Signal:
   const char* name
@@ -51,6 +52,8 @@ cdef struct DBC:
 
 ctypedef void * (*canpack_init_func)(const char* dbc_name)
 ctypedef uint64_t (*canpack_pack_vector_func)(void* inst, uint32_t address, const vector[SignalPackValue] &signals, int counter)
+ctypedef int (*canpack_compile_func)(void* inst, uint32_t address, size_t num_sigs, const char** sig_names)
+ctypedef uint64_t (*canpack_pack_handle_func)(void* inst, int handle, const double* values, int counter)
 ctypedef const DBC * (*dbc_lookup_func)(const char* dbc_name)
 
 
@@ -61,6 +64,10 @@ cdef class CANPacker(object):
   cdef map[int, int] address_to_size
   cdef canpack_init_func canpack_init
   cdef canpack_pack_vector_func canpack_pack_vector
+  cdef canpack_compile_func canpack_compile
+  cdef canpack_pack_handle_func canpack_pack_handle
+  cdef dict handles
+  cdef vector[double] pack_values
   cdef dbc_lookup_func dbc_lookup
 
   def __init__(self, dbc_name):
@@ -70,6 +77,9 @@ cdef class CANPacker(object):
     cdef void *libdbc = dlopen(libdbc_fn, RTLD_LAZY)
     self.canpack_init = <canpack_init_func>dlsym(libdbc, 'canpack_init')
     self.canpack_pack_vector = <canpack_pack_vector_func>dlsym(libdbc, 'canpack_pack_vector')
+    self.canpack_compile = <canpack_compile_func>dlsym(libdbc, 'canpack_compile')
+    self.canpack_pack_handle = <canpack_pack_handle_func>dlsym(libdbc, 'canpack_pack_handle')
+    self.handles = {}
     self.dbc_lookup = <dbc_lookup_func>dlsym(libdbc, 'dbc_lookup')
     self.packer = self.canpack_init(dbc_name)
     self.dbc = self.dbc_lookup(dbc_name)
@@ -79,15 +89,26 @@ cdef class CANPacker(object):
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
 
+  cdef int get_handle(self, addr, names):
+    # signal names are resolved once per (address, set of keys)
+    cdef vector[const char*] sig_names
+    key = (addr, names)
+    handle = self.handles.get(key)
+    if handle is None:
+      for name in names:
+        sig_names.push_back(name)
+      handle = self.canpack_compile(self.packer, addr, sig_names.size(), sig_names.data())
+      self.handles[key] = handle
+    return handle
+
   cdef uint64_t pack(self, addr, values, counter):
-    cdef vector[SignalPackValue] values_thing
-    cdef SignalPackValue spv
-    for name, value in values.iteritems():
-      spv.name = name
-      spv.value = value
-      values_thing.push_back(spv)
-
-    return self.canpack_pack_vector(self.packer, addr, values_thing, counter)
+    cdef int handle = self.get_handle(addr, tuple(values))
+
+    self.pack_values.clear()
+    for value in values.itervalues():
+      self.pack_values.push_back(value)
+
+    return self.canpack_pack_handle(self.packer, handle, self.pack_values.data(), counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
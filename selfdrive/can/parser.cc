@@ -1,22 +1,20 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 #include <cassert>
 #include <cstring>
 
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-
 #include <string>
 #include <vector>
 #include <algorithm>
-#include <unordered_map>
+#include <functional>
+#include <utility>
 
 #include <zmq.h>
 
 #include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/common/aligned_buffer.h"
 
 #include "common.h"
 
@@ -27,137 +25,167 @@
 
 #define MAX_BAD_COUNTER 5
 
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 4; // remove checksum
-
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
-  s = 8-s;
-  s &= 0xF;
-
-  return s;
-}
-
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
-
-  unsigned int s = l;
-  while (address) { s += address & 0xff; address >>= 8; }
-  while (d) { s += d & 0xff; d >>= 8; }
-
-  return s & 0xFF;
-}
-
-unsigned int pedal_checksum(unsigned int address, uint64_t d, int l) {
-  uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
-
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
-
-  uint8_t *dat = (uint8_t *)&d;
-
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= dat[i];
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
-  }
-  return crc;
-}
-
 namespace {
 
-uint64_t read_u64_be(const uint8_t* v) {
-  return (((uint64_t)v[0] << 56)
-          | ((uint64_t)v[1] << 48)
-          | ((uint64_t)v[2] << 40)
-          | ((uint64_t)v[3] << 32)
-          | ((uint64_t)v[4] << 24)
-          | ((uint64_t)v[5] << 16)
-          | ((uint64_t)v[6] << 8)
-          | (uint64_t)v[7]);
-}
-
-uint64_t read_u64_le(const uint8_t* v) {
-  return ((uint64_t)v[0]
-          | ((uint64_t)v[1] << 8)
-          | ((uint64_t)v[2] << 16)
-          | ((uint64_t)v[3] << 24)
-          | ((uint64_t)v[4] << 32)
-          | ((uint64_t)v[5] << 40)
-          | ((uint64_t)v[6] << 48)
-          | ((uint64_t)v[7] << 56));
-}
-
+// checksum or counter signal, verified before any value of the message is decoded
+struct MessageCheck {
+  ChecksumFunc checksum; // NULL for counters
+  size_t sig;
+  int size;
+};
 
 struct MessageState {
   uint32_t address;
   unsigned int size;
 
-  std::vector<Signal> parse_sigs;
+  // which byte order views of the frame the plan reads from
+  bool needs_le;
+  bool needs_be;
+
+  // decode plan, built once per message. one entry per tracked signal,
+  // stored as parallel arrays so parse() is a flat shift/mask/scale loop
+  std::vector<const char*> sig_names;
+  std::vector<uint8_t> sig_words; // index into the {le, be} words of the frame
+  std::vector<uint8_t> sig_shifts;
+  std::vector<uint64_t> sig_masks;
+  std::vector<uint64_t> sig_signs; // sign bit for signed signals, 0 otherwise
+  std::vector<double> sig_factors;
+  std::vector<double> sig_offsets;
   std::vector<double> vals;
+  std::vector<uint32_t> sig_gens; // parser generation in which each value last changed
+
+  std::vector<MessageCheck> checks;
+
+  // generated decoder, if the dbc was built with codegen. it fills decoded
+  // with every signal of the message, sig_index maps tracked signals into it
+  const MsgCodec *codec;
+  std::vector<uint8_t> sig_index;
+  std::vector<double> decoded;
 
   uint16_t ts;
   uint64_t seen;
   uint64_t check_threshold;
+  uint32_t gen; // parser generation in which this message was last parsed
+  int timeout_pos; // index in CANParser::timed_out, -1 if not timed out
 
   uint8_t counter;
   uint8_t counter_fail;
 
-  bool parse(uint64_t sec, uint16_t ts_, uint64_t dat) {
-    for (int i=0; i < parse_sigs.size(); i++) {
-      auto& sig = parse_sigs[i];
-      int64_t tmp;
+  void add_signal(const Signal &sig, int index, double default_value) {
+    if (sig.is_little_endian) {
+      needs_le = true;
+    } else {
+      needs_be = true;
+    }
 
-      if (sig.is_little_endian){
-        tmp = (dat >> sig.b1) & ((1ULL << sig.b2)-1);
-      } else {
-        tmp = (dat >> sig.bo) & ((1ULL << sig.b2)-1);
-      }
+    if (sig.type != SignalType::DEFAULT) {
+      ChecksumFunc checksum = checksum_lookup(sig.type);
 
-      if (sig.is_signed) {
-        tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
+      // checksums are always computed over the big endian view
+      if (checksum) {
+        needs_be = true;
       }
 
-      DEBUG("parse %X %s -> %lld\n", address, sig.name, tmp);
+      checks.push_back((MessageCheck){
+        .checksum = checksum,
+        .sig = sig_names.size(),
+        .size = sig.b2,
+      });
+    }
+
+    sig_names.push_back(sig.name);
+    sig_index.push_back(index);
+    sig_words.push_back(sig.is_little_endian ? 0 : 1);
+    sig_shifts.push_back(sig.is_little_endian ? sig.b1 : sig.bo);
+    sig_masks.push_back(sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1);
+    sig_signs.push_back(sig.is_signed ? (1ULL << (sig.b2 - 1)) : 0);
+    sig_factors.push_back(sig.factor);
+    sig_offsets.push_back(sig.offset);
+    vals.push_back(default_value);
+    sig_gens.push_back(0);
+  }
+
+  bool parse(uint64_t sec, uint16_t ts_, const uint8_t *dat, uint32_t generation) {
+    if (codec) {
+      return parse_codec(sec, ts_, dat, generation);
+    }
+
+    // each byte order view is computed at most once per frame, and only if
+    // one of the tracked signals reads from it
+    uint64_t words[2] = {0, 0};
+    if (needs_le) words[0] = read_u64_le(dat);
+    if (needs_be) words[1] = read_u64_be(dat);
+    const uint64_t be = words[1];
 
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat, size) != tmp) {
+    DEBUG("  proc %X: le %llx be %llx\n", address, words[0], words[1]);
+
+    // checksums and counters first, a failing frame leaves all values untouched
+    for (const auto& check : checks) {
+      int64_t tmp = (words[sig_words[check.sig]] >> sig_shifts[check.sig]) & sig_masks[check.sig];
+
+      DEBUG("check %X %s -> %lld\n", address, sig_names[check.sig], tmp);
+
+      if (check.checksum) {
+        if (check.checksum(address, be, size) != tmp) {
           INFO("%X CHECKSUM FAIL\n", address);
           return false;
         }
-      } else if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        if (toyota_checksum(address, dat, size) != tmp) {
+      } else if (!update_counter_generic(tmp, check.size)) {
+        return false;
+      }
+    }
+
+    const size_t num_sigs = vals.size();
+    const uint8_t *sel = sig_words.data();
+    const uint8_t *shifts = sig_shifts.data();
+    const uint64_t *masks = sig_masks.data();
+    const uint64_t *signs = sig_signs.data();
+    const double *factors = sig_factors.data();
+    const double *offsets = sig_offsets.data();
+    double *out = vals.data();
+    uint32_t *gens = sig_gens.data();
+
+    for (size_t i = 0; i < num_sigs; i++) {
+      int64_t tmp = (words[sel[i]] >> shifts[i]) & masks[i];
+      tmp = (tmp ^ signs[i]) - signs[i]; // sign extend, no-op for unsigned signals
+      const double v = tmp * factors[i] + offsets[i];
+      gens[i] = (v != out[i]) ? generation : gens[i];
+      out[i] = v;
+    }
+
+    ts = ts_;
+    seen = sec;
+
+    return true;
+  }
+
+  bool parse_codec(uint64_t sec, uint16_t ts_, const uint8_t *dat, uint32_t generation) {
+    double *dec = decoded.data();
+    const bool checksum_ok = codec->decode(dat, dec);
+
+    // same order of checks as the generic path, so counters see the same frames
+    for (const auto& check : checks) {
+      if (check.checksum) {
+        if (!checksum_ok) {
           INFO("%X CHECKSUM FAIL\n", address);
           return false;
         }
-      } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-        if (pedal_checksum(address, dat, size) != tmp) {
-          INFO("%X PEDAL CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
+      } else if (!update_counter_generic((int64_t)dec[sig_index[check.sig]], check.size)) {
+        return false;
       }
+    }
 
-      vals[i] = tmp * sig.factor + sig.offset;
+    const size_t num_sigs = vals.size();
+    const uint8_t *index = sig_index.data();
+    double *out = vals.data();
+    uint32_t *gens = sig_gens.data();
+
+    for (size_t i = 0; i < num_sigs; i++) {
+      const double v = dec[index[i]];
+      gens[i] = (v != out[i]) ? generation : gens[i];
+      out[i] = v;
     }
+
     ts = ts_;
     seen = sec;
 
@@ -224,6 +252,8 @@ class CANParser {
 
     dbc = dbc_lookup(dbc_name);
     assert(dbc); 
+    // DBC_NO_CODEGEN takes the generic path in a codegen build, to compare them
+    const MsgCodec *codecs = getenv("DBC_NO_CODEGEN") ? NULL : dbc->codecs;
     for (const auto& op : options) {
       MessageState state = {
         .address = op.address,
@@ -240,6 +270,7 @@ class CANParser {
       for (int i=0; i<dbc->num_msgs; i++) {
         if (dbc->msgs[i].address == op.address) {
           msg = &dbc->msgs[i];
+          state.codec = codecs ? &codecs[i] : NULL;
           break;
         }
       }
@@ -249,13 +280,15 @@ class CANParser {
       }
 
       state.size = msg->size;
+      if (state.codec) {
+        state.decoded.resize(msg->num_sigs);
+      }
 
       // track checksums and counters for this message
       for (int i=0; i<msg->num_sigs; i++) {
         const Signal *sig = &msg->sigs[i];
         if (sig->type != SignalType::DEFAULT) {
-          state.parse_sigs.push_back(*sig);
-          state.vals.push_back(0);
+          state.add_signal(*sig, i, 0);
         }
       }
 
@@ -267,21 +300,61 @@ class CANParser {
           const Signal *sig = &msg->sigs[i];
           if (strcmp(sig->name, sigop.name) == 0
               && sig->type == SignalType::DEFAULT) {
-            state.parse_sigs.push_back(*sig);
-            state.vals.push_back(sigop.default_value);
+            state.add_signal(*sig, i, sigop.default_value);
             break;
           }
         }
 
       }
 
-      message_states[state.address] = state;
+      // later options for the same address replace earlier ones
+      bool replaced = false;
+      for (auto& existing : message_states) {
+        if (existing.address == state.address) {
+          existing = state;
+          replaced = true;
+          break;
+        }
+      }
+      if (!replaced) {
+        message_states.push_back(state);
+      }
+    }
+
+    build_lookup();
+
+    // every checked message starts out waiting for its first frame. each one is
+    // either in the deadline heap or in timed_out, so neither ever reallocates
+    deadlines.reserve(message_states.size());
+    timed_out.reserve(message_states.size());
+    timeouts.reserve(message_states.size());
+    for (size_t i = 0; i < message_states.size(); i++) {
+      auto& state = message_states[i];
+      state.timeout_pos = -1;
+      if (state.check_threshold > 0) {
+        deadlines.push_back(std::make_pair(state.check_threshold, (uint32_t)i));
+      }
+    }
+    std::make_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
+
+    // preallocate the query_changed outputs for the worst case
+    size_t num_sigs = 0;
+    for (const auto& state : message_states) {
+      num_sigs += state.vals.size();
     }
+    updated.reserve(message_states.size());
+    updated_msgs.reserve(message_states.size());
+    changed_values.reserve(num_sigs);
+  }
+
+  // starts a new generation, query_changed reports what changed since this call
+  void BeginBatch() {
+    generation++;
+    updated.clear();
   }
 
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
       int msg_count = cans.size();
-      uint64_t p;
 
       DEBUG("got %d messages\n", msg_count);
 
@@ -292,8 +365,8 @@ class CANParser {
           // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
           continue;
         }
-        auto state_it = message_states.find(cmsg.getAddress());
-        if (state_it == message_states.end()) {
+        MessageState *state = find_state(cmsg.getAddress());
+        if (state == NULL) {
           // DEBUG("skip %d: not specified\n", cmsg.getAddress());
           continue;
         }
@@ -302,48 +375,86 @@ class CANParser {
         uint8_t dat[8] = {0};
         memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
 
-        // Assumes all signals in the message are of the same type (little or big endian)
-        // TODO: allow signals within the same message to have different endianess
-        auto& sig = message_states[cmsg.getAddress()].parse_sigs[0];
-        if (sig.is_little_endian) {
-            p = read_u64_le(dat);
-        } else {
-            p = read_u64_be(dat);
+        if (!state->parse(sec, cmsg.getBusTime(), dat, generation)) continue;
+
+        const uint32_t idx = state - message_states.data();
+        if (state->gen != generation) {
+          state->gen = generation;
+          updated.push_back(idx);
         }
+        if (state->timeout_pos >= 0) {
+          Recovered(idx);
+        }
+      }
+  }
 
-        DEBUG("  proc %X: %llx\n", cmsg.getAddress(), p);
+  // a timed out message was received again, it goes back on the deadline heap
+  void Recovered(uint32_t idx) {
+    auto& state = message_states[idx];
 
-        state_it->second.parse(sec, cmsg.getBusTime(), p);
-      }
+    const uint32_t last = timed_out.back();
+    timed_out[state.timeout_pos] = last;
+    message_states[last].timeout_pos = state.timeout_pos;
+    timed_out.pop_back();
+    state.timeout_pos = -1;
+
+    deadlines.push_back(std::make_pair(state.seen + state.check_threshold, idx));
+    std::push_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
   }
 
+  // only looks at messages whose deadline passed. heap entries aren't updated
+  // when a message is received, a stale entry is pushed again with the new
+  // deadline once it reaches the top
   void UpdateValid(uint64_t sec) {
-    can_valid = true;
-    for (const auto& kv : message_states) {
-      const auto& state = kv.second;
-      if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
+    if (start_sec == 0) {
+      start_sec = sec;
+    }
+
+    while (!deadlines.empty() && deadlines.front().first < sec) {
+      std::pop_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
+      const uint32_t idx = deadlines.back().second;
+      deadlines.pop_back();
+
+      auto& state = message_states[idx];
+      const uint64_t deadline = state.seen + state.check_threshold;
+      if (deadline >= sec) {
+        deadlines.push_back(std::make_pair(deadline, idx));
+        std::push_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
+      } else {
         if (state.seen > 0) {
           DEBUG("%X TIMEOUT\n", state.address);
         }
-        can_valid = false;
+        state.timeout_pos = timed_out.size();
+        timed_out.push_back(idx);
       }
     }
-  }
 
-  void update_string(std::string data) {
-    // format for board, make copy due to alignment issues, will be freed on out of scope
-    auto amsg = kj::heapArray<capnp::word>((data.length() / sizeof(capnp::word)) + 1);
-    memcpy(amsg.begin(), data.data(), data.length());
+    can_valid = timed_out.empty();
+  }
 
-    // extract the messages
-    capnp::FlatArrayMessageReader cmsg(amsg);
+  void UpdateString(const char* data, size_t len) {
+    // extract the messages, only copies if the python string is misaligned
+    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(data, len));
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
     last_sec = event.getLogMonoTime();
 
     auto cans = event.getCan();
     UpdateCans(last_sec, cans);
+  }
 
+  void update_string(const char* data, size_t len) {
+    BeginBatch();
+    UpdateString(data, len);
+    UpdateValid(last_sec);
+  }
+
+  // parses several can events as one batch
+  void update_strings(size_t num_strings, const char* const* data, const size_t* lens) {
+    BeginBatch();
+    for (size_t i = 0; i < num_strings; i++) {
+      UpdateString(data[i], lens[i]);
+    }
     UpdateValid(last_sec);
   }
 
@@ -355,6 +466,8 @@ class CANParser {
     zmq_msg_t msg;
     zmq_msg_init(&msg);
 
+    BeginBatch();
+
     // multiple recv is fine
     bool first = wait;
     while (subscriber != NULL) {
@@ -371,12 +484,8 @@ class CANParser {
       }
       if (err < 0) break;
 
-      // format for board, make copy due to alignment issues, will be freed on out of scope
-      auto amsg = kj::heapArray<capnp::word>((zmq_msg_size(&msg) / sizeof(capnp::word)) + 1);
-      memcpy(amsg.begin(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-
-      // extract the messages
-      capnp::FlatArrayMessageReader cmsg(amsg);
+      // extract the messages, read in place unless zmq handed us a misaligned buffer
+      capnp::FlatArrayMessageReader cmsg(aligned_buf.align(zmq_msg_data(&msg), zmq_msg_size(&msg)));
       cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
       auto cans = event.getCan();
@@ -392,16 +501,18 @@ class CANParser {
   std::vector<SignalValue> query_latest() {
     std::vector<SignalValue> ret;
 
-    for (const auto& kv : message_states) {
-      const auto& state = kv.second;
+    // before the first update every message is reported with its defaults,
+    // after that only the ones parsed in the last update can match last_sec
+    const size_t num_states = last_sec != 0 ? updated.size() : message_states.size();
+    for (size_t j = 0; j < num_states; j++) {
+      const auto& state = message_states[last_sec != 0 ? updated[j] : j];
       if (last_sec != 0 && state.seen != last_sec) continue;
 
-      for (int i=0; i<state.parse_sigs.size(); i++) {
-        const Signal &sig = state.parse_sigs[i];
+      for (int i=0; i<state.vals.size(); i++) {
         ret.push_back((SignalValue){
           .address = state.address,
           .ts = state.ts,
-          .name = sig.name,
+          .name = state.sig_names[i],
           .value = state.vals[i],
         });
       }
@@ -410,6 +521,51 @@ class CANParser {
     return ret;
   }
 
+  // signals whose value changed and messages parsed since the last BeginBatch.
+  // the outputs are owned by the parser and valid until the next update
+  void query_changed(const std::vector<SignalValue> **out_values,
+                     const std::vector<MessageTimestamp> **out_msgs) {
+    changed_values.clear();
+    updated_msgs.clear();
+
+    for (uint32_t idx : updated) {
+      const auto& state = message_states[idx];
+      updated_msgs.push_back((MessageTimestamp){
+        .address = state.address,
+        .ts = state.ts,
+        .seen = state.seen,
+      });
+
+      for (int i=0; i<state.vals.size(); i++) {
+        if (state.sig_gens[i] != generation) continue;
+        changed_values.push_back((SignalValue){
+          .address = state.address,
+          .ts = state.ts,
+          .name = state.sig_names[i],
+          .value = state.vals[i],
+        });
+      }
+    }
+
+    *out_values = &changed_values;
+    *out_msgs = &updated_msgs;
+  }
+
+  // messages that are currently timed out, owned by the parser
+  const std::vector<MessageTimeout>& query_timeouts() {
+    timeouts.clear();
+    for (uint32_t idx : timed_out) {
+      const auto& state = message_states[idx];
+      const uint64_t since = state.seen > 0 ? state.seen : start_sec;
+      timeouts.push_back((MessageTimeout){
+        .address = state.address,
+        .seen = state.seen,
+        .missing = last_sec > since ? last_sec - since : 0,
+      });
+    }
+    return timeouts;
+  }
+
   bool can_valid = false;
   uint64_t last_sec = 0;
 
@@ -418,9 +574,67 @@ class CANParser {
   // zmq vars
   void *context = NULL;
   void *subscriber = NULL;
+  AlignedBuffer aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  std::vector<MessageState> message_states;
+
+  // change tracking for query_changed
+  uint32_t generation = 0;
+  std::vector<uint32_t> updated; // indices into message_states
+  std::vector<SignalValue> changed_values;
+  std::vector<MessageTimestamp> updated_msgs;
+
+  // timeout tracking, a min-heap of (deadline, state index) for the checked
+  // messages that haven't timed out and the list of the ones that have
+  typedef std::pair<uint64_t, uint32_t> Deadline;
+  std::vector<Deadline> deadlines;
+  std::vector<uint32_t> timed_out;
+  std::vector<MessageTimeout> timeouts;
+  uint64_t start_sec = 0;
+
+  // open addressing table from address to message state, built once after
+  // all states are known. kept at most 25% full so nearly every frame
+  // resolves in a single probe
+  struct LookupSlot {
+    uint32_t address;
+    int state; // index into message_states, -1 if the slot is empty
+  };
+  std::vector<LookupSlot> lookup;
+  uint32_t lookup_mask = 0;
+  int lookup_shift = 32;
+
+  static uint32_t lookup_hash(uint32_t address) {
+    return address * 2654435761U; // Knuth multiplicative hash
+  }
+
+  void build_lookup() {
+    int bits = 3;
+    while ((1U << bits) < message_states.size() * 4) bits++;
+
+    lookup.assign(1U << bits, (LookupSlot){ .address = 0, .state = -1 });
+    lookup_mask = (1U << bits) - 1;
+    lookup_shift = 32 - bits;
+
+    for (int i = 0; i < message_states.size(); i++) {
+      uint32_t slot = lookup_hash(message_states[i].address) >> lookup_shift;
+      while (lookup[slot].state >= 0) {
+        slot = (slot + 1) & lookup_mask;
+      }
+      lookup[slot].address = message_states[i].address;
+      lookup[slot].state = i;
+    }
+  }
+
+  MessageState* find_state(uint32_t address) {
+    uint32_t slot = lookup_hash(address) >> lookup_shift;
+    while (true) {
+      const LookupSlot &l = lookup[slot];
+      if (l.state < 0) return NULL;
+      if (l.address == address) return &message_states[l.state];
+      slot = (slot + 1) & lookup_mask;
+    }
+  }
 };
 
 }
@@ -457,7 +671,7 @@ int can_update(void* can, uint64_t sec, bool wait) {
 
 void can_update_string(void *can, const char* dat, int len) {
   CANParser* cp = (CANParser*)can;
-  cp->update_string(std::string(dat, len));
+  cp->update_string(dat, len);
 }
 
 size_t can_query_latest(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values) {
@@ -482,98 +696,38 @@ void can_query_latest_vector(void* can, bool *out_can_valid, std::vector<SignalV
   values = cp->query_latest();
 };
 
+void can_update_strings(void *can, size_t num_strings, const char* const* dats, const size_t* lens) {
+  CANParser* cp = (CANParser*)can;
+  cp->update_strings(num_strings, dats, lens);
 }
 
-#ifdef TEST
-
-int main(int argc, char** argv) {
-  CANParser cp(0, "honda_civic_touring_2016_can",
-    std::vector<MessageParseOptions>{
-      // address, check_frequency
-      {0x14a, 100},
-      {0x158, 100},
-      {0x17c, 100},
-      {0x191, 100},
-      {0x1a4, 50},
-      {0x326, 10},
-      {0x1b0, 50},
-      {0x1d0, 50},
-      {0x305, 10},
-      {0x324, 10},
-      {0x405, 3},
-      {0x18f, 0},
-      {0x130, 0},
-      {0x296, 0},
-      {0x30c, 0},
-    },
-    std::vector<SignalParseOptions>{
-      //  sig_name, sig_address, default
-      {0x158, "XMISSION_SPEED", 0},
-      {0x1d0, "WHEEL_SPEED_FL", 0},
-      {0x1d0, "WHEEL_SPEED_FR", 0},
-      {0x1d0, "WHEEL_SPEED_RL", 0},
-      {0x14a, "STEER_ANGLE", 0},
-      {0x18f, "STEER_TORQUE_SENSOR", 0},
-      {0x191, "GEAR", 0},
-      {0x1b0, "WHEELS_MOVING", 1},
-      {0x405, "DOOR_OPEN_FL", 1},
-      {0x405, "DOOR_OPEN_FR", 1},
-      {0x405, "DOOR_OPEN_RL", 1},
-      {0x405, "DOOR_OPEN_RR", 1},
-      {0x324, "CRUISE_SPEED_PCM", 0},
-      {0x305, "SEATBELT_DRIVER_LAMP", 1},
-      {0x305, "SEATBELT_DRIVER_LATCHED", 0},
-      {0x17c, "BRAKE_PRESSED", 0},
-      {0x130, "CAR_GAS", 0},
-      {0x296, "CRUISE_BUTTONS", 0},
-      {0x1a4, "ESP_DISABLED", 1},
-      {0x30c, "HUD_LEAD", 0},
-      {0x1a4, "USER_BRAKE", 0},
-      {0x18f, "STEER_STATUS", 5},
-      {0x1d0, "WHEEL_SPEED_RR", 0},
-      {0x1b0, "BRAKE_ERROR_1", 1},
-      {0x1b0, "BRAKE_ERROR_2", 1},
-      {0x191, "GEAR_SHIFTER", 0},
-      {0x326, "MAIN_ON", 0},
-      {0x17c, "ACC_STATUS", 0},
-      {0x17c, "PEDAL_GAS", 0},
-      {0x296, "CRUISE_SETTING", 0},
-      {0x326, "LEFT_BLINKER", 0},
-      {0x326, "RIGHT_BLINKER", 0},
-      {0x324, "COUNTER", 0},
-      {0x17c, "ENGINE_RPM", 0},
-    });
-
-
-
-  const std::string log_fn = "dats.bin";
-
-  int log_fd = open(log_fn.c_str(), O_RDONLY, 0);
-  assert(log_fd >= 0);
-
-  off_t log_size = lseek(log_fd, 0, SEEK_END);
-  lseek(log_fd, 0, SEEK_SET);
-
-  void* log_data = mmap(NULL, log_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
-  assert(log_data);
-
-  auto words = kj::arrayPtr((const capnp::word*)log_data, log_size/sizeof(capnp::word));
-  while (words.size() > 0) {
-    capnp::FlatArrayMessageReader reader(words);
-
-    auto evt = reader.getRoot<cereal::Event>();
-    auto cans = evt.getCan();
-
-    cp.UpdateCans(0, cans);
-
-    words = kj::arrayPtr(reader.getEnd(), words.end());
-  }
+// out_timeouts points into an array owned by the parser,
+// it stays valid until the next query of this parser
+void can_query_timeouts(void* can, const MessageTimeout **out_timeouts, size_t *out_num_timeouts) {
+  CANParser* cp = (CANParser*)can;
+  const std::vector<MessageTimeout>& timeouts = cp->query_timeouts();
+  *out_timeouts = timeouts.data();
+  *out_num_timeouts = timeouts.size();
+}
 
-  munmap(log_data, log_size);
+// out_values and out_msgs point into arrays owned by the parser,
+// they stay valid until the next update of this parser
+void can_query_changed(void* can, bool *out_can_valid,
+                       const SignalValue **out_values, size_t *out_num_values,
+                       const MessageTimestamp **out_msgs, size_t *out_num_msgs) {
+  CANParser* cp = (CANParser*)can;
+  if (out_can_valid) {
+    *out_can_valid = cp->can_valid;
+  }
 
-  close(log_fd);
+  const std::vector<SignalValue> *values;
+  const std::vector<MessageTimestamp> *msgs;
+  cp->query_changed(&values, &msgs);
 
-  return 0;
+  *out_values = values->data();
+  *out_num_values = values->size();
+  *out_msgs = msgs->data();
+  *out_num_msgs = msgs->size();
 }
 
-#endif
+}
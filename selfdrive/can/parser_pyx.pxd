@@ -12,7 +12,8 @@ ctypedef enum SignalType:
   HONDA_COUNTER,
   TOYOTA_CHECKSUM,
   PEDAL_CHECKSUM,
-  PEDAL_COUNTER
+  PEDAL_COUNTER,
+  CHRYSLER_CHECKSUM
 
 cdef struct Signal:
   const char* name
@@ -59,6 +60,16 @@ cdef struct SignalValue:
   const char* name
   double value
 
+cdef struct MessageTimestamp:
+  uint32_t address
+  uint16_t ts
+  uint64_t seen
+
+cdef struct MessageTimeout:
+  uint32_t address
+  uint64_t seen
+  uint64_t missing
+
 ctypedef const DBC * (*dbc_lookup_func)(const char* dbc_name)
 ctypedef void* (*can_init_with_vectors_func)(int bus, const char* dbc_name,
                 vector[MessageParseOptions] message_options,
@@ -70,6 +81,11 @@ ctypedef int (*can_update_func)(void* can, uint64_t sec, bool wait);
 ctypedef void (*can_update_string_func)(void* can, const char* dat, int len);
 ctypedef size_t (*can_query_latest_func)(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
 ctypedef void (*can_query_latest_vector_func)(void* can, bool *out_can_valid,  vector[SignalValue] &values)
+ctypedef void (*can_update_strings_func)(void* can, size_t num_strings, const char** dats, const size_t* lens)
+ctypedef void (*can_query_changed_func)(void* can, bool *out_can_valid,
+                                        const SignalValue **out_values, size_t *out_num_values,
+                                        const MessageTimestamp **out_msgs, size_t *out_num_msgs)
+ctypedef void (*can_query_timeouts_func)(void* can, const MessageTimeout **out_timeouts, size_t *out_num_timeouts)
 
 cdef class CANParser:
   cdef:
@@ -80,9 +96,14 @@ cdef class CANParser:
     can_update_func can_update
     can_update_string_func can_update_string
     can_query_latest_vector_func can_query_latest_vector
+    can_update_strings_func can_update_strings
+    can_query_changed_func can_query_changed
+    can_query_timeouts_func can_query_timeouts
     map[string, uint32_t] msg_name_to_address
     map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
+    vector[const char*] batch_dats
+    vector[size_t] batch_lens
     bool test_mode_enabled
   cdef public:
     string dbc_name
@@ -91,4 +112,5 @@ cdef class CANParser:
     bool can_valid
     int can_invalid_cnt
 
+  cdef void init_vl(self)
   cdef unordered_set[uint32_t] update_vl(self)
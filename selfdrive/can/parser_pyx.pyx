@@ -19,6 +19,9 @@ cdef class CANParser:
     self.can_update = <can_update_func>dlsym(libdbc, 'can_update')
     self.can_update_string = <can_update_string_func>dlsym(libdbc, 'can_update_string')
     self.can_query_latest_vector = <can_query_latest_vector_func>dlsym(libdbc, 'can_query_latest_vector')
+    self.can_update_strings = <can_update_strings_func>dlsym(libdbc, 'can_update_strings')
+    self.can_query_changed = <can_query_changed_func>dlsym(libdbc, 'can_query_changed')
+    self.can_query_timeouts = <can_query_timeouts_func>dlsym(libdbc, 'can_query_timeouts')
     if checks is None:
       checks = []
 
@@ -35,10 +38,11 @@ cdef class CANParser:
       msg = self.dbc[0].msgs[i]
       self.msg_name_to_address[string(msg.name)] = msg.address
       self.address_to_msg_name[msg.address] = string(msg.name)
+      # lookups by address and by name share the same dict
       self.vl[msg.address] = {}
-      self.vl[str(msg.name)] = {}
+      self.vl[str(msg.name)] = self.vl[msg.address]
       self.ts[msg.address] = {}
-      self.ts[str(msg.name)] = {}
+      self.ts[str(msg.name)] = self.ts[msg.address]
 
     # Convert message names into addresses
     for i in range(len(signals)):
@@ -72,14 +76,28 @@ cdef class CANParser:
       message_options_v.push_back(mpo)
 
     self.can = self.can_init_with_vectors(bus, dbc_name, message_options_v, signal_options_v, sendcan, tcp_addr, timeout)
-    self.update_vl()
+    self.init_vl()
+
+  cdef void init_vl(self):
+    # fill in defaults for every tracked signal
+    cdef bool valid = False
+    self.can_query_latest_vector(self.can, &valid, self.can_values)
+
+    for cv in self.can_values:
+      self.vl[cv.address][string(cv.name)] = cv.value
+      self.ts[cv.address][string(cv.name)] = cv.ts
 
   cdef unordered_set[uint32_t] update_vl(self):
-    cdef string sig_name
     cdef unordered_set[uint32_t] updated_val
     cdef bool valid = False
+    cdef const SignalValue *values
+    cdef const MessageTimestamp *msgs
+    cdef size_t num_values = 0
+    cdef size_t num_msgs = 0
+    cdef size_t i
 
-    self.can_query_latest_vector(self.can, &valid, self.can_values)
+    # only signals that changed value in the last update are reported
+    self.can_query_changed(self.can, &valid, &values, &num_values, &msgs, &num_msgs)
 
     # Update invalid flag
     self.can_invalid_cnt += 1
@@ -87,16 +105,15 @@ cdef class CANParser:
         self.can_invalid_cnt = 0
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
+    for i in range(num_values):
+      self.vl[values[i].address][values[i].name] = values[i].value
 
-    for cv in self.can_values:
-      self.vl[cv.address][string(cv.name)] = cv.value
-      self.ts[cv.address][string(cv.name)] = cv.ts
-
-      sig_name = self.address_to_msg_name[cv.address]
-      self.vl[sig_name][string(cv.name)] = cv.value
-      self.ts[sig_name][string(cv.name)] = cv.ts
-
-      updated_val.insert(cv.address)
+    # every signal of a received message gets the new timestamp, even if its value didn't change
+    for i in range(num_msgs):
+      ts = self.ts[msgs[i].address]
+      for sig_name in ts:
+        ts[sig_name] = msgs[i].ts
+      updated_val.insert(msgs[i].address)
 
     return updated_val
 
@@ -105,13 +122,30 @@ cdef class CANParser:
     return self.update_vl()
 
   def update_strings(self, strings):
-    updated_vals = set()
+    # the batch points into the python strings, keep them alive until parsed
+    if not isinstance(strings, list):
+      strings = list(strings)
 
+    self.batch_dats.clear()
+    self.batch_lens.clear()
     for s in strings:
-      updated_val = self.update_string(s)
-      updated_vals.update(updated_val)
+      self.batch_dats.push_back(s)
+      self.batch_lens.push_back(len(s))
+
+    self.can_update_strings(self.can, self.batch_dats.size(), self.batch_dats.data(), self.batch_lens.data())
+    return self.update_vl()
 
-    return updated_vals
+  def timeouts(self):
+    """Messages that are timed out, as {name: seconds missing}"""
+    cdef const MessageTimeout *timeouts
+    cdef size_t num_timeouts = 0
+    cdef size_t i
+    self.can_query_timeouts(self.can, &timeouts, &num_timeouts)
+
+    ret = {}
+    for i in range(num_timeouts):
+      ret[self.address_to_msg_name[timeouts[i].address]] = timeouts[i].missing * 1e-9
+    return ret
 
   def update(self, uint64_t sec, bool wait):
     r = (self.can_update(self.can, sec, wait) >= 0)
@@ -9,12 +9,16 @@ from collections import Counter
 from common.dbc import dbc
 
 def main():
-  if len(sys.argv) != 3:
-    print "usage: %s dbc_directory output_directory" % (sys.argv[0],)
+  # --codegen also emits a specialized decode and encode function per message
+  args = [a for a in sys.argv[1:] if a != "--codegen"]
+  codegen = len(args) != len(sys.argv) - 1
+
+  if len(args) != 2:
+    print "usage: %s [--codegen] dbc_directory output_directory" % (sys.argv[0],)
     sys.exit(0)
 
-  dbc_dir = sys.argv[1]
-  out_dir = sys.argv[2]
+  dbc_dir = args[0]
+  out_dir = args[1]
 
   template_fn = os.path.join(os.path.dirname(__file__), "dbc_template.cc")
   template_mtime = os.path.getmtime(template_fn)
@@ -50,10 +54,15 @@ def main():
     elif can_dbc.name.startswith("toyota") or can_dbc.name.startswith("lexus"):
       checksum_type = "toyota"
       checksum_size = 8
+    elif can_dbc.name.startswith("chrysler"):
+      checksum_type = "chrysler"
+      checksum_size = 8
     else:
       checksum_type = None
 
     for address, msg_name, msg_size, sigs in msgs:
+      if codegen and len(sigs) > 64:
+        sys.exit("Too many signals for codegen %s" % msg_name)
       for sig in sigs:
         if checksum_type is not None and sig.name == "CHECKSUM":
           if sig.size != checksum_size:
@@ -62,6 +71,8 @@ def main():
             sys.exit("CHECKSUM starts at wrong bit %s" % msg_name)
           if checksum_type == "toyota" and sig.start_bit % 8 != 7:
             sys.exit("CHECKSUM starts at wrong bit %s" % msg_name)
+          if checksum_type == "chrysler" and sig.start_bit != msg_size*8 - 1:
+            sys.exit("CHECKSUM is not the last byte %s" % msg_name)
         if checksum_type == "honda" and sig.name == "COUNTER":
           if sig.size != 2:
             sys.exit("COUNTER is not 2 bits longs %s" % msg_name)
@@ -79,7 +90,7 @@ def main():
       if count > 1:
         sys.exit("Duplicate message name in DBC file %s" % name)
 
-    parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+    parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len, codegen=codegen)
 
 
     with open(out_fn, "w") as out_f:
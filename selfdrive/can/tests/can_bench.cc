@@ -0,0 +1,384 @@
+// Replays the can events of rlogs through CANParser and CANPacker for each
+// DBC and reports frames/s, ns/frame and heap allocations per frame. The
+// parser is on bus 0 and checks every message at the rate it has in the
+// logs, only bus 0 frames are counted for it.
+//
+// usage: can_bench [--dbc name]... [--dbc-dir dir] [--iterations n]
+//                  [--max-ns-per-frame ns] [--max-allocs-per-frame n]
+//                  rlog [rlog...]
+//
+// Logs can be raw capnp or bz2. Without --dbc every DBC in --dbc-dir
+// (default ../../opendbc) that is compiled into libdbc is benchmarked.
+// Exits with 1 if any DBC is over one of the --max thresholds.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <new>
+
+#include <dirent.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <bzlib.h>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "selfdrive/common/timing.h"
+
+#include "common.h"
+
+extern "C" {
+void* can_init(int bus, const char* dbc_name,
+               size_t num_message_options, const MessageParseOptions* message_options,
+               size_t num_signal_options, const SignalParseOptions* signal_options,
+               bool sendcan, const char* tcp_addr, int timeout);
+void can_update_string(void *can, const char* dat, int len);
+void can_query_changed(void* can, bool *out_can_valid,
+                       const SignalValue **out_values, size_t *out_num_values,
+                       const MessageTimestamp **out_msgs, size_t *out_num_msgs);
+
+void* canpack_init(const char* dbc_name);
+int canpack_compile(void* inst, uint32_t address, size_t num_sigs, const char* const* sig_names);
+uint64_t canpack_pack_handle(void* inst, int handle, const double *values, int counter);
+}
+
+// every heap allocation made by the process, including inside libdbc
+static uint64_t num_allocs = 0;
+
+void* operator new(size_t size) {
+  num_allocs++;
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+namespace {
+
+struct CanEvent {
+  const char* dat;
+  size_t len;
+};
+
+struct CanFrame {
+  uint32_t address;
+  uint8_t src;
+};
+
+struct Result {
+  uint64_t frames;
+  uint64_t ns;
+  uint64_t allocs;
+};
+
+bool read_file(const char* fn, std::string &out) {
+  FILE *f = fopen(fn, "rb");
+  if (!f) return false;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+bool bz2_decompress(const std::string &in, std::string &out) {
+  bz_stream strm = {0};
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+
+  strm.next_in = (char*)in.data();
+  strm.avail_in = in.size();
+
+  char buf[1 << 16];
+  int ret;
+  do {
+    strm.next_out = buf;
+    strm.avail_out = sizeof(buf);
+    ret = BZ2_bzDecompress(&strm);
+    out.append(buf, sizeof(buf) - strm.avail_out);
+  } while (ret == BZ_OK);
+
+  BZ2_bzDecompressEnd(&strm);
+  return ret == BZ_STREAM_END;
+}
+
+// keeps the log words alive, events point into them
+struct Log {
+  kj::Array<capnp::word> words;
+  std::vector<CanEvent> events;
+  std::vector<CanFrame> frames;
+  uint64_t start_ns = 0, end_ns = 0;
+};
+
+bool load_log(const char* fn, Log &log) {
+  std::string raw;
+  if (!read_file(fn, raw)) {
+    fprintf(stderr, "can't read %s\n", fn);
+    return false;
+  }
+
+  if (raw.size() >= 3 && memcmp(raw.data(), "BZh", 3) == 0) {
+    std::string dec;
+    if (!bz2_decompress(raw, dec)) {
+      fprintf(stderr, "bad bz2 in %s\n", fn);
+      return false;
+    }
+    raw.swap(dec);
+  }
+
+  const size_t num_words = raw.size() / sizeof(capnp::word);
+  log.words = kj::heapArray<capnp::word>(num_words);
+  memcpy(log.words.begin(), raw.data(), num_words * sizeof(capnp::word));
+
+  kj::ArrayPtr<const capnp::word> words = log.words.asPtr();
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    auto event = reader.getRoot<cereal::Event>();
+    const capnp::word* end = reader.getEnd();
+
+    if (event.which() == cereal::Event::CAN) {
+      if (log.events.empty()) log.start_ns = event.getLogMonoTime();
+      log.end_ns = event.getLogMonoTime();
+      log.events.push_back((CanEvent){
+        .dat = (const char*)words.begin(),
+        .len = (size_t)(end - words.begin()) * sizeof(capnp::word),
+      });
+      auto cans = event.getCan();
+      for (int i = 0; i < cans.size(); i++) {
+        log.frames.push_back((CanFrame){
+          .address = cans[i].getAddress(),
+          .src = (uint8_t)cans[i].getSrc(),
+        });
+      }
+    }
+
+    words = kj::arrayPtr(end, words.end());
+  }
+  return true;
+}
+
+std::vector<std::string> list_dbcs(const std::string& dbc_dir) {
+  std::vector<std::string> names;
+  DIR *dir = opendir(dbc_dir.c_str());
+  if (!dir) return names;
+
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    std::string fn = de->d_name;
+    if (fn.size() > 4 && fn.compare(fn.size() - 4, 4, ".dbc") == 0) {
+      names.push_back(fn.substr(0, fn.size() - 4));
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// tracks every signal of every message on bus 0, messages are checked at
+// their rate in the logs like carstate checks them
+Result bench_parser(const DBC* dbc, const std::vector<Log> &logs, int iterations) {
+  std::map<uint32_t, uint64_t> counts;
+  std::vector<uint64_t> bus0_frames;
+  double seconds = 0;
+  for (const auto &log : logs) {
+    bus0_frames.push_back(0);
+    for (const auto &frame : log.frames) {
+      if (frame.src != 0) continue;
+      counts[frame.address]++;
+      bus0_frames.back()++;
+    }
+    seconds += (log.end_ns - log.start_ns) / 1e9;
+  }
+
+  std::vector<MessageParseOptions> msg_options;
+  std::vector<SignalParseOptions> sig_options;
+  for (size_t i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    // messages not on bus 0 aren't checked
+    const int freq = seconds > 0 ? (int)(counts[msg.address] / seconds + 0.5) : 0;
+    msg_options.push_back((MessageParseOptions){.address = msg.address, .check_frequency = freq});
+    for (size_t j = 0; j < msg.num_sigs; j++) {
+      sig_options.push_back((SignalParseOptions){.address = msg.address, .name = msg.sigs[j].name, .default_value = 0});
+    }
+  }
+
+  void *can = can_init(0, dbc->name, msg_options.size(), msg_options.data(),
+                       sig_options.size(), sig_options.data(), false, "", -1);
+
+  Result res = {0};
+  // the first pass warms up the parser's scratch buffers and isn't counted
+  for (int it = 0; it <= iterations; it++) {
+    const uint64_t allocs_start = num_allocs;
+    const uint64_t t_start = nanos_since_boot();
+    for (size_t l = 0; l < logs.size(); l++) {
+      for (const auto &event : logs[l].events) {
+        can_update_string(can, event.dat, event.len);
+
+        bool can_valid;
+        const SignalValue *values;
+        const MessageTimestamp *msgs;
+        size_t num_values, num_msgs;
+        can_query_changed(can, &can_valid, &values, &num_values, &msgs, &num_msgs);
+      }
+      if (it > 0) res.frames += bus0_frames[l];
+    }
+    if (it > 0) {
+      res.ns += nanos_since_boot() - t_start;
+      res.allocs += num_allocs - allocs_start;
+    }
+  }
+  return res;
+}
+
+// packs every frame of the log that exists in the dbc, with all its signals
+Result bench_packer(const DBC* dbc, const std::vector<Log> &logs, int iterations) {
+  void *packer = canpack_init(dbc->name);
+
+  struct Handle {
+    int handle;
+    bool has_counter;
+  };
+  std::map<uint32_t, Handle> handles;
+  size_t max_sigs = 0;
+  for (size_t i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    std::vector<const char*> names;
+    bool has_counter = false;
+    for (size_t j = 0; j < msg.num_sigs; j++) {
+      names.push_back(msg.sigs[j].name);
+      has_counter |= strcmp(msg.sigs[j].name, "COUNTER") == 0;
+    }
+    handles[msg.address] = (Handle){
+      .handle = canpack_compile(packer, msg.address, names.size(), names.data()),
+      .has_counter = has_counter,
+    };
+    max_sigs = std::max(max_sigs, names.size());
+  }
+
+  // flat lookup so the timed loop only measures the packer
+  std::vector<std::vector<const Handle*>> frame_handles;
+  for (const auto &log : logs) {
+    frame_handles.emplace_back();
+    for (const auto &frame : log.frames) {
+      auto it = handles.find(frame.address);
+      frame_handles.back().push_back(it == handles.end() ? NULL : &it->second);
+    }
+  }
+
+  std::vector<double> values(max_sigs, 1.0);
+
+  Result res = {0};
+  volatile uint64_t sink = 0;
+  for (int it = 0; it <= iterations; it++) {
+    const uint64_t allocs_start = num_allocs;
+    const uint64_t t_start = nanos_since_boot();
+    int counter = 0;
+    for (const auto &fh : frame_handles) {
+      for (const Handle *h : fh) {
+        if (h == NULL) continue;
+        sink = sink + canpack_pack_handle(packer, h->handle, values.data(), h->has_counter ? (counter++ & 3) : -1);
+        if (it > 0) res.frames++;
+      }
+    }
+    if (it > 0) {
+      res.ns += nanos_since_boot() - t_start;
+      res.allocs += num_allocs - allocs_start;
+    }
+  }
+  return res;
+}
+
+void print_result(const char* name, const Result &res) {
+  const double frames = res.frames > 0 ? res.frames : 1;
+  printf("  %s %10llu frames %12.0f frames/s %8.1f ns/frame %6.3f allocs/frame",
+         name, (unsigned long long)res.frames,
+         res.ns > 0 ? res.frames * 1e9 / res.ns : 0.0,
+         res.ns / frames, res.allocs / frames);
+}
+
+bool over(const Result &res, double max_ns, double max_allocs) {
+  if (res.frames == 0) return false;
+  return (max_ns > 0 && (double)res.ns / res.frames > max_ns)
+      || (max_allocs >= 0 && (double)res.allocs / res.frames > max_allocs);
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> dbc_names;
+  std::string dbc_dir = "../../opendbc";
+  int iterations = 5;
+  double max_ns = 0;
+  double max_allocs = -1;
+  std::vector<const char*> log_fns;
+
+  for (int i = 1; i < argc; i++) {
+    const bool has_arg = i + 1 < argc;
+    if (strcmp(argv[i], "--dbc") == 0 && has_arg) {
+      dbc_names.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--dbc-dir") == 0 && has_arg) {
+      dbc_dir = argv[++i];
+    } else if (strcmp(argv[i], "--iterations") == 0 && has_arg) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-ns-per-frame") == 0 && has_arg) {
+      max_ns = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-allocs-per-frame") == 0 && has_arg) {
+      max_allocs = atof(argv[++i]);
+    } else {
+      log_fns.push_back(argv[i]);
+    }
+  }
+
+  if (log_fns.empty() || iterations < 1) {
+    fprintf(stderr, "usage: %s [--dbc name]... [--dbc-dir dir] [--iterations n] "
+                    "[--max-ns-per-frame ns] [--max-allocs-per-frame n] rlog [rlog...]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<Log> logs(log_fns.size());
+  size_t num_frames = 0;
+  for (size_t i = 0; i < log_fns.size(); i++) {
+    if (!load_log(log_fns[i], logs[i])) return 2;
+    num_frames += logs[i].frames.size();
+  }
+  printf("%zu logs, %zu can frames, %d iterations\n", logs.size(), num_frames, iterations);
+
+  if (dbc_names.empty()) {
+    dbc_names = list_dbcs(dbc_dir);
+  }
+
+  bool failed = false;
+  for (const auto &name : dbc_names) {
+    const DBC *dbc = dbc_lookup(name);
+    if (!dbc) {
+      fprintf(stderr, "%s not in libdbc, skipping\n", name.c_str());
+      continue;
+    }
+
+    const Result parse = bench_parser(dbc, logs, iterations);
+    const Result pack = bench_packer(dbc, logs, iterations);
+
+    printf("%s\n", name.c_str());
+    print_result("parse", parse);
+    printf("\n");
+    print_result("pack ", pack);
+    printf("\n");
+
+    if (over(parse, max_ns, max_allocs) || over(pack, max_ns, max_allocs)) {
+      printf("  FAIL: over threshold\n");
+      failed = true;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
@@ -1,6 +1,8 @@
 #!/usr/bin/env python2
 
 import os
+import random
+import time
 import unittest
 
 import requests
@@ -13,6 +15,8 @@ from selfdrive.car.honda.interface import CarInterface
 from selfdrive.car.honda.values import CAR, DBC
 from selfdrive.services import service_list
 from tools.lib.logreader import LogReader
+from common.dbc import dbc
+from opendbc import DBC_PATH
 
 BASE_URL = "https://commadataci.blob.core.windows.net/openpilotci/"
 DT = int(0.01 * 1e9)  # ns
@@ -42,6 +46,27 @@ def dicts_vals_differ(dict1, dict2):
 
   return False
 
+def can_event(t, frames, bus=0, bus_time=0):
+  """Serialized can event at logMonoTime t, frames are (address, dat)"""
+  msg = messaging.new_message()
+  msg.logMonoTime = t
+  msg.init('can', len(frames))
+  for i, (address, dat) in enumerate(frames):
+    msg.can[i].address = address
+    msg.can[i].busTime = bus_time
+    msg.can[i].dat = dat
+    msg.can[i].src = bus
+  return msg.to_bytes()
+
+def random_dat(size):
+  return "".join(chr(random.randint(0, 255)) for _ in xrange(size))
+
+def toyota_checksum(address, dat):
+  s = len(dat) + (address & 0xFF) + (address >> 8)
+  for c in dat[:-1]:
+    s += ord(c)
+  return dat[:-1] + chr(s & 0xFF)
+
 def run_route(route):
   can = messaging.pub_sock(service_list['can'].port)
 
@@ -102,5 +127,152 @@ class TestCanParser(unittest.TestCase):
     self.assertTrue(run_route(self.routes[CAR.CIVIC]))
 
 
+class TestMixedEndian(unittest.TestCase):
+  # messages with big and little endian signals. the old parser decoded all
+  # of a message in the byte order of its first signal, here every signal
+  # has to match the python dbc decoder and an old parser tracking only it
+  MSGS = [
+    # dbc, message, signals, frame filter
+    ("subaru_global_2017", "G_Sensor", ["longitudinal", "Latitudinal"], None),
+    ("subaru_global_2017", "Steering", ["Steering_Angle", "Counter", "Checksum"], None),
+    # the checksum is computed over the big endian view next to a little endian signal
+    ("toyota_rav4_2017_pt_generated", "PCM_CRUISE", ["CANCEL_REQ", "ACCEL_NET", "CRUISE_STATE", "GAS_RELEASED"], toyota_checksum),
+  ]
+
+  def test_mixed_endian(self):
+    random.seed(0)
+    can = messaging.pub_sock(service_list['can'].port)
+
+    for dbc_name, msg_name, sig_names, fix in self.MSGS:
+      ref = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc"))
+      address = ref.msg_name_to_address[msg_name]
+      size = ref.msgs[address][0][1]
+
+      signals = [(sig, msg_name, 0) for sig in sig_names]
+      parser = CANParserNew(dbc_name, list(signals), [], 0)
+      parsers_old = [CANParserOld(dbc_name, [sig], [], 0, timeout=-1, tcp_addr="127.0.0.1") for sig in signals]
+      # let the old parsers' subscriptions connect
+      time.sleep(0.5)
+
+      for i in xrange(200):
+        t = (i + 1) * DT
+        dat = random_dat(size)
+        if fix is not None:
+          dat = fix(address, dat)
+
+        msg_bytes = can_event(t, [(address, dat)])
+        can.send(msg_bytes)
+        parser.update_string(msg_bytes)
+
+        _, expected = ref.decode((address, 0, dat))
+        for sig, p in zip(sig_names, parsers_old):
+          p.update(t, True)
+          self.assertAlmostEqual(parser.vl[msg_name][sig], expected[sig], msg="%s %s %r" % (msg_name, sig, dat))
+          self.assertAlmostEqual(p.vl[msg_name][sig], expected[sig], msg="%s %s old %r" % (msg_name, sig, dat))
+
+        # a frame with a bad checksum changes nothing
+        if fix is not None:
+          before = dict(parser.vl[msg_name])
+          bad = dat[:-1] + chr((ord(dat[-1]) + 1) & 0xFF)
+          parser.update_string(can_event(t + DT // 2, [(address, bad)]))
+          self.assertEqual(parser.vl[msg_name], before)
+
+
+class TestBatchedUpdate(unittest.TestCase):
+  def test_update_strings(self):
+    # update_strings on batches has to end up where update_string frame by
+    # frame does, only changed values are reported but vl and ts hold all
+    random.seed(1)
+    dbc_name = "subaru_global_2017"
+    ref = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc"))
+    addresses = sorted(a for a, m in ref.msgs.items() if m[1] and m[0][1] <= 8)[:10]
+
+    signals = [(s.name, a, 0) for a in addresses for s in ref.msgs[a][1]]
+    parser_single = CANParserNew(dbc_name, list(signals), [], 0)
+    parser_batch = CANParserNew(dbc_name, list(signals), [], 0)
+
+    last_dat = {}
+    events = []
+    for i in xrange(1000):
+      frames = []
+      for a in random.sample(addresses, random.randint(1, len(addresses))):
+        # repeats the last frame half the time, so values stay the same
+        if a not in last_dat or random.random() < 0.5:
+          last_dat[a] = random_dat(ref.msgs[a][0][1])
+        frames.append((a, last_dat[a]))
+      events.append((frames, can_event((i + 1) * DT, frames, bus_time=i)))
+
+    i = 0
+    while i < len(events):
+      batch = events[i:i + random.randint(1, 10)]
+      i += len(batch)
+
+      updated_single = set()
+      for _, msg_bytes in batch:
+        updated_single |= parser_single.update_string(msg_bytes)
+      updated_batch = parser_batch.update_strings([msg_bytes for _, msg_bytes in batch])
+
+      self.assertEqual(updated_single, set(updated_batch))
+      self.assertEqual(parser_single.vl, parser_batch.vl)
+      self.assertEqual(parser_single.ts, parser_batch.ts)
+
+      # what was received has the values and bus time of its last frame,
+      # also where nothing changed
+      last = {}
+      for j, (frames, _) in enumerate(batch):
+        for a, dat in frames:
+          last[a] = (dat, (i - len(batch) + j) & 0xFFFF)
+      for a, (dat, bus_time) in last.items():
+        _, expected = ref.decode((a, 0, dat))
+        for name, value in expected.items():
+          self.assertAlmostEqual(parser_batch.vl[a][name], value)
+          self.assertEqual(parser_batch.ts[a][name], bus_time)
+
+
+class TestTimeouts(unittest.TestCase):
+  def test_dropped_message(self):
+    # both messages checked at 100Hz, so missing for more than 10 frames is
+    # a timeout. STEER_ANGLE_SENSOR is dropped from the replay for a while
+    random.seed(2)
+    dbc_name = "toyota_rav4_2017_pt_generated"
+    ref = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc"))
+    wheel = ref.msg_name_to_address["WHEEL_SPEEDS"]
+    steer = ref.msg_name_to_address["STEER_ANGLE_SENSOR"]
+
+    signals = [("WHEEL_SPEED_FL", "WHEEL_SPEEDS", 0), ("STEER_ANGLE", "STEER_ANGLE_SENSOR", 0)]
+    checks = [("WHEEL_SPEEDS", 100), ("STEER_ANGLE_SENSOR", 100)]
+    parser = CANParserNew(dbc_name, signals, checks, 0)
+
+    drop_start, drop_end = 100, 200
+    invalid = 0
+    for i in xrange(1, 300):
+      wheel_dat, steer_dat = random_dat(8), random_dat(8)
+      frames = [(wheel, wheel_dat)]
+      if not drop_start < i <= drop_end:
+        frames.append((steer, steer_dat))
+      else:
+        steer_angle = parser.vl["STEER_ANGLE_SENSOR"]["STEER_ANGLE"]
+
+      updated = parser.update_string(can_event(i * DT, frames))
+      self.assertEqual(updated, set(a for a, _ in frames))
+      _, decoded = ref.decode((wheel, 0, wheel_dat))
+      self.assertAlmostEqual(parser.vl["WHEEL_SPEEDS"]["WHEEL_SPEED_FL"], decoded["WHEEL_SPEED_FL"])
+
+      timeouts = parser.timeouts()
+      if drop_start + 10 < i <= drop_end:
+        # gone for more than 10 frames, the last value stays
+        self.assertEqual(timeouts.keys(), ["STEER_ANGLE_SENSOR"])
+        self.assertAlmostEqual(timeouts["STEER_ANGLE_SENSOR"], (i - drop_start) * DT * 1e-9)
+        self.assertEqual(parser.vl["STEER_ANGLE_SENSOR"]["STEER_ANGLE"], steer_angle)
+        invalid += 1
+      else:
+        self.assertEqual(timeouts, {})
+        invalid = 0
+
+      # can_valid goes away after 5 updates with a timeout, and is back
+      # with the first one without
+      self.assertEqual(parser.can_valid, invalid < 5, msg="frame %d" % i)
+
+
 if __name__ == "__main__":
   unittest.main()
@@ -0,0 +1,40 @@
+#ifndef COMMON_ALIGNED_BUFFER_H
+#define COMMON_ALIGNED_BUFFER_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <capnp/serialize.h>
+
+// Word aligned view of a serialized capnp message for FlatArrayMessageReader.
+// Buffers that are already word aligned (the common case for zmq messages)
+// are used in place. Anything else is copied into a scratch buffer that is
+// reused across calls, so the receive path does no per-message allocation.
+// The returned view is valid until the next call to align() or until data
+// is freed.
+class AlignedBuffer {
+ public:
+  kj::ArrayPtr<const capnp::word> align(const void *data, size_t size) {
+    const size_t words_size = (size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+
+    if (((uintptr_t)data % sizeof(capnp::word)) == 0 && (size % sizeof(capnp::word)) == 0) {
+      return kj::arrayPtr((const capnp::word*)data, words_size);
+    }
+
+    if (buf.size() < words_size) {
+      buf = kj::heapArray<capnp::word>(words_size < 512 ? 512 : words_size * 2);
+    }
+
+    // zero the tail word so a truncated message doesn't read stale data
+    if (words_size > 0) {
+      memset(&buf[words_size - 1], 0, sizeof(capnp::word));
+    }
+    memcpy(buf.begin(), data, size);
+    return buf.slice(0, words_size);
+  }
+
+ private:
+  kj::Array<capnp::word> buf;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef COMMON_MESSAGE_ARENA_H
+#define COMMON_MESSAGE_ARENA_H
+
+#include <cstring>
+#include <string>
+
+#include <zmq.h>
+
+#include <capnp/serialize.h>
+#include <kj/io.h>
+
+#include "common/shm_ring.h"
+
+// Reusable first segment for a MallocMessageBuilder, and serialization
+// straight into the zmq message or string that goes out, so publishing
+// doesn't allocate a builder segment and a flat array per message.
+// The segment grows to fit the biggest message seen, and stays zeroed
+// because MallocMessageBuilder clears what it used on destruction.
+//
+//   capnp::MallocMessageBuilder msg(arena.segment());
+//   ... build ...
+//   arena.send(sock, msg);
+//
+// or arena.publish(sock, ring, msg) to also put it in the service's shm ring.
+//
+// Only one builder may use the segment at a time.
+class MessageArena {
+ public:
+  explicit MessageArena(size_t words = 1024) : want_words(words) {}
+
+  kj::ArrayPtr<capnp::word> segment() {
+    if (buf.size() < want_words) {
+      buf = kj::heapArray<capnp::word>(want_words);
+      memset(buf.begin(), 0, buf.size() * sizeof(capnp::word));
+    }
+    return buf;
+  }
+
+  // returns what zmq_msg_send returns
+  int send(void *sock, capnp::MessageBuilder &msg, int flags = 0) {
+    const size_t size = serialized_size(msg);
+
+    zmq_msg_t zmsg;
+    int err = zmq_msg_init_size(&zmsg, size);
+    if (err != 0) return err;
+
+    write(msg, zmq_msg_data(&zmsg), size);
+    err = zmq_msg_send(&zmsg, sock, flags);
+    if (err < 0) zmq_msg_close(&zmsg);
+    return err;
+  }
+
+  // sends msg and puts it in ring too if that's open. it's serialized in
+  // the ring and zmq copies it from there. one too big for the ring is
+  // only sent, the ring counts it and readers go back to zmq
+  int publish(void *sock, ShmRingWriter &ring, capnp::MessageBuilder &msg) {
+    if (!ring.is_open()) return send(sock, msg);
+
+    const size_t size = serialized_size(msg);
+    void *dst = ring.reserve(size);
+    if (!dst) return send(sock, msg);
+
+    write(msg, dst, size);
+    ring.commit();
+    return zmq_send(sock, dst, size, 0);
+  }
+
+  void append(capnp::MessageBuilder &msg, std::string &out) {
+    const size_t size = serialized_size(msg);
+    const size_t start = out.size();
+    out.resize(start + size);
+    write(msg, &out[start], size);
+  }
+
+ private:
+  size_t serialized_size(capnp::MessageBuilder &msg) {
+    const size_t words = capnp::computeSerializedSizeInWords(msg);
+    // the next message fits in one segment
+    if (words > want_words) want_words = words;
+    return words * sizeof(capnp::word);
+  }
+
+  static void write(capnp::MessageBuilder &msg, void *dst, size_t size) {
+    kj::ArrayOutputStream stream(kj::arrayPtr((kj::byte*)dst, size));
+    capnp::writeMessage(stream, msg);
+  }
+
+  kj::Array<capnp::word> buf;
+  size_t want_words;
+};
+
+#endif
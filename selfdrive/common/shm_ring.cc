@@ -0,0 +1,241 @@
+#include "common/shm_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common/swaglog.h"
+
+// messages are 8 byte aligned, like the capnp words in them
+#define SHM_RING_ALIGN 8
+// marks the rest of the ring as unused, the next message is at 0
+#define SHM_RING_PAD 0xFFFFFFFF
+
+namespace {
+
+const char shm_ring_magic[8] = {'o', 'p', 'r', 'i', 'n', 'g', '1', 0};
+
+struct Record {
+  uint32_t size;
+  uint32_t pad;
+};
+
+size_t align(size_t n) {
+  return (n + SHM_RING_ALIGN - 1) & ~(size_t)(SHM_RING_ALIGN - 1);
+}
+
+void ring_path(char *path, size_t len, const char *service, const char *suffix) {
+  const char *dir = getenv("SHM_RING_DIR");
+  snprintf(path, len, "%s/%s%s", dir ? dir : "/dev/shm", service, suffix);
+}
+
+}  // namespace
+
+ShmRingWriter::~ShmRingWriter() {
+  if (hdr) munmap(hdr, map_size);
+}
+
+bool ShmRingWriter::open(const char *service, size_t size) {
+  static_assert(sizeof(ShmRingHeader) == 64, "ring data must start on a cache line");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "positions are shared between processes");
+  if (size == 0 || (size & (size - 1)) != 0) {
+    LOGE("shm ring %s: size %zu isn't a power of two", service, size);
+    return false;
+  }
+
+  char path[256], tmp_path[256];
+  ring_path(path, sizeof(path), service, "");
+  ring_path(tmp_path, sizeof(tmp_path), service, ".tmp");
+
+  // readers only ever see a ready ring
+  int fd = ::open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOGW("no shm ring for %s: %s", service, strerror(errno));
+    return false;
+  }
+
+  map_size = sizeof(ShmRingHeader) + size;
+  void *mem = MAP_FAILED;
+  if (ftruncate(fd, map_size) == 0) {
+    mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) {
+    LOGW("no shm ring for %s: %s", service, strerror(errno));
+    unlink(tmp_path);
+    return false;
+  }
+
+  hdr = (ShmRingHeader*)mem;
+  buf = (uint8_t*)(hdr + 1);
+  memcpy(hdr->magic, shm_ring_magic, sizeof(hdr->magic));
+  hdr->size = size;
+  hdr->pid = getpid();
+  hdr->write_end.store(0);
+  hdr->write_pos.store(0);
+  hdr->skipped.store(0);
+
+  if (rename(tmp_path, path) != 0) {
+    LOGW("no shm ring for %s: %s", service, strerror(errno));
+    unlink(tmp_path);
+    munmap(hdr, map_size);
+    hdr = NULL;
+    return false;
+  }
+  return true;
+}
+
+void *ShmRingWriter::reserve(size_t size) {
+  const size_t need = sizeof(Record) + align(size);
+  // a reader has to have time to copy what it found
+  if (size == 0 || need > hdr->size / 4) {
+    hdr->skipped.fetch_add(1, std::memory_order_release);
+    return NULL;
+  }
+
+  const uint64_t w = hdr->write_pos.load(std::memory_order_relaxed);
+  // messages don't wrap, skip what's left at the end if it doesn't fit
+  size_t pos = w & (hdr->size - 1);
+  const size_t pad = (hdr->size - pos < need) ? hdr->size - pos : 0;
+  pending_end = w + pad + need;
+
+  hdr->write_end.store(pending_end, std::memory_order_relaxed);
+  // readers checking write_end after copying see it moved before the overwrite
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (pad) {
+    ((Record*)(buf + pos))->size = SHM_RING_PAD;
+    pos = 0;
+  }
+  ((Record*)(buf + pos))->size = size;
+  return buf + pos + sizeof(Record);
+}
+
+void ShmRingWriter::commit() {
+  hdr->write_pos.store(pending_end, std::memory_order_release);
+}
+
+void ShmRingWriter::write(const void *data, size_t size) {
+  void *dst = reserve(size);
+  if (!dst) return;
+  memcpy(dst, data, size);
+  commit();
+}
+
+bool ShmRingReader::open(const char *service) {
+  ring_path(path, sizeof(path), service, "");
+
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(ShmRingHeader)) {
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  ShmRingHeader *h = (ShmRingHeader*)mem;
+  if (memcmp(h->magic, shm_ring_magic, sizeof(h->magic)) != 0
+      || sizeof(ShmRingHeader) + h->size != (size_t)st.st_size) {
+    LOGW("bad shm ring %s", path);
+    munmap(mem, st.st_size);
+    return false;
+  }
+  if (h->skipped.load(std::memory_order_acquire) != 0) {
+    // not everything goes through it, the service stays on zmq
+    munmap(mem, st.st_size);
+    return false;
+  }
+
+  hdr = h;
+  buf = (const uint8_t*)(hdr + 1);
+  map_size = st.st_size;
+  ino = st.st_ino;
+  // messages start at 0 after every wrap. if the writer is already past
+  // the end of the lap next_size notices and starts at the newest
+  read_pos = hdr->write_pos.load(std::memory_order_acquire) & ~(hdr->size - 1);
+  next = 0;
+  overruns = 0;
+  return true;
+}
+
+void ShmRingReader::close() {
+  if (hdr) munmap(hdr, map_size);
+  hdr = NULL;
+}
+
+bool ShmRingReader::stale() const {
+  if (kill(hdr->pid, 0) != 0 && errno == ESRCH) return true;
+
+  struct stat st;
+  return stat(path, &st) != 0 || st.st_ino != ino;
+}
+
+bool ShmRingReader::intact(uint64_t pos) const {
+  // the writer is past pos by at most a ring, nothing from pos on is touched
+  return hdr->write_end.load(std::memory_order_relaxed) - pos <= hdr->size;
+}
+
+void ShmRingReader::resync() {
+  overruns++;
+  read_pos = hdr->write_pos.load(std::memory_order_acquire);
+  next = 0;
+}
+
+size_t ShmRingReader::next_size() {
+  if (next) return next;
+
+  while (true) {
+    const uint64_t w = hdr->write_pos.load(std::memory_order_acquire);
+    if (w == read_pos) return 0;
+    if (w - read_pos > hdr->size) {
+      resync();
+      continue;
+    }
+
+    const size_t pos = read_pos & (hdr->size - 1);
+    const uint32_t size = ((const volatile Record*)(buf + pos))->size;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!intact(read_pos)) {
+      resync();
+      continue;
+    }
+
+    if (size == SHM_RING_PAD) {
+      read_pos += hdr->size - pos;
+      continue;
+    }
+    if (size == 0 || sizeof(Record) + align(size) > hdr->size - pos) {
+      LOGE_100("corrupt shm ring %s", path);
+      resync();
+      continue;
+    }
+    next = size;
+    return next;
+  }
+}
+
+bool ShmRingReader::read(void *dst) {
+  const size_t pos = read_pos & (hdr->size - 1);
+  memcpy(dst, buf + pos + sizeof(Record), next);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!intact(read_pos)) {
+    resync();
+    return false;
+  }
+  skip();
+  return true;
+}
+
+void ShmRingReader::skip() {
+  read_pos += sizeof(Record) + align(next);
+  next = 0;
+}
@@ -0,0 +1,113 @@
+#ifndef COMMON_SHM_RING_H
+#define COMMON_SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+// Messages of one service in a ring in shared memory, next to its zmq
+// socket. The publisher writes without ever waiting on readers, and any
+// number of readers follow it with their own read position, so a slow
+// reader loses the oldest messages instead of holding anyone up. Readers
+// copy a message out and then check it wasn't overwritten meanwhile, like
+// a seqlock.
+//
+// Publishers put a message in the ring before sending it on zmq, so a
+// reader has everything before what zmq gives it. A message too big for
+// the ring goes out on zmq only and is counted in the header, a reader
+// can't rely on the ring from then on.
+//
+// The ring of a service is the file SHM_RING_DIR/<service>, /dev/shm by
+// default. A restarted publisher makes a new file, readers notice the
+// replacement or a dead publisher with stale() and open it again.
+
+#define SHM_RING_DEFAULT_SIZE (2*1024*1024)
+
+struct ShmRingHeader {
+  char magic[8];
+  // bytes of ring after the header, a power of two
+  uint64_t size;
+  int32_t pid;
+  uint32_t pad;
+
+  // byte offsets that only grow. the writer moves write_end past what it's
+  // about to write before touching it, and write_pos once it's written
+  std::atomic<uint64_t> write_end;
+  std::atomic<uint64_t> write_pos;
+
+  // messages that didn't fit and went out on zmq only
+  std::atomic<uint32_t> skipped;
+
+  uint8_t reserved[20];
+};
+
+class ShmRingWriter {
+ public:
+  ShmRingWriter() {}
+  ~ShmRingWriter();
+
+  // makes a new ring for the service, replacing any old one. false if
+  // there's no shared memory, publishing goes on over zmq only
+  bool open(const char *service, size_t size = SHM_RING_DEFAULT_SIZE);
+  bool is_open() const { return hdr != NULL; }
+
+  // room for a message of size bytes to be built in place, NULL if it's
+  // too big for the ring and counted as skipped. readers see it after commit
+  void *reserve(size_t size);
+  void commit();
+
+  void write(const void *data, size_t size);
+
+ private:
+  ShmRingHeader *hdr = NULL;
+  uint8_t *buf = NULL;
+  size_t map_size = 0;
+  uint64_t pending_end = 0;
+};
+
+class ShmRingReader {
+ public:
+  ShmRingReader() {}
+  ~ShmRingReader() { close(); }
+
+  // starts at the oldest message the ring has since it last wrapped. false
+  // if the service has no ring, or one its publisher had to skip
+  bool open(const char *service);
+  void close();
+  bool is_open() const { return hdr != NULL; }
+
+  // the publisher exited or a new one replaced the ring
+  bool stale() const;
+
+  // size of the next message, 0 if there's nothing new
+  size_t next_size();
+  // copies out the next message, dst has room for next_size() bytes. false
+  // if the publisher overwrote it while copying, it's gone either way
+  bool read(void *dst);
+  // passes over the next message
+  void skip();
+
+  // messages the publisher sent on zmq only, the ring is missing them
+  uint32_t skipped() const { return hdr->skipped.load(std::memory_order_acquire); }
+
+  // times the publisher lapped this reader, each lost one message or more
+  uint32_t overruns = 0;
+
+ private:
+  bool intact(uint64_t pos) const;
+  void resync();
+
+  ShmRingHeader *hdr = NULL;
+  const uint8_t *buf = NULL;
+  size_t map_size = 0;
+  char path[256];
+  ino_t ino = 0;
+
+  uint64_t read_pos = 0;
+  // of the message next_size found, 0 if it hasn't looked
+  uint32_t next = 0;
+};
+
+#endif
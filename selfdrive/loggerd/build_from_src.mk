@@ -35,6 +35,13 @@ BZIP_FLAGS = -I$(PHONELIBS)/bzip2/
 BZIP_LIBS = -L$(PHONELIBS)/bzip2/ \
             -l:libbz2.a
 
+# zstd log compression, only when the library is there
+ifneq ($(wildcard $(PHONELIBS)/zstd/include/zstd.h),)
+ZSTD_FLAGS = -DHAVE_ZSTD -I$(PHONELIBS)/zstd/include
+ZSTD_LIBS = -L$(PHONELIBS)/zstd/lib \
+            -l:libzstd.a
+endif
+
 # todo: dont use system ffmpeg libs
 FFMPEG_LIBS = -lavformat \
               -lavcodec \
@@ -60,12 +67,18 @@ include ../common/cereal.mk
 
 OBJS += loggerd.o \
        logger.o \
+       log_codec.o \
+       log_ring.o \
+       log_blocks.o \
+       qlog_filter.o \
+       shm_handover.o \
        ../common/util.o \
        ../common/params.o \
        ../common/cqueue.o \
        ../common/swaglog.o \
        ../common/visionipc.o \
        ../common/ipc.o \
+       ../common/shm_ring.o \
        $(PHONELIBS)/json/src/json.o
 
 ifeq ($(ARCH),x86_64)
@@ -96,6 +109,7 @@ loggerd: $(OBJS)
         $(YAML_LIBS) \
         $(EXTRA_LIBS) \
         $(BZIP_LIBS) \
+        $(ZSTD_LIBS) \
         -lm
 
 %.o: %.cc
@@ -107,6 +121,7 @@ loggerd: $(OBJS)
            $(OPENMAX_FLAGS) \
            $(YAML_FLAGS) \
            $(BZIP_FLAGS) \
+           $(ZSTD_FLAGS) \
            -Iinclude \
            -I../ \
            -I../../ \
@@ -120,6 +135,7 @@ loggerd: $(OBJS)
            $(OPENMAX_FLAGS) \
            $(JSON_FLAGS) \
            $(BZIP_FLAGS) \
+           $(ZSTD_FLAGS) \
            -Iinclude \
            -I../ \
            -I../../ \
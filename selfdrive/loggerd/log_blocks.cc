@@ -0,0 +1,335 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <algorithm>
+
+#include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <capnp/serialize.h>
+
+#include "common/swaglog.h"
+#include "common/aligned_buffer.h"
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "log_codec.h"
+#include "log_blocks.h"
+
+// uncompressed, a few seconds of can
+#define LOG_BLOCK_SIZE (256*1024)
+// slow services are flushed once their oldest pending event is this old in
+// logMonoTime, so a crash doesn't lose more of them than of can
+#define LOG_BLOCK_MAX_AGE (5ULL*1000*1000*1000)
+#define LOG_BLOCK_AGE_CHECK (1ULL*1000*1000*1000)
+// all pending blocks together, the biggest is flushed past it
+#define LOG_BLOCKS_MAX_PENDING (4*1024*1024)
+#define LOG_BLOCK_ZSTD_LEVEL 9
+// events that don't parse
+#define LOG_BLOCK_UNKNOWN_SERVICE 0xFFFF
+
+static_assert(sizeof(LogFileHeader) == 16, "LogFileHeader layout");
+static_assert(sizeof(LogBlockHeader) == 32, "LogBlockHeader layout");
+static_assert(sizeof(LogBlockIndexEntry) == 40, "LogBlockIndexEntry layout");
+static_assert(sizeof(LogFileFooter) == 24, "LogFileFooter layout");
+
+namespace {
+
+struct PendingBlock {
+  std::string data;
+  uint32_t events = 0;
+  uint64_t min_mono_time = UINT64_MAX;
+  uint64_t max_mono_time = 0;
+};
+
+struct BlockWriter {
+  FILE *f;
+  uint64_t offset = 0;
+  bool failed = false;
+
+  size_t pending_bytes = 0;
+  uint64_t last_age_check = 0;
+
+  AlignedBuffer aligned;
+  std::map<uint16_t, PendingBlock> pending;
+  std::vector<LogBlockIndexEntry> index;
+  std::vector<uint8_t> compressed;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *cctx = NULL;
+#endif
+};
+
+void write_bytes(BlockWriter *w, const void *data, size_t size) {
+  if (fwrite(data, 1, size, w->f) != size) {
+    w->failed = true;
+  }
+  w->offset += size;
+}
+
+bool compress_block(BlockWriter *w, const std::string &src) {
+#ifdef HAVE_ZSTD
+  w->compressed.resize(ZSTD_compressBound(src.size()));
+  size_t ret = ZSTD_compressCCtx(w->cctx, w->compressed.data(), w->compressed.size(),
+                                 src.data(), src.size(), LOG_BLOCK_ZSTD_LEVEL);
+  if (ZSTD_isError(ret)) return false;
+  w->compressed.resize(ret);
+#else
+  // worst case from the bzip2 docs
+  unsigned int out_size = src.size() + src.size() / 100 + 600;
+  w->compressed.resize(out_size);
+  int err = BZ2_bzBuffToBuffCompress((char*)w->compressed.data(), &out_size,
+                                     (char*)src.data(), src.size(), 9, 0, 30);
+  if (err != BZ_OK) return false;
+  w->compressed.resize(out_size);
+#endif
+  return true;
+}
+
+void flush_block(BlockWriter *w, uint16_t service, PendingBlock &p) {
+  if (p.events == 0) return;
+
+  if (!compress_block(w, p.data)) {
+    LOGE("log block compress failed, dropping %u events", p.events);
+    w->failed = true;
+  } else {
+    LogBlockIndexEntry entry = {};
+    entry.block.service = service;
+    entry.block.events = p.events;
+    entry.block.size = p.data.size();
+    entry.block.compressed_size = w->compressed.size();
+    entry.block.min_mono_time = p.min_mono_time;
+    entry.block.max_mono_time = p.max_mono_time;
+    entry.offset = w->offset;
+    w->index.push_back(entry);
+
+    write_bytes(w, &entry.block, sizeof(entry.block));
+    write_bytes(w, w->compressed.data(), w->compressed.size());
+  }
+
+  // keeps its capacity for the next block
+  w->pending_bytes -= p.data.size();
+  p.data.clear();
+  p.events = 0;
+  p.min_mono_time = UINT64_MAX;
+  p.max_mono_time = 0;
+}
+
+// once a second of logMonoTime, flushes what's been pending too long and
+// hands it to the kernel, where a crash of loggerd can't lose it
+void flush_old_blocks(BlockWriter *w, uint64_t mono_time) {
+  if (mono_time < w->last_age_check + LOG_BLOCK_AGE_CHECK) return;
+  w->last_age_check = mono_time;
+
+  bool flushed = false;
+  for (auto &it : w->pending) {
+    PendingBlock &p = it.second;
+    if (p.events > 0 && mono_time > p.min_mono_time + LOG_BLOCK_MAX_AGE) {
+      flush_block(w, it.first, p);
+      flushed = true;
+    }
+  }
+  if (flushed && fflush(w->f) != 0) {
+    w->failed = true;
+  }
+}
+
+void flush_biggest_block(BlockWriter *w) {
+  auto biggest = w->pending.begin();
+  for (auto it = w->pending.begin(); it != w->pending.end(); ++it) {
+    if (it->second.data.size() > biggest->second.data.size()) biggest = it;
+  }
+  flush_block(w, biggest->first, biggest->second);
+}
+
+void* blocks_open(FILE *f) {
+  BlockWriter *w = new BlockWriter();
+  w->f = f;
+#ifdef HAVE_ZSTD
+  w->cctx = ZSTD_createCCtx();
+  assert(w->cctx);
+#endif
+
+  LogFileHeader header = {};
+  memcpy(header.magic, LOG_BLOCKS_MAGIC, sizeof(header.magic));
+  header.version = LOG_BLOCKS_VERSION;
+#ifdef HAVE_ZSTD
+  header.compression = LOG_BLOCKS_ZSTD;
+#else
+  header.compression = LOG_BLOCKS_BZ2;
+#endif
+  write_bytes(w, &header, sizeof(header));
+
+  if (w->failed) {
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(w->cctx);
+#endif
+    delete w;
+    return NULL;
+  }
+  return w;
+}
+
+// logger.c always writes whole messages
+int blocks_write(void *arg, const uint8_t *data, size_t data_size) {
+  BlockWriter *w = (BlockWriter*)arg;
+
+  uint16_t service = LOG_BLOCK_UNKNOWN_SERVICE;
+  uint64_t mono_time = 0;
+  try {
+    capnp::FlatArrayMessageReader cmsg(w->aligned.align(data, data_size));
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    service = event.which();
+    mono_time = event.getLogMonoTime();
+  } catch (...) {
+    LOGE_100("logging unparseable event of %zu bytes", data_size);
+  }
+
+  PendingBlock &p = w->pending[service];
+  p.data.append((const char*)data, data_size);
+  p.events++;
+  p.min_mono_time = std::min(p.min_mono_time, mono_time);
+  p.max_mono_time = std::max(p.max_mono_time, mono_time);
+  w->pending_bytes += data_size;
+
+  if (p.data.size() >= LOG_BLOCK_SIZE) {
+    flush_block(w, service, p);
+  }
+  flush_old_blocks(w, mono_time);
+  while (w->pending_bytes > LOG_BLOCKS_MAX_PENDING) {
+    flush_biggest_block(w);
+  }
+  return w->failed ? -1 : 0;
+}
+
+int blocks_close(void *arg) {
+  BlockWriter *w = (BlockWriter*)arg;
+
+  for (auto &it : w->pending) {
+    flush_block(w, it.first, it.second);
+  }
+
+  LogFileFooter footer = {};
+  footer.index_offset = w->offset;
+  footer.num_blocks = w->index.size();
+  footer.version = LOG_BLOCKS_VERSION;
+  memcpy(footer.magic, LOG_BLOCKS_MAGIC, sizeof(footer.magic));
+  write_bytes(w, w->index.data(), w->index.size() * sizeof(LogBlockIndexEntry));
+  write_bytes(w, &footer, sizeof(footer));
+
+  const bool failed = w->failed;
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(w->cctx);
+#endif
+  delete w;
+  return failed ? -1 : 0;
+}
+
+}
+
+const LogCodec log_codec_blocks = {
+  "blocks",
+  ".blk",
+  blocks_open,
+  blocks_write,
+  blocks_close,
+};
+
+LogBlockReader::~LogBlockReader() {
+  close();
+}
+
+bool LogBlockReader::open(const char *path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LogFileHeader)) {
+    ::close(fd);
+    return false;
+  }
+
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) return false;
+  data = (const uint8_t*)addr;
+  size = st.st_size;
+
+  LogFileHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, LOG_BLOCKS_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_BLOCKS_VERSION) {
+    close();
+    return false;
+  }
+  compression = header.compression;
+
+  LogFileFooter footer;
+  if (size >= sizeof(header) + sizeof(footer)) {
+    memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+  }
+  const bool has_footer = size >= sizeof(header) + sizeof(footer)
+                          && memcmp(footer.magic, LOG_BLOCKS_MAGIC, sizeof(footer.magic)) == 0
+                          && footer.index_offset + (uint64_t)footer.num_blocks * sizeof(LogBlockIndexEntry)
+                             == size - sizeof(footer);
+  if (!has_footer) {
+    return scan_blocks();
+  }
+
+  // the index isn't necessarily aligned
+  index.resize(footer.num_blocks);
+  memcpy(index.data(), data + footer.index_offset, footer.num_blocks * sizeof(LogBlockIndexEntry));
+  return true;
+}
+
+bool LogBlockReader::scan_blocks() {
+  uint64_t offset = sizeof(LogFileHeader);
+  while (offset + sizeof(LogBlockHeader) <= size) {
+    LogBlockIndexEntry entry;
+    memcpy(&entry.block, data + offset, sizeof(entry.block));
+    entry.offset = offset;
+
+    // a block cut off by a crash ends it
+    if (offset + sizeof(LogBlockHeader) + entry.block.compressed_size > size) break;
+    index.push_back(entry);
+    offset += sizeof(LogBlockHeader) + entry.block.compressed_size;
+  }
+  return true;
+}
+
+void LogBlockReader::close() {
+  if (data) {
+    munmap((void*)data, size);
+  }
+  data = NULL;
+  size = 0;
+  compression = 0;
+  index.clear();
+}
+
+bool LogBlockReader::read_block(const LogBlockIndexEntry &entry, std::string &out) const {
+  const uint64_t start = entry.offset + sizeof(LogBlockHeader);
+  if (data == NULL || start + entry.block.compressed_size > size) return false;
+  const uint8_t *src = data + start;
+
+  out.resize(entry.block.size);
+  if (compression == LOG_BLOCKS_BZ2) {
+    unsigned int out_size = entry.block.size;
+    int err = BZ2_bzBuffToBuffDecompress(&out[0], &out_size, (char*)src, entry.block.compressed_size, 0, 0);
+    return err == BZ_OK && out_size == entry.block.size;
+#ifdef HAVE_ZSTD
+  } else if (compression == LOG_BLOCKS_ZSTD) {
+    size_t ret = ZSTD_decompress(&out[0], out.size(), src, entry.block.compressed_size);
+    return !ZSTD_isError(ret) && ret == entry.block.size;
+#endif
+  }
+  return false;
+}
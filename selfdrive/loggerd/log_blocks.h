@@ -0,0 +1,88 @@
+#ifndef LOG_BLOCKS_H
+#define LOG_BLOCKS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// Seekable log segments, written by the "blocks" log codec.
+//
+// Events are grouped by service, the Event union field they set, into
+// blocks of about LOG_BLOCK_SIZE bytes, or a few seconds of a slow service,
+// that are compressed on their own.
+// Every block starts with a LogBlockHeader and an index of all of them ends
+// the file:
+//
+//   LogFileHeader
+//   LogBlockHeader, compressed events
+//   ...
+//   LogBlockIndexEntry for every block
+//   LogFileFooter
+//
+// so a reader can mmap the file, read the footer and only decompress the
+// blocks for the services and times it's after. A file that was never
+// closed has no footer, its block headers can still be walked from the
+// start. Everything is in host order, little endian on all our devices.
+
+#define LOG_BLOCKS_MAGIC "opblocks"
+#define LOG_BLOCKS_VERSION 1
+
+#define LOG_BLOCKS_BZ2 1
+#define LOG_BLOCKS_ZSTD 2
+
+struct LogFileHeader {
+  char magic[8];
+  uint32_t version;
+  // LOG_BLOCKS_BZ2 or LOG_BLOCKS_ZSTD, for every block
+  uint32_t compression;
+};
+
+struct LogBlockHeader {
+  // cereal::Event::Which of all the events in the block
+  uint16_t service;
+  uint16_t reserved;
+  uint32_t events;
+  uint32_t size;
+  uint32_t compressed_size;
+  uint64_t min_mono_time;
+  uint64_t max_mono_time;
+};
+
+struct LogBlockIndexEntry {
+  LogBlockHeader block;
+  // of the block header, from the start of the file
+  uint64_t offset;
+};
+
+struct LogFileFooter {
+  uint64_t index_offset;
+  uint32_t num_blocks;
+  uint32_t version;
+  char magic[8];
+};
+
+class LogBlockReader {
+ public:
+  ~LogBlockReader();
+
+  bool open(const char *path);
+  void close();
+
+  const std::vector<LogBlockIndexEntry> &blocks() const { return index; }
+
+  // the block's events, serialized messages back to back like in an rlog
+  bool read_block(const LogBlockIndexEntry &entry, std::string &out) const;
+
+ private:
+  // rebuilds the index of a file without a footer
+  bool scan_blocks();
+
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  uint32_t compression = 0;
+  std::vector<LogBlockIndexEntry> index;
+};
+
+#endif
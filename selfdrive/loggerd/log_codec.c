@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <bzlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "common/swaglog.h"
+
+#include "log_codec.h"
+
+static void* bz2_open(FILE* f) {
+  int bzerror;
+  BZFILE* bz = BZ2_bzWriteOpen(&bzerror, f, 9, 0, 30);
+  if (bzerror != BZ_OK) return NULL;
+  return bz;
+}
+
+static int bz2_write(void* w, const uint8_t* data, size_t data_size) {
+  int bzerror;
+  BZ2_bzWrite(&bzerror, (BZFILE*)w, (void*)data, data_size);
+  return bzerror == BZ_OK ? 0 : -1;
+}
+
+static int bz2_close(void* w) {
+  int bzerror;
+  BZ2_bzWriteClose(&bzerror, (BZFILE*)w, 0, NULL, NULL);
+  return bzerror == BZ_OK ? 0 : -1;
+}
+
+const LogCodec log_codec_bz2 = {
+  .name = "bz2",
+  .ext = ".bz2",
+  .open = bz2_open,
+  .write = bz2_write,
+  .close = bz2_close,
+};
+
+#ifdef HAVE_ZSTD
+
+// zstd 9 still compresses several times faster than bzip2 does
+#define LOG_ZSTD_LEVEL 9
+#define LOG_ZSTD_WORKERS 2
+// blocks compressing or waiting to be written before a write blocks
+#define LOG_ZSTD_JOBS (2*LOG_ZSTD_WORKERS)
+
+// from the zstd seekable format spec, contrib/seekable_format in zstd
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+
+typedef struct ZstdJob {
+  uint8_t* in;
+  size_t in_len;
+  uint8_t* out;
+  size_t out_len;
+  bool done;
+} ZstdJob;
+
+typedef struct ZstdSeekEntry {
+  uint32_t compressed_size;
+  uint32_t decompressed_size;
+} ZstdSeekEntry;
+
+typedef struct ZstdWriter {
+  FILE* f;
+  bool failed;
+
+  pthread_mutex_t lock;
+  // a job was submitted or finished, or the workers should exit
+  pthread_cond_t cond;
+  bool exiting;
+  pthread_t workers[LOG_ZSTD_WORKERS];
+
+  // job n lives in jobs[n % LOG_ZSTD_JOBS]. jobs from written to taken are
+  // with the workers, then up to submitted they wait for one. the job at
+  // submitted is the one being filled.
+  ZstdJob jobs[LOG_ZSTD_JOBS];
+  uint64_t written, taken, submitted;
+
+  ZstdSeekEntry* seek_table;
+  size_t seek_table_len, seek_table_cap;
+} ZstdWriter;
+
+static void* zstd_worker(void* arg) {
+  ZstdWriter* w = (ZstdWriter*)arg;
+
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  assert(cctx);
+
+  pthread_mutex_lock(&w->lock);
+  while (true) {
+    while (!w->exiting && w->taken == w->submitted) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->taken == w->submitted) break;
+
+    ZstdJob* job = &w->jobs[w->taken % LOG_ZSTD_JOBS];
+    w->taken++;
+    pthread_mutex_unlock(&w->lock);
+
+    size_t ret = ZSTD_compressCCtx(cctx, job->out, ZSTD_compressBound(LOG_ZSTD_BLOCK_SIZE),
+                                   job->in, job->in_len, LOG_ZSTD_LEVEL);
+
+    pthread_mutex_lock(&w->lock);
+    if (ZSTD_isError(ret)) {
+      LOGE("zstd compress failed: %s", ZSTD_getErrorName(ret));
+      w->failed = true;
+      job->out_len = 0;
+    } else {
+      job->out_len = ret;
+    }
+    job->done = true;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  ZSTD_freeCCtx(cctx);
+  return NULL;
+}
+
+// writes out the oldest job, waiting for it if asked to. with lock held
+static bool zstd_write_oldest(ZstdWriter* w, bool wait) {
+  if (w->written == w->submitted) return false;
+
+  ZstdJob* job = &w->jobs[w->written % LOG_ZSTD_JOBS];
+  while (!job->done) {
+    if (!wait) return false;
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+
+  // only this thread touches finished jobs
+  pthread_mutex_unlock(&w->lock);
+  bool write_failed = false;
+  if (job->out_len > 0) {
+    write_failed = fwrite(job->out, 1, job->out_len, w->f) != job->out_len;
+
+    if (w->seek_table_len == w->seek_table_cap) {
+      w->seek_table_cap = w->seek_table_cap ? 2*w->seek_table_cap : 64;
+      w->seek_table = (ZstdSeekEntry*)realloc(w->seek_table, w->seek_table_cap * sizeof(ZstdSeekEntry));
+      assert(w->seek_table);
+    }
+    w->seek_table[w->seek_table_len++] = (ZstdSeekEntry){
+      .compressed_size = (uint32_t)job->out_len,
+      .decompressed_size = (uint32_t)job->in_len,
+    };
+  }
+  job->in_len = 0;
+  job->out_len = 0;
+  job->done = false;
+  pthread_mutex_lock(&w->lock);
+
+  if (write_failed) w->failed = true;
+  w->written++;
+  return true;
+}
+
+// hands the job being filled to the workers. with lock held
+static void zstd_submit(ZstdWriter* w) {
+  w->submitted++;
+  pthread_cond_broadcast(&w->cond);
+
+  // don't hold on to what's already compressed
+  while (zstd_write_oldest(w, false)) {}
+
+  // make room for the next one
+  if (w->submitted - w->written == LOG_ZSTD_JOBS) {
+    zstd_write_oldest(w, true);
+  }
+
+  ZstdJob* job = &w->jobs[w->submitted % LOG_ZSTD_JOBS];
+  if (job->in == NULL) {
+    job->in = (uint8_t*)malloc(LOG_ZSTD_BLOCK_SIZE);
+    job->out = (uint8_t*)malloc(ZSTD_compressBound(LOG_ZSTD_BLOCK_SIZE));
+    assert(job->in && job->out);
+  }
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void zstd_write_seek_table(ZstdWriter* w) {
+  // skippable frame header, the entries, then the footer
+  const size_t frame_size = w->seek_table_len * 8 + 9;
+  const size_t size = 8 + frame_size;
+  uint8_t* buf = (uint8_t*)malloc(size);
+  assert(buf);
+
+  uint8_t* p = buf;
+  put_le32(p, ZSTD_SKIPPABLE_MAGIC); p += 4;
+  put_le32(p, frame_size); p += 4;
+  for (size_t i=0; i<w->seek_table_len; i++) {
+    put_le32(p, w->seek_table[i].compressed_size); p += 4;
+    put_le32(p, w->seek_table[i].decompressed_size); p += 4;
+  }
+  put_le32(p, w->seek_table_len); p += 4;
+  // descriptor, no checksums
+  *p++ = 0;
+  put_le32(p, ZSTD_SEEKABLE_MAGIC); p += 4;
+
+  if (fwrite(buf, 1, size, w->f) != size) {
+    w->failed = true;
+  }
+  free(buf);
+}
+
+static void* zstd_open(FILE* f) {
+  ZstdWriter* w = (ZstdWriter*)calloc(1, sizeof(ZstdWriter));
+  assert(w);
+  w->f = f;
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  ZstdJob* job = &w->jobs[0];
+  job->in = (uint8_t*)malloc(LOG_ZSTD_BLOCK_SIZE);
+  job->out = (uint8_t*)malloc(ZSTD_compressBound(LOG_ZSTD_BLOCK_SIZE));
+  assert(job->in && job->out);
+
+  for (int i=0; i<LOG_ZSTD_WORKERS; i++) {
+    int err = pthread_create(&w->workers[i], NULL, zstd_worker, w);
+    assert(err == 0);
+  }
+  return w;
+}
+
+static int zstd_write(void* arg, const uint8_t* data, size_t data_size) {
+  ZstdWriter* w = (ZstdWriter*)arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (data_size > 0) {
+    ZstdJob* job = &w->jobs[w->submitted % LOG_ZSTD_JOBS];
+
+    size_t n = LOG_ZSTD_BLOCK_SIZE - job->in_len;
+    if (n > data_size) n = data_size;
+    memcpy(job->in + job->in_len, data, n);
+    job->in_len += n;
+    data += n;
+    data_size -= n;
+
+    if (job->in_len == LOG_ZSTD_BLOCK_SIZE) {
+      zstd_submit(w);
+    }
+  }
+  bool failed = w->failed;
+  pthread_mutex_unlock(&w->lock);
+
+  return failed ? -1 : 0;
+}
+
+static int zstd_close(void* arg) {
+  ZstdWriter* w = (ZstdWriter*)arg;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->jobs[w->submitted % LOG_ZSTD_JOBS].in_len > 0) {
+    w->submitted++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  while (zstd_write_oldest(w, true)) {}
+
+  w->exiting = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  for (int i=0; i<LOG_ZSTD_WORKERS; i++) {
+    pthread_join(w->workers[i], NULL);
+  }
+
+  zstd_write_seek_table(w);
+  const bool failed = w->failed;
+
+  for (int i=0; i<LOG_ZSTD_JOBS; i++) {
+    free(w->jobs[i].in);
+    free(w->jobs[i].out);
+  }
+  free(w->seek_table);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+
+  return failed ? -1 : 0;
+}
+
+const LogCodec log_codec_zstd = {
+  .name = "zstd",
+  .ext = ".zst",
+  .open = zstd_open,
+  .write = zstd_write,
+  .close = zstd_close,
+};
+
+#endif
+
+const LogCodec* log_codec_find(const char* name) {
+  if (strcmp(name, log_codec_bz2.name) == 0) {
+    return &log_codec_bz2;
+  }
+#ifdef HAVE_ZSTD
+  if (strcmp(name, log_codec_zstd.name) == 0) {
+    return &log_codec_zstd;
+  }
+#endif
+  if (strcmp(name, log_codec_blocks.name) == 0) {
+    return &log_codec_blocks;
+  }
+  return NULL;
+}
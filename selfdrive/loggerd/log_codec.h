@@ -0,0 +1,50 @@
+#ifndef LOG_CODEC_H
+#define LOG_CODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A compressor for log files. open wraps an already opened file, write
+// appends to the compressed stream and close flushes it and frees the
+// writer, the file is closed by the caller. write always gets one whole
+// serialized Event.
+typedef struct LogCodec {
+  const char* name;
+  // extension of files written with it, like ".bz2"
+  const char* ext;
+
+  void* (*open)(FILE* f);
+  int (*write)(void* w, const uint8_t* data, size_t data_size);
+  int (*close)(void* w);
+} LogCodec;
+
+// what logs were always written with
+extern const LogCodec log_codec_bz2;
+
+#ifdef HAVE_ZSTD
+// Independent zstd frames of LOG_ZSTD_BLOCK_SIZE bytes each, compressed on
+// worker threads. A seek table in the zstd seekable format ends the file, so
+// readers can start decompressing at any block. Plain zstd tools skip it.
+extern const LogCodec log_codec_zstd;
+
+// seek granularity, and how much of a log can be lost on a crash
+#define LOG_ZSTD_BLOCK_SIZE (1024*1024)
+#endif
+
+// Seekable segments in blocks per service with an index, see log_blocks.h.
+// Blocks are compressed with zstd when it's built in, bzip2 otherwise.
+extern const LogCodec log_codec_blocks;
+
+// NULL if there is no codec by that name in this build
+const LogCodec* log_codec_find(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <chrono>
+
+#include "log_ring.h"
+
+// keeps headers aligned, anything left at the end of buf fits a header
+#define RING_ALIGN 16
+// marks the rest of buf as unused, the next entry starts over at 0
+#define RING_PAD 0xFFFFFFFF
+
+namespace {
+
+size_t align(size_t n) {
+  return (n + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1);
+}
+
+}
+
+LogRing::LogRing(size_t capacity) : size(align(capacity)), head(0), tail(0), consumer_waiting(false) {
+  static_assert(sizeof(Header) == RING_ALIGN, "ring header must be one alignment unit");
+  buf = (uint8_t*)malloc(size);
+  assert(buf);
+}
+
+LogRing::~LogRing() {
+  free(buf);
+}
+
+bool LogRing::push(uint16_t service, uint64_t recv_time, const uint8_t *data, size_t data_size) {
+  uint8_t *dst = reserve(data_size);
+  if (!dst) return false;
+  memcpy(dst, data, data_size);
+  commit(service, recv_time);
+  return true;
+}
+
+uint8_t *LogRing::reserve(size_t data_size) {
+  const size_t need = sizeof(Header) + align(data_size);
+  if (data_size >= RING_PAD || need > size) return NULL;
+
+  const uint64_t t = tail.load(std::memory_order_relaxed);
+  const uint64_t h = head.load(std::memory_order_acquire);
+
+  // entries don't wrap, skip what's left at the end if it doesn't fit
+  size_t pos = t % size;
+  const size_t pad = (size - pos < need) ? size - pos : 0;
+  if (t + pad + need - h > size) return NULL;
+
+  // the consumer doesn't look past tail, a reserve that isn't committed is
+  // just written over by the next one
+  if (pad) {
+    ((Header*)(buf + pos))->size = RING_PAD;
+    pos = 0;
+  }
+
+  reserved = (Header*)(buf + pos);
+  reserved->size = data_size;
+  reserved_end = t + pad + need;
+  return (uint8_t*)(reserved + 1);
+}
+
+void LogRing::commit(uint16_t service, uint64_t recv_time) {
+  reserved->service = service;
+  reserved->recv_time = recv_time;
+
+  tail.store(reserved_end);
+  if (consumer_waiting.load()) {
+    std::lock_guard<std::mutex> lk(lock);
+    cv.notify_one();
+  }
+}
+
+bool LogRing::front(Entry *entry, int timeout_ms) {
+  uint64_t h = head.load(std::memory_order_relaxed);
+
+  if (tail.load(std::memory_order_acquire) == h) {
+    std::unique_lock<std::mutex> lk(lock);
+    // the producer checks this after moving tail, so one of us sees the other
+    consumer_waiting.store(true);
+    if (tail.load() == h) {
+      cv.wait_for(lk, std::chrono::milliseconds(timeout_ms));
+    }
+    consumer_waiting.store(false);
+    if (tail.load(std::memory_order_acquire) == h) return false;
+  }
+
+  const Header *hdr = (const Header*)(buf + h % size);
+  if (hdr->size == RING_PAD) {
+    // the entry pushed along with the pad is at 0
+    h += size - h % size;
+    head.store(h, std::memory_order_release);
+    hdr = (const Header*)buf;
+  }
+
+  entry->service = hdr->service;
+  entry->recv_time = hdr->recv_time;
+  entry->data = (const uint8_t*)(hdr + 1);
+  entry->size = hdr->size;
+  return true;
+}
+
+void LogRing::pop() {
+  const uint64_t h = head.load(std::memory_order_relaxed);
+  const Header *hdr = (const Header*)(buf + h % size);
+  assert(hdr->size != RING_PAD);
+  head.store(h + sizeof(Header) + align(hdr->size), std::memory_order_release);
+}
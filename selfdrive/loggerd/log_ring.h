@@ -0,0 +1,67 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Bounded single producer, single consumer queue of messages, stored back
+// to back in one buffer. push and pop don't lock, only a consumer waiting
+// for an empty ring to fill sleeps on a condition variable.
+class LogRing {
+ public:
+  struct Entry {
+    uint16_t service;
+    // when the producer received it
+    uint64_t recv_time;
+    const uint8_t *data;
+    size_t size;
+  };
+
+  LogRing(size_t capacity);
+  ~LogRing();
+
+  // producer. false if it doesn't fit, nothing is queued then
+  bool push(uint16_t service, uint64_t recv_time, const uint8_t *data, size_t size);
+  // producer, room to fill in place with a message of size bytes, NULL if
+  // it doesn't fit. it's queued on commit
+  uint8_t *reserve(size_t size);
+  void commit(uint16_t service, uint64_t recv_time);
+
+  // consumer. the oldest entry stays valid until pop, false if the ring was
+  // still empty after timeout_ms
+  bool front(Entry *entry, int timeout_ms);
+  void pop();
+
+  size_t capacity() const { return size; }
+  size_t used() const { return tail.load() - head.load(); }
+
+ private:
+  struct Header {
+    uint32_t size;
+    uint16_t service;
+    uint16_t pad;
+    uint64_t recv_time;
+  };
+
+  uint8_t *buf;
+  size_t size;
+
+  // byte offsets that only grow, the position in buf is modulo size.
+  // tail is written by the producer, head by the consumer
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+
+  // producer only, what reserve set aside
+  Header *reserved = NULL;
+  uint64_t reserved_end = 0;
+
+  std::atomic<bool> consumer_waiting;
+  std::mutex lock;
+  std::condition_variable cv;
+};
+
+#endif
@@ -11,7 +11,6 @@
 #include <sys/stat.h>
 
 #include <pthread.h>
-#include <bzlib.h>
 
 #include "common/swaglog.h"
 
@@ -33,7 +32,8 @@ static int mkpath(char* file_path) {
   return 0;
 }
 
-void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog) {
+void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog,
+                 const LogCodec* codec) {
   memset(s, 0, sizeof(*s));
   if (init_data) {
     s->init_data = (uint8_t*)malloc(init_data_len);
@@ -48,6 +48,7 @@ void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data,
 
   s->part = -1;
   s->has_qlog = has_qlog;
+  s->codec = codec;
 
   time_t rawtime = time(NULL);
   struct tm timeinfo;
@@ -73,8 +74,8 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name, s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s%s", h->segment_path, s->log_name, s->codec->ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog%s", h->segment_path, s->codec->ext);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
   err = mkpath(h->log_path);
@@ -92,23 +93,23 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
     if (h->qlog_file == NULL) goto fail;
   }
 
-  int bzerror;
-  h->bz_file = BZ2_bzWriteOpen(&bzerror, h->log_file, 9, 0, 30);
-  if (bzerror != BZ_OK) goto fail;
+  h->codec = s->codec;
+  h->log_writer = h->codec->open(h->log_file);
+  if (h->log_writer == NULL) goto fail;
 
   if (s->has_qlog) {
-    h->bz_qlog = BZ2_bzWriteOpen(&bzerror, h->qlog_file, 9, 0, 30);
-    if (bzerror != BZ_OK) goto fail;
+    h->qlog_writer = h->codec->open(h->qlog_file);
+    if (h->qlog_writer == NULL) goto fail;
   }
 
   if (s->init_data) {
-    BZ2_bzWrite(&bzerror, h->bz_file, s->init_data, s->init_data_len);
-    if (bzerror != BZ_OK) goto fail;
+    err = h->codec->write(h->log_writer, s->init_data, s->init_data_len);
+    if (err) goto fail;
 
     if (s->has_qlog) {
       // init data goes in the qlog too
-      BZ2_bzWrite(&bzerror, h->bz_qlog, s->init_data, s->init_data_len);
-      if (bzerror != BZ_OK) goto fail;
+      err = h->codec->write(h->qlog_writer, s->init_data, s->init_data_len);
+      if (err) goto fail;
     }
   }
 
@@ -117,8 +118,12 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   return h;
 fail:
   LOGE("logger failed to open files");
+  if (h->qlog_writer) h->codec->close(h->qlog_writer);
+  if (h->log_writer) h->codec->close(h->log_writer);
+  h->qlog_writer = h->log_writer = NULL;
   if (h->qlog_file) fclose(h->qlog_file);
   if (h->log_file) fclose(h->log_file);
+  h->qlog_file = h->log_file = NULL;
   return NULL;
 }
 
@@ -182,11 +187,19 @@ void logger_close(LoggerState *s) {
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
-  int bzerror;
-  BZ2_bzWrite(&bzerror, h->bz_file, data, data_size);
+  h->codec->write(h->log_writer, data, data_size);
 
-  if (in_qlog && h->bz_qlog != NULL) {
-    BZ2_bzWrite(&bzerror, h->bz_qlog, data, data_size);
+  if (in_qlog && h->qlog_writer != NULL) {
+    h->codec->write(h->qlog_writer, data, data_size);
+  }
+  pthread_mutex_unlock(&h->lock);
+}
+
+void lh_log_qlog(LoggerHandle* h, uint8_t* data, size_t data_size) {
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt > 0);
+  if (h->qlog_writer != NULL) {
+    h->codec->write(h->qlog_writer, data, data_size);
   }
   pthread_mutex_unlock(&h->lock);
 }
@@ -196,15 +209,13 @@ void lh_close(LoggerHandle* h) {
   assert(h->refcnt > 0);
   h->refcnt--;
   if (h->refcnt == 0) {
-    if (h->bz_file){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_file, 0, NULL, NULL);
-      h->bz_file = NULL;
+    if (h->log_writer) {
+      h->codec->close(h->log_writer);
+      h->log_writer = NULL;
     }
-    if (h->bz_qlog){
-      int bzerror;
-      BZ2_bzWriteClose(&bzerror, h->bz_qlog, 0, NULL, NULL);
-      h->bz_qlog = NULL;
+    if (h->qlog_writer) {
+      h->codec->close(h->qlog_writer);
+      h->qlog_writer = NULL;
     }
     if (h->qlog_file) fclose(h->qlog_file);
     fclose(h->log_file);
@@ -4,7 +4,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <bzlib.h>
+
+#include "log_codec.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,12 +19,13 @@ typedef struct LoggerHandle {
   char segment_path[4096];
   char log_path[4096];
   char lock_path[4096];
+  const LogCodec* codec;
   FILE* log_file;
-  BZFILE* bz_file;
+  void* log_writer;
 
   FILE* qlog_file;
   char qlog_path[4096];
-  BZFILE* bz_qlog;
+  void* qlog_writer;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -36,12 +38,14 @@ typedef struct LoggerState {
   char route_name[64];
   char log_name[64];
   bool has_qlog;
+  const LogCodec* codec;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
 } LoggerState;
 
-void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog);
+void logger_init(LoggerState *s, const char* log_name, const uint8_t* init_data, size_t init_data_len, bool has_qlog,
+                 const LogCodec* codec);
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part);
@@ -50,6 +54,7 @@ void logger_close(LoggerState *s);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+void lh_log_qlog(LoggerHandle* h, uint8_t* data, size_t data_size);
 void lh_close(LoggerHandle* h);
 
 #ifdef __cplusplus
@@ -19,6 +19,9 @@
 #include <mutex>
 #include <condition_variable>
 #include <random>
+#include <atomic>
+#include <deque>
+#include <algorithm>
 
 #include <ftw.h>
 
@@ -34,8 +37,13 @@
 #include "common/visionipc.h"
 #include "common/utilpp.h"
 #include "common/util.h"
+#include "common/aligned_buffer.h"
+#include "common/shm_ring.h"
 
 #include "logger.h"
+#include "log_ring.h"
+#include "qlog_filter.h"
+#include "shm_handover.h"
 
 
 #ifndef DISABLE_ENCODER
@@ -53,6 +61,19 @@
 #define RAW_CLIP_LENGTH 100 // 5 seconds at 20fps
 #define RAW_CLIP_FREQUENCY (randrange(61, 8*60)) // once every ~4 minutes
 
+// messages wait here for the writer while the disk is slow, tens of seconds worth
+#define LOG_RING_SIZE (64*1024*1024)
+// a message waiting longer than this in the ring counts as delayed
+#define LOG_DELAY_NS (500000000ULL)
+// how often loggerdStats is published
+#define LOGGERD_STATS_INTERVAL_NS (1000000000ULL)
+// ring entry asking the writer to start the next segment, holds the frame id to rotate after
+#define ROTATE_SERVICE 0xFFFF
+// shm rings are drained this often
+#define SHM_POLL_MS 10
+// how often rings of new publishers are looked for and dead ones dropped
+#define SHM_CHECK_INTERVAL_NS (1000000000ULL)
+
 namespace {
 
 double randrange(double a, double b) {
@@ -67,16 +88,43 @@ volatile int do_exit = 0;
 static void set_do_exit(int sig) {
   do_exit = 1;
 }
+struct ServiceStats {
+  std::string name;
+
+  // counted by the receive loop
+  std::atomic<uint32_t> dropped_msgs;
+  std::atomic<uint64_t> dropped_bytes;
+  std::atomic<uint32_t> shm_overruns;
+
+  // by the writer
+  uint32_t msgs = 0;
+  uint64_t bytes = 0;
+  uint32_t delayed_msgs = 0;
+  uint64_t delayed_bytes = 0;
+
+  ServiceStats(const std::string &name) : name(name), dropped_msgs(0), dropped_bytes(0), shm_overruns(0) {}
+};
+
 struct LoggerdState {
   void *ctx;
   LoggerState logger;
 
+  // from the receive loop to log_writer_thread, indexed by socket
+  LogRing *ring;
+  std::deque<ServiceStats> services;
+  // only used by log_writer_thread
+  QlogFilter *qlog_filter;
+
   std::mutex lock;
   std::condition_variable cv;
   char segment_path[4096];
   uint32_t last_frame_id;
   uint32_t rotate_last_frame_id;
   int rotate_segment;
+  // frame ids of rotations queued in the ring that the writer hasn't done
+  // yet. the rear encoder holds frames past the first until it has, so the
+  // video rotates at the same frame however far behind the writer is
+  std::deque<uint32_t> rotate_queued_frame_ids;
 };
 LoggerdState s;
 
@@ -171,6 +219,11 @@ void encoder_thread(bool is_streaming, bool raw_clips, bool front) {
                  && !do_exit) {
             s.cv.wait(lk);
           }
+          while (!s.rotate_queued_frame_ids.empty()
+                 && extra.frame_id > s.rotate_queued_frame_ids.front()
+                 && !do_exit) {
+            s.cv.wait(lk);
+          }
           should_rotate = extra.frame_id > s.rotate_last_frame_id && encoder_segment < s.rotate_segment;
         } else {
           // front camera is best effort
@@ -288,6 +341,133 @@ void encoder_thread(bool is_streaming, bool raw_clips, bool front) {
 }
 #endif
 
+void publish_loggerd_stats(void *sock, uint64_t cur_time, uint64_t interval, size_t high_water, uint64_t max_delay) {
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(cur_time);
+  auto stats = event.initLoggerdStats();
+
+  stats.setIntervalNanos(interval);
+  stats.setRingSize(s.ring->capacity());
+  stats.setRingHighWater(high_water);
+  stats.setMaxDelayNanos(max_delay);
+
+  std::vector<ServiceStats*> active;
+  std::vector<uint32_t> dropped_msgs;
+  std::vector<uint64_t> dropped_bytes;
+  std::vector<uint32_t> shm_overruns;
+  for (ServiceStats &st : s.services) {
+    uint32_t msgs = st.dropped_msgs.exchange(0);
+    uint64_t bytes = st.dropped_bytes.exchange(0);
+    uint32_t overruns = st.shm_overruns.exchange(0);
+    if (st.msgs == 0 && msgs == 0 && overruns == 0) continue;
+
+    active.push_back(&st);
+    dropped_msgs.push_back(msgs);
+    dropped_bytes.push_back(bytes);
+    shm_overruns.push_back(overruns);
+  }
+
+  auto lservices = stats.initServices(active.size());
+  for (int i=0; i<active.size(); i++) {
+    ServiceStats *st = active[i];
+    auto lservice = lservices[i];
+    lservice.setName(st->name);
+    lservice.setMsgs(st->msgs);
+    lservice.setBytes(st->bytes);
+    lservice.setDroppedMsgs(dropped_msgs[i]);
+    lservice.setDroppedBytes(dropped_bytes[i]);
+    lservice.setDelayedMsgs(st->delayed_msgs);
+    lservice.setDelayedBytes(st->delayed_bytes);
+    lservice.setShmOverruns(shm_overruns[i]);
+
+    st->msgs = 0;
+    st->bytes = 0;
+    st->delayed_msgs = 0;
+    st->delayed_bytes = 0;
+  }
+
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  zmq_send(sock, bytes.begin(), bytes.size(), 0);
+}
+
+// compresses and writes what the receive loop queued, so a slow disk
+// doesn't stop it from draining the sockets. runs until do_exit and the
+// ring is empty.
+void log_writer_thread() {
+  int err;
+  set_thread_name("loggerd_writer");
+
+  // loggerdStats = 8073
+  void *stats_sock = zmq_socket(s.ctx, ZMQ_PUB);
+  assert(stats_sock);
+  zmq_bind(stats_sock, "tcp://*:8073");
+
+  uint64_t last_stats_time = nanos_since_boot();
+  size_t high_water = 0;
+  uint64_t max_delay = 0;
+
+  s.qlog_filter->rotate(logger_get_handle(&s.logger));
+
+  while (true) {
+    LogRing::Entry entry;
+    if (s.ring->front(&entry, 100)) {
+      high_water = std::max(high_water, s.ring->used());
+
+      if (entry.service == ROTATE_SERVICE) {
+        {
+          std::lock_guard<std::mutex> guard(s.lock);
+          memcpy(&s.rotate_last_frame_id, entry.data, sizeof(s.rotate_last_frame_id));
+          if (!s.rotate_queued_frame_ids.empty()) {
+            s.rotate_queued_frame_ids.pop_front();
+          }
+
+          err = logger_next(&s.logger, LOG_ROOT, s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
+          assert(err == 0);
+          LOGW("rotated to %s", s.segment_path);
+        }
+        s.cv.notify_all();
+
+        s.qlog_filter->rotate(logger_get_handle(&s.logger));
+      } else {
+        const uint64_t delay = nanos_since_boot() - entry.recv_time;
+        max_delay = std::max(max_delay, delay);
+
+        logger_log(&s.logger, (uint8_t*)entry.data, entry.size, false);
+        s.qlog_filter->log(entry.service, entry.recv_time, entry.data, entry.size);
+
+        ServiceStats &st = s.services[entry.service];
+        st.msgs++;
+        st.bytes += entry.size;
+        if (delay > LOG_DELAY_NS) {
+          st.delayed_msgs++;
+          st.delayed_bytes += entry.size;
+        }
+      }
+      s.ring->pop();
+    } else if (do_exit) {
+      break;
+    } else {
+      // nothing in the ring could trigger a window anymore
+      s.qlog_filter->flush(nanos_since_boot());
+    }
+
+    const uint64_t cur_time = nanos_since_boot();
+    if (cur_time - last_stats_time >= LOGGERD_STATS_INTERVAL_NS) {
+      publish_loggerd_stats(stats_sock, cur_time, cur_time - last_stats_time, high_water, max_delay);
+      last_stats_time = cur_time;
+      high_water = s.ring->used();
+      max_delay = 0;
+
+      s.qlog_filter->reload_rules();
+    }
+  }
+
+  s.qlog_filter->flush(0, true);
+  zmq_close(stats_sock);
+}
+
 #if ENABLE_LIDAR
 
 #include <netinet/in.h>
@@ -491,7 +671,7 @@ static void bootlog() {
   {
     auto words = gen_init_data();
     auto bytes = words.asBytes();
-    logger_init(&s.logger, "bootlog", bytes.begin(), bytes.size(), false);
+    logger_init(&s.logger, "bootlog", bytes.begin(), bytes.size(), false, &log_codec_bz2);
   }
 
   err = logger_next(&s.logger, LOG_ROOT, s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
@@ -521,6 +701,118 @@ static void bootlog() {
   logger_close(&s.logger);
 }
 
+// track camera frames to sync to encoder
+void track_frame(const uint8_t *data, size_t len) {
+  // frame packets are read in place, this only holds copies of misaligned ones
+  static AlignedBuffer frame_buf;
+
+  capnp::FlatArrayMessageReader cmsg(frame_buf.align(data, len));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+  if (event.isFrame()) {
+    std::unique_lock<std::mutex> lk(s.lock);
+    s.last_frame_id = event.getFrame().getFrameId();
+    lk.unlock();
+    s.cv.notify_all();
+  }
+}
+
+uint64_t log_mono_time(const uint8_t *data, size_t len) {
+  static AlignedBuffer mono_buf;
+
+  try {
+    capnp::FlatArrayMessageReader cmsg(mono_buf.align(data, len));
+    return cmsg.getRoot<cereal::Event>().getLogMonoTime();
+  } catch (...) {
+    return 0;
+  }
+}
+
+// moves what's new in the shm ring of service i to the log ring. once it's
+// read up to what zmq took over with, it's closed
+void read_shm_ring(int i, ShmRingReader &shm, ShmHandover &handover, bool frame, uint64_t recv_time,
+                   uint64_t &msg_count, uint64_t &bytes_count) {
+  ServiceStats &st = s.services[i];
+
+  size_t len;
+  while ((len = shm.next_size()) > 0) {
+    uint8_t *data = s.ring->reserve(len);
+    if (!data) {
+      shm.skip();
+      st.dropped_msgs++;
+      st.dropped_bytes += len;
+      LOGE_100("log ring full, dropped %s", st.name.c_str());
+      continue;
+    }
+    if (!shm.read(data)) continue;
+
+    // logged from zmq, the reservation is written over by the next
+    if (!handover.ring_msg(log_mono_time(data, len))) {
+      if (handover.ring_done()) break;
+      continue;
+    }
+
+    if (frame) {
+      track_frame(data, len);
+    }
+    s.ring->commit(i, recv_time);
+
+    bytes_count += len;
+    msg_count++;
+  }
+
+  if (shm.overruns) {
+    st.shm_overruns += shm.overruns;
+    shm.overruns = 0;
+    LOGE_100("%s shm ring overrun", st.name.c_str());
+  }
+
+  if (handover.ring_done()) {
+    shm.close();
+    handover.closed();
+    LOGW("%s back on zmq", st.name.c_str());
+  }
+}
+
+// the publisher sent something on zmq only, that was lost if zmq was
+// unsubscribed. zmq is needed from now on
+void shm_skipped(ShmRingReader &shm, ShmHandover &handover, void *sock, ServiceStats &st) {
+  st.shm_overruns += shm.skipped();
+  LOGE("%s too big for its shm ring, going back to zmq", st.name.c_str());
+  if (handover.state() == ShmHandover::RING) {
+    zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
+  }
+  handover.to_zmq();
+}
+
+// drops the rings of publishers that are gone and opens those of new ones.
+// zmq stays subscribed until it catches up with the ring
+void check_shm_rings(std::vector<ShmRingReader> &shm, std::vector<ShmHandover> &handover,
+                     const std::vector<void*> &socks, const std::vector<bool> &local) {
+  for (int i=0; i<shm.size(); i++) {
+    if (!local[i]) continue;
+    ServiceStats &st = s.services[i];
+
+    if (shm[i].is_open() && shm[i].stale()) {
+      // read to the end already. a new publisher's ring has all it sent
+      shm[i].close();
+      if (handover[i].state() == ShmHandover::RING) {
+        zmq_setsockopt(socks[i], ZMQ_SUBSCRIBE, "", 0);
+      }
+      handover[i].closed();
+      LOGW("%s back on zmq", st.name.c_str());
+    }
+
+    if (!shm[i].is_open() && shm[i].open(st.name.c_str())) {
+      if (shm[i].stale()) {
+        // left behind by a publisher that's gone
+        shm[i].close();
+        continue;
+      }
+      handover[i].to_ring();
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   int err;
 
@@ -544,18 +836,24 @@ int main(int argc, char** argv) {
   std::string exe_dir = util::dir_name(util::readlink("/proc/self/exe"));
   std::string service_list_path = exe_dir + "/../service_list.yaml";
 
+  const char* qlog_rules_env = getenv("LOGGERD_QLOG_RULES");
+  std::string qlog_rules_path = qlog_rules_env ? qlog_rules_env : exe_dir + "/qlog_rules.yaml";
+
   // subscribe to all services
 
   void *frame_sock = NULL;
 
+  // services published by a process here, which may have an shm ring
+  std::vector<bool> local_service;
+
   // zmq_poll is slow because it has to be careful because the signaling
   // fd is edge-triggered. we can be faster by knowing that we're not messing with it
   // other than draining and polling
   std::vector<struct pollfd> polls;
   std::vector<void*> socks;
 
-  std::map<void*, int> qlog_counter;
-  std::map<void*, int> qlog_freqs;
+  std::vector<std::string> service_names;
+  std::vector<int> qlog_decimations;
 
   YAML::Node service_list = YAML::LoadFile(service_list_path);
   for (const auto& it : service_list) {
@@ -580,6 +878,7 @@ int main(int argc, char** argv) {
       } else{
         ss << "127.0.0.1";
       }
+      local_service.push_back(!it.second[4]);
       ss << ":" << port;
 
       zmq_connect(sock, ss.str().c_str());
@@ -597,16 +896,37 @@ int main(int argc, char** argv) {
         frame_sock = sock;
       }
 
-      qlog_counter[sock] = (qlog_freq == 0) ? -1 : 0;
-      qlog_freqs[sock] = qlog_freq;
+      service_names.push_back(name);
+      qlog_decimations.push_back(qlog_freq);
+      s.services.emplace_back(name);
     }
   }
+  s.ring = new LogRing(LOG_RING_SIZE);
+
+  std::vector<ShmRingReader> shm(socks.size());
+  // nothing from before loggerd started is taken from a ring
+  std::vector<ShmHandover> shm_handover(socks.size(), ShmHandover(nanos_since_boot()));
+  const bool use_shm = getenv("LOGGERD_NO_SHM") == NULL;
+  uint64_t last_shm_check = 0;
+
+  s.qlog_filter = new QlogFilter(service_names, qlog_decimations);
+  s.qlog_filter->load_rules(qlog_rules_path);
 
 
+  const LogCodec* codec = &log_codec_bz2;
+  const char* codec_name = getenv("LOGGERD_CODEC");
+  if (codec_name) {
+    codec = log_codec_find(codec_name);
+    if (!codec) {
+      LOGE("unknown log codec %s, using bz2", codec_name);
+      codec = &log_codec_bz2;
+    }
+  }
+
   {
     auto words = gen_init_data();
     auto bytes = words.asBytes();
-    logger_init(&s.logger, "rlog", bytes.begin(), bytes.size(), true);
+    logger_init(&s.logger, "rlog", bytes.begin(), bytes.size(), true, codec);
   }
 
   bool is_streaming = false;
@@ -628,6 +948,8 @@ int main(int argc, char** argv) {
   double start_ts = seconds_since_boot();
   double last_rotate_ts = start_ts;
 
+  std::thread log_writer_thread_handle(log_writer_thread);
+
 #ifndef DISABLE_ENCODER
   // rear camera
   std::thread encoder_thread_handle(encoder_thread, is_streaming, false, false);
@@ -645,9 +967,32 @@ int main(int argc, char** argv) {
 
   while (!do_exit) {
     // err = zmq_poll(polls.data(), polls.size(), 100 * 1000);
-    err = poll(polls.data(), polls.size(), 100*1000);
+    // rings don't wake poll, wake up to drain them and to look for new ones
+    int timeout = use_shm ? SHM_CHECK_INTERVAL_NS / 1000000 : 100*1000;
+    if (std::any_of(shm.begin(), shm.end(), [](const ShmRingReader &r) { return r.is_open(); })) {
+      timeout = SHM_POLL_MS;
+    }
+    err = poll(polls.data(), polls.size(), timeout);
     if (err < 0) break;
 
+    const uint64_t poll_time = nanos_since_boot();
+
+    // everything the rings got since the last poll, copied once, straight into the log ring
+    for (int i=0; i<shm.size(); i++) {
+      if (!shm[i].is_open()) continue;
+      read_shm_ring(i, shm[i], shm_handover[i], socks[i] == frame_sock, poll_time, msg_count, bytes_count);
+
+      const ShmHandover::State state = shm_handover[i].state();
+      if (shm[i].is_open() && shm[i].skipped() && (state == ShmHandover::TO_RING || state == ShmHandover::RING)) {
+        shm_skipped(shm[i], shm_handover[i], socks[i], s.services[i]);
+      }
+    }
+
+    if (use_shm && poll_time - last_shm_check >= SHM_CHECK_INTERVAL_NS) {
+      check_shm_rings(shm, shm_handover, socks, local_service);
+      last_shm_check = poll_time;
+    }
+
     for (int i=0; i<polls.size(); i++) {
       if (!polls[i].revents) continue;
 
@@ -664,22 +1009,34 @@ int main(int argc, char** argv) {
         uint8_t* data = (uint8_t*)zmq_msg_data(&msg);
         size_t len = zmq_msg_size(&msg);
 
-        if (socks[i] == frame_sock) {
-          // make copy due to alignment issues, will be freed on out of scope
-          auto amsg = kj::heapArray<capnp::word>((len / sizeof(capnp::word)) + 1);
-          memcpy(amsg.begin(), data, len);
-
-          // track camera frames to sync to encoder
-          capnp::FlatArrayMessageReader cmsg(amsg);
-          cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-          if (event.isFrame()) {
-            std::unique_lock<std::mutex> lk(s.lock);
-            s.last_frame_id = event.getFrame().getFrameId();
-            lk.unlock();
-            s.cv.notify_all();
+        if (use_shm && local_service[i]) {
+          // what it logs from zmq the ring passes over later
+          ShmHandover &handover = shm_handover[i];
+          const bool to_ring = handover.state() == ShmHandover::TO_RING;
+          if (to_ring) {
+            // the ring got it first, and whatever zmq missed before it
+            read_shm_ring(i, shm[i], handover, socks[i] == frame_sock, nanos_since_boot(), msg_count, bytes_count);
+          }
+          const bool logged = handover.zmq_msg(log_mono_time(data, len));
+          if (to_ring && handover.state() == ShmHandover::RING) {
+            // zmq caught up, what it still has queued is dropped
+            zmq_setsockopt(socks[i], ZMQ_UNSUBSCRIBE, "", 0);
+            LOG("%s over shm", s.services[i].name.c_str());
+          }
+          if (handover.ring_done()) {
+            // what's before this one is in the ring
+            read_shm_ring(i, shm[i], handover, socks[i] == frame_sock, nanos_since_boot(), msg_count, bytes_count);
+          }
+          if (!logged) {
+            zmq_msg_close(&msg);
+            continue;
           }
         }
 
+        if (socks[i] == frame_sock) {
+          track_frame(data, len);
+        }
+
         if (ts_replace_sock.find(socks[i]) != ts_replace_sock.end()) {
           // get new time
           uint64_t current_time = nanos_since_boot();
@@ -715,14 +1072,13 @@ int main(int argc, char** argv) {
           memcpy(data+0x10, &current_time, sizeof(current_time));
         }
 
-        logger_log(&s.logger, data, len, qlog_counter[socks[i]] == 0);
-        zmq_msg_close(&msg);
-
-        if (qlog_counter[socks[i]] != -1) {
-          //printf("%p: %d/%d\n", socks[i], qlog_counter[socks[i]], qlog_freqs[socks[i]]);
-          qlog_counter[socks[i]]++;
-          qlog_counter[socks[i]] %= qlog_freqs[socks[i]];
+        if (!s.ring->push(i, nanos_since_boot(), data, len)) {
+          ServiceStats &st = s.services[i];
+          st.dropped_msgs++;
+          st.dropped_bytes += len;
+          LOGE_100("log ring full, dropped %s", st.name.c_str());
         }
+        zmq_msg_close(&msg);
 
         bytes_count += len;
         msg_count++;
@@ -731,17 +1087,19 @@ int main(int argc, char** argv) {
 
     double ts = seconds_since_boot();
     if (ts - last_rotate_ts > SEGMENT_LENGTH) {
-      // rotate the log
-
-      last_rotate_ts += SEGMENT_LENGTH;
-
-      std::lock_guard<std::mutex> guard(s.lock);
-      s.rotate_last_frame_id = s.last_frame_id;
-
+      // rotate the log, the writer does it in order with the messages before.
+      // queued before the push, the writer may take it right away
+      std::unique_lock<std::mutex> lk(s.lock);
+      const uint32_t frame_id = s.last_frame_id;
       if (is_logging) {
-        err = logger_next(&s.logger, LOG_ROOT, s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
-        assert(err == 0);
-        LOGW("rotated to %s", s.segment_path);
+        s.rotate_queued_frame_ids.push_back(frame_id);
+      }
+
+      // if the ring is full, try again after the next messages
+      if (!is_logging || s.ring->push(ROTATE_SERVICE, nanos_since_boot(), (uint8_t*)&frame_id, sizeof(frame_id))) {
+        last_rotate_ts += SEGMENT_LENGTH;
+      } else {
+        s.rotate_queued_frame_ids.pop_back();
       }
     }
 
@@ -751,8 +1109,12 @@ int main(int argc, char** argv) {
   }
 
   LOGW("joining threads");
+  do_exit = 1;
   s.cv.notify_all();
 
+  log_writer_thread_handle.join();
+  LOGW("log writer joined");
+
 #ifndef DISABLE_ENCODER
   //front_encoder_thread_handle.join();
   encoder_thread_handle.join();
@@ -764,7 +1126,10 @@ int main(int argc, char** argv) {
   LOGW("lidar joined");
 #endif
 
+  // releases its segments before the last one is closed
+  delete s.qlog_filter;
   logger_close(&s.logger);
+  delete s.ring;
 
   return 0;
 }
@@ -0,0 +1,284 @@
+#include <cstring>
+#include <cassert>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include <yaml-cpp/yaml.h>
+#include <capnp/serialize.h>
+
+#include "common/swaglog.h"
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "qlog_filter.h"
+
+namespace {
+
+const char *trigger_names[] = {
+  "alert",
+  "engage",
+  "disengage",
+};
+
+}
+
+QlogFilter::QlogFilter(const std::vector<std::string> &services, const std::vector<int> &decimations)
+  : names(services), base_decimations(decimations), services(services.size()) {
+  assert(services.size() == decimations.size());
+
+  for (int i=0; i<names.size(); i++) {
+    this->services[i].rule = (ServiceRule){base_decimations[i], 0, 0};
+    if (names[i] == "controlsState") {
+      controls_state = i;
+    }
+  }
+}
+
+QlogFilter::~QlogFilter() {
+  flush(0, true);
+  for (LoggerHandle *h : handles) {
+    if (h) lh_close(h);
+  }
+}
+
+bool QlogFilter::load_rules(const std::string &path) {
+  rules_path = path;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    LOGW("no qlog rules at %s", path.c_str());
+    return false;
+  }
+  rules_mtime = st.st_mtim;
+
+  std::vector<ServiceRule> rules;
+  for (int d : base_decimations) {
+    rules.push_back((ServiceRule){d, 0, 0});
+  }
+  std::vector<Window> new_windows;
+
+  try {
+    YAML::Node root = YAML::LoadFile(path);
+
+    for (const auto& it : root["services"]) {
+      auto name = it.first.as<std::string>();
+      auto found = std::find(names.begin(), names.end(), name);
+      if (found == names.end()) {
+        LOGW("qlog rules: %s isn't logged", name.c_str());
+        continue;
+      }
+
+      ServiceRule &rule = rules[found - names.begin()];
+      rule.decimation = it.second["decimation"] ? it.second["decimation"].as<int>() : 0;
+      rule.min_interval = 0;
+      if (it.second["rate"]) {
+        double rate = it.second["rate"].as<double>();
+        if (rate <= 0) {
+          LOGE("qlog rules %s: bad rate for %s", path.c_str(), name.c_str());
+          return false;
+        }
+        rule.min_interval = 1e9 / rate;
+      }
+    }
+
+    for (const auto& it : root["windows"]) {
+      if (new_windows.size() == MAX_WINDOWS) {
+        LOGE("qlog rules %s: more than %d windows", path.c_str(), MAX_WINDOWS);
+        return false;
+      }
+
+      Window w;
+      auto trigger = it["trigger"].as<std::string>();
+      auto found = std::find(std::begin(trigger_names), std::end(trigger_names), trigger);
+      if (found == std::end(trigger_names)) {
+        LOGE("qlog rules %s: unknown trigger %s", path.c_str(), trigger.c_str());
+        return false;
+      }
+      w.trigger = (Trigger)(found - std::begin(trigger_names));
+      w.before = it["before"].as<double>() * 1e9;
+      w.after = it["after"].as<double>() * 1e9;
+
+      for (const auto& svc : it["services"]) {
+        auto name = svc.as<std::string>();
+        auto found_svc = std::find(names.begin(), names.end(), name);
+        if (found_svc == names.end()) {
+          LOGW("qlog rules: %s isn't logged", name.c_str());
+          continue;
+        }
+        rules[found_svc - names.begin()].windows |= 1U << new_windows.size();
+      }
+      new_windows.push_back(w);
+    }
+  } catch (const YAML::Exception &e) {
+    LOGE("qlog rules %s: %s", path.c_str(), e.what());
+    return false;
+  }
+
+  for (int i=0; i<services.size(); i++) {
+    services[i].rule = rules[i];
+    services[i].counter = 0;
+  }
+  windows = new_windows;
+
+  lookback_windows = 0;
+  max_before = 0;
+  for (int i=0; i<windows.size(); i++) {
+    if (windows[i].before > 0) {
+      lookback_windows |= 1U << i;
+    }
+    max_before = std::max(max_before, windows[i].before);
+  }
+
+  // window bits of what's held refer to the old rules
+  for (Held &m : held) {
+    m.windows = 0;
+  }
+
+  LOG("qlog rules from %s: %zu windows", path.c_str(), windows.size());
+  return true;
+}
+
+void QlogFilter::reload_rules() {
+  if (rules_path.empty()) return;
+
+  struct stat st;
+  if (stat(rules_path.c_str(), &st) != 0) return;
+  if (st.st_mtim.tv_sec == rules_mtime.tv_sec && st.st_mtim.tv_nsec == rules_mtime.tv_nsec) return;
+
+  if (!load_rules(rules_path)) {
+    // don't retry until it changes again
+    rules_mtime = st.st_mtim;
+  }
+}
+
+void QlogFilter::rotate(LoggerHandle *h) {
+  handles.push_back(h);
+  flush(0);
+}
+
+uint32_t QlogFilter::controls_triggers(const uint8_t *data, size_t size) {
+  uint32_t fired = 0;
+  try {
+    capnp::FlatArrayMessageReader cmsg(controls_buf.align(data, size));
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    if (!event.isControlsState()) return 0;
+    auto controls = event.getControlsState();
+
+    bool enabled = controls.getEnabled();
+    if (enabled && !last_enabled) fired |= 1U << TRIGGER_ENGAGE;
+    if (!enabled && last_enabled) fired |= 1U << TRIGGER_DISENGAGE;
+    last_enabled = enabled;
+
+    // the alert stays up for a while, only a new one counts
+    std::string alert = controls.getAlertType().cStr();
+    if (!alert.empty() && alert != last_alert) fired |= 1U << TRIGGER_ALERT;
+    last_alert = alert;
+  } catch (...) {
+    LOGE_100("qlog filter can't read controlsState");
+  }
+  return fired;
+}
+
+void QlogFilter::fire(Trigger trigger, uint64_t t) {
+  uint32_t fired = 0;
+  for (int i=0; i<windows.size(); i++) {
+    Window &w = windows[i];
+    if (w.trigger != trigger) continue;
+
+    w.active_until = std::max(w.active_until, t + w.after);
+    fired |= 1U << i;
+  }
+
+  // what the windows look back on, in the order received
+  for (Held &m : held) {
+    for (uint32_t w = m.windows & fired; w; w &= w - 1) {
+      if (m.recv_time + windows[__builtin_ctz(w)].before >= t) {
+        if (m.handle) lh_log_qlog(m.handle, &held_data[m.offset], m.size);
+        m.windows = 0;
+        break;
+      }
+    }
+  }
+}
+
+void QlogFilter::hold(uint64_t recv_time, LoggerHandle *h, const uint8_t *data, size_t size, uint32_t window_bits) {
+  // free is after held_head up to the end, and before the oldest message,
+  // or between held_head and the oldest once wrapped. never filled up to
+  // the oldest, held_head == tail is empty
+  const size_t tail = held.empty() ? 0 : held.front().offset;
+  if (held.empty()) held_head = 0;
+
+  size_t offset;
+  if (held_head >= tail && held_data.size() - held_head >= size) {
+    offset = held_head;
+  } else if (held_head >= tail && size < tail) {
+    offset = 0;
+  } else if (held_head < tail && tail - held_head > size) {
+    offset = held_head;
+  } else {
+    // too small, copies what's held in order into a bigger one
+    size_t held_size = 0;
+    for (const Held &m : held) held_size += m.size;
+    std::vector<uint8_t> bigger(std::max(2 * held_data.size(), held_size + size));
+    size_t pos = 0;
+    for (Held &m : held) {
+      memcpy(&bigger[pos], &held_data[m.offset], m.size);
+      m.offset = pos;
+      pos += m.size;
+    }
+    held_data.swap(bigger);
+    offset = pos;
+  }
+
+  memcpy(&held_data[offset], data, size);
+  held_head = offset + size;
+  held.push_back((Held){recv_time, h, offset, size, window_bits});
+}
+
+void QlogFilter::log(int service, uint64_t recv_time, const uint8_t *data, size_t size) {
+  ServiceState &st = services[service];
+
+  if (service == controls_state && !windows.empty()) {
+    uint32_t fired = controls_triggers(data, size);
+    for (int t=0; t<NUM_TRIGGERS; t++) {
+      if (fired & (1U << t)) fire((Trigger)t, recv_time);
+    }
+  }
+
+  bool keep = false;
+  if (st.rule.min_interval > 0) {
+    keep = recv_time - st.last_kept >= st.rule.min_interval;
+  } else if (st.rule.decimation > 0) {
+    keep = st.counter == 0;
+    st.counter = (st.counter + 1) % st.rule.decimation;
+  }
+
+  for (uint32_t w = st.rule.windows; w && !keep; w &= w - 1) {
+    keep = recv_time <= windows[__builtin_ctz(w)].active_until;
+  }
+  if (keep) {
+    st.last_kept = recv_time;
+  }
+
+  LoggerHandle *h = handles.empty() ? NULL : handles.back();
+  if (keep) {
+    if (h) lh_log_qlog(h, (uint8_t*)data, size);
+  } else if (st.rule.windows & lookback_windows) {
+    // might still be kept by a trigger in the next max_before
+    hold(recv_time, h, data, size, st.rule.windows & lookback_windows);
+  }
+  flush(recv_time);
+}
+
+void QlogFilter::flush(uint64_t now, bool flush_all) {
+  while (!held.empty() && (flush_all || held.front().recv_time + max_before <= now)) {
+    held.pop_front();
+  }
+
+  // segments nothing held goes to anymore
+  while (handles.size() > 1 && (held.empty() || held.front().handle != handles.front())) {
+    if (handles.front()) lh_close(handles.front());
+    handles.pop_front();
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef QLOG_FILTER_H
+#define QLOG_FILTER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "common/aligned_buffer.h"
+
+#include "logger.h"
+
+// Picks the messages that go in the qlog. Each service keeps every n-th
+// message (the decimation column of service_list.yaml) or at most some
+// messages a second, and windows keep everything of chosen services from
+// a few seconds before to a few seconds after a trigger, like openpilot
+// disengaging. The rules come from a yaml file that can change while
+// loggerd runs, see qlog_rules.yaml.
+//
+// Kept messages are written right away. To look back before a trigger,
+// messages a lookback window might still want are held for its before time
+// and written when it fires, after what's already been kept since. Held
+// messages keep the handle of the segment they were received in, so they
+// still go in that segment's qlog after a rotation.
+class QlogFilter {
+ public:
+  // services in socket order, with their service_list decimations
+  QlogFilter(const std::vector<std::string> &services, const std::vector<int> &decimations);
+  ~QlogFilter();
+
+  // merges the rules in path over the service_list decimations. false and
+  // the old rules stay if it doesn't parse
+  bool load_rules(const std::string &path);
+  // reloads the rules if the file changed since they were loaded
+  void reload_rules();
+
+  // qlog messages from now on go to h, this takes over its reference
+  void rotate(LoggerHandle *h);
+
+  void log(int service, uint64_t recv_time, const uint8_t *data, size_t size);
+  // drops held messages no window can want anymore, all if flush_all
+  void flush(uint64_t now, bool flush_all = false);
+
+ private:
+  enum Trigger {
+    TRIGGER_ALERT,
+    TRIGGER_ENGAGE,
+    TRIGGER_DISENGAGE,
+    NUM_TRIGGERS,
+  };
+
+  struct ServiceRule {
+    // keep every decimation-th message, 0 for none
+    int decimation;
+    // or at most one in this long
+    uint64_t min_interval;
+    // bit i for windows[i]
+    uint32_t windows;
+  };
+
+  struct ServiceState {
+    ServiceRule rule;
+    int counter = 0;
+    uint64_t last_kept = 0;
+  };
+
+  struct Window {
+    Trigger trigger;
+    uint64_t before;
+    uint64_t after;
+    uint64_t active_until = 0;
+  };
+
+  struct Held {
+    uint64_t recv_time;
+    LoggerHandle *handle;
+    // of the message in held_data
+    size_t offset;
+    size_t size;
+    // lookback windows that would keep it, 0 once written
+    uint32_t windows;
+  };
+
+  static const int MAX_WINDOWS = 32;
+
+  // triggers this controlsState fires
+  uint32_t controls_triggers(const uint8_t *data, size_t size);
+  void fire(Trigger trigger, uint64_t t);
+  void hold(uint64_t recv_time, LoggerHandle *h, const uint8_t *data, size_t size, uint32_t window_bits);
+
+  std::vector<std::string> names;
+  std::vector<int> base_decimations;
+
+  std::vector<ServiceState> services;
+  std::vector<Window> windows;
+  // windows that look back, messages of their services are held
+  uint32_t lookback_windows = 0;
+  uint64_t max_before = 0;
+
+  int controls_state = -1;
+  AlignedBuffer controls_buf;
+  bool last_enabled = false;
+  std::string last_alert;
+
+  std::string rules_path;
+  struct timespec rules_mtime = {};
+
+  std::deque<Held> held;
+  // a ring of the held messages' bytes, oldest at held.front().offset. it
+  // grows to fit the windows and is reused from then on
+  std::vector<uint8_t> held_data;
+  size_t held_head = 0;
+  // every handle a held message might use, oldest first, the last is current
+  std::deque<LoggerHandle*> handles;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include <algorithm>
+
+#include "shm_handover.h"
+
+void ShmHandover::to_ring() {
+  st = TO_RING;
+  ring_start = UINT64_MAX;
+}
+
+void ShmHandover::to_zmq() {
+  st = TO_ZMQ;
+  ring_end = UINT64_MAX;
+}
+
+bool ShmHandover::ring_msg(uint64_t mono_time) {
+  switch (st) {
+  case TO_RING:
+    if (ring_start == UINT64_MAX) {
+      if (mono_time <= last) return false;
+      ring_start = mono_time;
+    }
+    break;
+  case RING:
+    break;
+  case TO_ZMQ:
+    if (mono_time >= ring_end) return false;
+    break;
+  default:
+    return false;
+  }
+
+  last = std::max(last, mono_time);
+  return true;
+}
+
+bool ShmHandover::zmq_msg(uint64_t mono_time) {
+  switch (st) {
+  case ZMQ:
+    break;
+  case TO_RING:
+    if (mono_time >= ring_start) {
+      // the ring has it and everything after
+      st = RING;
+      return false;
+    }
+    break;
+  case RING:
+    return false;
+  case TO_ZMQ:
+    if (ring_end == UINT64_MAX) {
+      if (mono_time <= last) return false;
+      ring_end = mono_time;
+    }
+    break;
+  }
+
+  last = std::max(last, mono_time);
+  return true;
+}
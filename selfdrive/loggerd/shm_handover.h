@@ -0,0 +1,63 @@
+#ifndef SHM_HANDOVER_H
+#define SHM_HANDOVER_H
+
+#include <stdint.h>
+
+// Which copy of a message to log while a service moves between zmq and its
+// publisher's shm ring, going by logMonoTime. Publishers put a message in
+// the ring before sending it, and the ring is read from the start of its
+// current lap, so it can have older messages than zmq or miss older ones.
+//
+// To the ring, zmq stays subscribed until it delivers the first message
+// taken from the ring, only zmq has what came before that. The ring is read
+// before each message from zmq, and passes over what's logged already and
+// anything from before loggerd started.
+//
+// Back to zmq, once the ring can't be relied on and zmq is subscribed
+// again, the ring is read until zmq delivers something it didn't have.
+// Everything before that is in the ring.
+class ShmHandover {
+ public:
+  enum State {
+    // no ring
+    ZMQ,
+    // ring opened, zmq still subscribed
+    TO_RING,
+    // zmq unsubscribed
+    RING,
+    // zmq subscribed again, the ring is finished
+    TO_ZMQ,
+  };
+
+  // messages up to since aren't wanted from a ring
+  explicit ShmHandover(uint64_t since = 0) : last(since) {}
+
+  State state() const { return st; }
+
+  // the ring was opened
+  void to_ring();
+  // from the ring back to zmq, which is subscribed again
+  void to_zmq();
+  // the ring was closed
+  void closed() { st = ZMQ; }
+
+  // a message read from the ring, true if it's logged
+  bool ring_msg(uint64_t mono_time);
+  // a message zmq delivered, true if it's logged. in TO_RING the ring has to
+  // be read first. zmq can be unsubscribed if it moved to RING
+  bool zmq_msg(uint64_t mono_time);
+
+  // in TO_ZMQ, the ring is read up to what zmq delivered and can be closed
+  bool ring_done() const { return st == TO_ZMQ && ring_end != UINT64_MAX; }
+
+ private:
+  State st = ZMQ;
+  // newest message logged, from either
+  uint64_t last;
+  // of the first message logged from the ring
+  uint64_t ring_start = UINT64_MAX;
+  // of the first message zmq delivered that the ring didn't have
+  uint64_t ring_end = UINT64_MAX;
+};
+
+#endif
@@ -0,0 +1,215 @@
+// Writes two minutes of can, health and thermal through the blocks codec
+// and reads them back with LogBlockReader: from the footer of a closed file,
+// and by walking the blocks of one cut off mid block or never closed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "log_codec.h"
+#include "log_blocks.h"
+
+#define SEC 1000000000ULL
+
+// LOG_BLOCK_MAX_AGE, give or take the once a second it's checked
+#define MAX_BLOCK_SPAN (6 * SEC)
+
+struct Events {
+  std::vector<std::string> all;
+  // serialized events of each service back to back, in the order written
+  std::map<uint16_t, std::string> by_service;
+  uint64_t end_mono_time = 0;
+};
+
+std::string serialize(capnp::MallocMessageBuilder &msg) {
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  return std::string((const char*)bytes.begin(), bytes.size());
+}
+
+// can at 100Hz fills blocks by size, health at 2Hz and thermal at 0.5Hz
+// only by age
+Events make_events(uint64_t seconds) {
+  srand(1);
+  Events ev;
+  const uint64_t start = 10 * SEC;
+  for (uint64_t i = 0; i < seconds * 100; i++) {
+    const uint64_t t = start + i * SEC / 100;
+
+    capnp::MallocMessageBuilder msg;
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+    event.setLogMonoTime(t);
+    if (i % 200 == 50) {
+      event.initThermal().setFreeSpace(rand() % 100 / 100.0);
+    } else if (i % 50 == 25) {
+      event.initHealth().setVoltage(12000 + rand() % 1000);
+    } else {
+      auto cans = event.initCan(20);
+      for (int j = 0; j < 20; j++) {
+        uint8_t dat[8];
+        for (int k = 0; k < 8; k++) dat[k] = rand();
+        cans[j].setAddress(0x100 + j);
+        cans[j].setDat(kj::arrayPtr(dat, sizeof(dat)));
+      }
+    }
+
+    const std::string data = serialize(msg);
+    ev.all.push_back(data);
+    ev.by_service[event.which()] += data;
+    ev.end_mono_time = t;
+  }
+  return ev;
+}
+
+// leaves the file open, like a crashed loggerd, if f is given
+void* write_file(const char *path, const Events &ev, FILE **f = NULL) {
+  FILE *file = fopen(path, "wb");
+  assert(file);
+  void *w = log_codec_blocks.open(file);
+  assert(w);
+  for (const std::string &data : ev.all) {
+    assert(log_codec_blocks.write(w, (const uint8_t*)data.data(), data.size()) == 0);
+  }
+  if (f) {
+    *f = file;
+    return w;
+  }
+
+  assert(log_codec_blocks.close(w) == 0);
+  fclose(file);
+  return NULL;
+}
+
+// every block decompresses to whole events of its service and time range,
+// and the blocks of a service put together are what was written of it,
+// all of it if complete
+void check_file(const LogBlockReader &reader, const Events &ev, bool complete) {
+  std::map<uint16_t, std::string> by_service;
+  std::string out;
+  for (const LogBlockIndexEntry &entry : reader.blocks()) {
+    assert(reader.read_block(entry, out));
+    assert(out.size() == entry.block.size && out.size() % sizeof(capnp::word) == 0);
+    assert(entry.block.min_mono_time <= entry.block.max_mono_time);
+
+    auto buf = kj::heapArray<capnp::word>(out.size() / sizeof(capnp::word));
+    memcpy(buf.begin(), out.data(), out.size());
+    kj::ArrayPtr<const capnp::word> words = buf.asPtr();
+    uint32_t events = 0;
+    uint64_t min_mono_time = UINT64_MAX, max_mono_time = 0;
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader cmsg(words);
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+      assert(event.which() == entry.block.service);
+      min_mono_time = std::min(min_mono_time, event.getLogMonoTime());
+      max_mono_time = std::max(max_mono_time, event.getLogMonoTime());
+      events++;
+      words = kj::arrayPtr(cmsg.getEnd(), words.end());
+    }
+    assert(events == entry.block.events);
+    assert(min_mono_time == entry.block.min_mono_time && max_mono_time == entry.block.max_mono_time);
+
+    // slow services don't sit in a block for longer than a few seconds
+    assert(entry.block.max_mono_time - entry.block.min_mono_time <= MAX_BLOCK_SPAN);
+
+    by_service[entry.block.service] += out;
+  }
+
+  for (const auto &it : ev.by_service) {
+    const std::string &got = by_service[it.first];
+    if (complete) {
+      assert(got == it.second);
+    } else {
+      assert(it.second.compare(0, got.size(), got) == 0);
+    }
+  }
+  assert(by_service.size() == ev.by_service.size());
+}
+
+uint64_t last_mono_time(const LogBlockReader &reader, uint16_t service) {
+  uint64_t t = 0;
+  for (const LogBlockIndexEntry &entry : reader.blocks()) {
+    if (entry.block.service == service) t = std::max(t, entry.block.max_mono_time);
+  }
+  return t;
+}
+
+std::string read_file(const char *path) {
+  std::string out;
+  FILE *f = fopen(path, "rb");
+  assert(f);
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return out;
+}
+
+void write_prefix(const char *path, const std::string &data, size_t size) {
+  FILE *f = fopen(path, "wb");
+  assert(f && fwrite(data.data(), 1, size, f) == size);
+  fclose(f);
+}
+
+int main() {
+  const Events ev = make_events(120);
+  assert(ev.by_service.size() == 3);
+  char path[] = "/tmp/test_log_blocks_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  // closed, read through the footer
+  write_file(path, ev);
+  LogBlockReader reader;
+  assert(reader.open(path));
+  check_file(reader, ev, true);
+  const std::vector<LogBlockIndexEntry> index = reader.blocks();
+  reader.close();
+
+  // cut off in the middle of a block, the blocks before it are found by
+  // walking the headers and are the same as in the index
+  const std::string file = read_file(path);
+  const size_t cut = index[index.size() / 2].offset + sizeof(LogBlockHeader) + 10;
+  write_prefix(path, file, cut);
+  assert(reader.open(path));
+  check_file(reader, ev, false);
+  assert(reader.blocks().size() == index.size() / 2);
+  assert(memcmp(reader.blocks().data(), index.data(), reader.blocks().size() * sizeof(LogBlockIndexEntry)) == 0);
+  reader.close();
+
+  // only the header left
+  write_prefix(path, file, sizeof(LogFileHeader));
+  assert(reader.open(path));
+  assert(reader.blocks().empty());
+  reader.close();
+
+  // never closed, the slow services are on disk up to a few seconds and
+  // one of their events before the end
+  FILE *f;
+  void *w = write_file(path, ev, &f);
+  assert(reader.open(path));
+  check_file(reader, ev, false);
+  assert(last_mono_time(reader, cereal::Event::HEALTH) + MAX_BLOCK_SPAN + SEC / 2 >= ev.end_mono_time);
+  assert(last_mono_time(reader, cereal::Event::THERMAL) + MAX_BLOCK_SPAN + 2 * SEC >= ev.end_mono_time);
+  reader.close();
+  assert(log_codec_blocks.close(w) == 0);
+  fclose(f);
+
+  unlink(path);
+  printf("log blocks ok\n");
+  return 0;
+}
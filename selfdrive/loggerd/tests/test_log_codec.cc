@@ -0,0 +1,161 @@
+// Round trips data through the log codecs of this build and reads the files
+// back like a log reader would. With HAVE_ZSTD the zstd codec's blocks, job
+// ring and seek table are checked too.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "log_codec.h"
+
+// random bytes with runs, so it compresses a bit but not to nothing
+std::string make_data(size_t size, unsigned seed) {
+  srand(seed);
+  std::string data(size, 0);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (rand() % 4 == 0) ? rand() : data[i > 0 ? i - 1 : 0];
+  }
+  return data;
+}
+
+// writes data in chunks of random size, like events of all sizes
+std::string write_file(const LogCodec &codec, const std::string &data, size_t max_chunk) {
+  char path[] = "/tmp/test_log_codec_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  FILE *f = fdopen(fd, "wb");
+  assert(f);
+
+  void *w = codec.open(f);
+  assert(w);
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t n = std::min(data.size() - pos, (size_t)(1 + rand() % max_chunk));
+    assert(codec.write(w, (const uint8_t*)data.data() + pos, n) == 0);
+    pos += n;
+  }
+  assert(codec.close(w) == 0);
+  fclose(f);
+
+  std::string out;
+  f = fopen(path, "rb");
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  unlink(path);
+  return out;
+}
+
+void test_bz2(size_t size) {
+  const std::string data = make_data(size, size);
+  const std::string file = write_file(log_codec_bz2, data, 10000);
+
+  std::string out(size + 1, 0);
+  unsigned int out_len = out.size();
+  int ret = BZ2_bzBuffToBuffDecompress(&out[0], &out_len, (char*)file.data(), file.size(), 0, 0);
+  assert(ret == BZ_OK);
+  assert(out_len == size && out.compare(0, size, data) == 0);
+}
+
+#ifdef HAVE_ZSTD
+
+uint32_t get_le32(const std::string &s, size_t pos) {
+  const uint8_t *p = (const uint8_t*)s.data() + pos;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void test_zstd(size_t size, size_t max_chunk) {
+  const std::string data = make_data(size, size);
+  const std::string file = write_file(log_codec_zstd, data, max_chunk);
+
+  // the seek table is the last frame, its footer is the last 9 bytes
+  assert(file.size() >= 17);
+  assert(get_le32(file, file.size() - 4) == 0x8F92EAB1);
+  assert(file[file.size() - 5] == 0);
+  const uint32_t num_frames = get_le32(file, file.size() - 9);
+  const size_t table_size = 8 + num_frames * 8 + 9;
+  assert(file.size() >= table_size);
+  const size_t table = file.size() - table_size;
+  assert(get_le32(file, table) == 0x184D2A5E);
+  assert(get_le32(file, table + 4) == num_frames * 8 + 9);
+
+  // full blocks, the rest in one more. nothing empty, not even when the
+  // data ends on a block boundary
+  const size_t expected_frames = (size + LOG_ZSTD_BLOCK_SIZE - 1) / LOG_ZSTD_BLOCK_SIZE;
+  assert(num_frames == expected_frames);
+
+  // every entry is the size of its frame, and the frames decompress to
+  // the data in order
+  std::string out(LOG_ZSTD_BLOCK_SIZE, 0);
+  size_t pos = 0, data_pos = 0;
+  for (uint32_t i = 0; i < num_frames; i++) {
+    const uint32_t compressed_size = get_le32(file, table + 8 + i * 8);
+    const uint32_t decompressed_size = get_le32(file, table + 12 + i * 8);
+    const size_t expected_size = std::min((size_t)LOG_ZSTD_BLOCK_SIZE, size - data_pos);
+    assert(decompressed_size == expected_size);
+
+    assert(ZSTD_findFrameCompressedSize(file.data() + pos, table - pos) == compressed_size);
+    size_t n = ZSTD_decompress(&out[0], out.size(), file.data() + pos, compressed_size);
+    assert(!ZSTD_isError(n) && n == decompressed_size);
+    assert(data.compare(data_pos, n, out, 0, n) == 0);
+
+    pos += compressed_size;
+    data_pos += n;
+  }
+  assert(pos == table && data_pos == size);
+
+  // and plain zstd tools read the whole file, skipping the table
+  std::string all(size + 1, 0);
+  size_t n = ZSTD_decompress(&all[0], all.size(), file.data(), file.size());
+  assert(!ZSTD_isError(n) && n == size && all.compare(0, size, data) == 0);
+}
+
+#endif
+
+int main() {
+  assert(log_codec_find("bz2") == &log_codec_bz2);
+  assert(log_codec_find("blocks") == &log_codec_blocks);
+  assert(log_codec_find("nope") == NULL);
+
+  test_bz2(0);
+  test_bz2(1);
+  test_bz2(3 * 1000 * 1000);
+
+#ifdef HAVE_ZSTD
+  assert(log_codec_find("zstd") == &log_codec_zstd);
+
+  // closing without data, and with less than a block
+  test_zstd(0, 1000);
+  test_zstd(1, 1000);
+  test_zstd(LOG_ZSTD_BLOCK_SIZE - 1, 100000);
+  // on and around block boundaries
+  test_zstd(LOG_ZSTD_BLOCK_SIZE, 100000);
+  test_zstd(LOG_ZSTD_BLOCK_SIZE + 1, 100000);
+  test_zstd(3 * LOG_ZSTD_BLOCK_SIZE, 100000);
+  // more blocks than jobs, so the job ring wraps and writes wait for the
+  // workers. writes bigger than a block span several
+  test_zstd(11 * LOG_ZSTD_BLOCK_SIZE + 12345, 100000);
+  test_zstd(5 * LOG_ZSTD_BLOCK_SIZE + 7, 3 * LOG_ZSTD_BLOCK_SIZE);
+  printf("log codecs ok, with zstd\n");
+#else
+  assert(log_codec_find("zstd") == NULL);
+  printf("log codecs ok, without zstd\n");
+#endif
+  return 0;
+}
@@ -0,0 +1,197 @@
+// LogRing with one producer and one consumer: entries come out whole and in
+// order around the wrap and its padding, a full ring refuses what doesn't
+// fit, and a consumer sleeping on an empty ring wakes up for a push.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include <thread>
+#include <chrono>
+#include <vector>
+
+#include "log_ring.h"
+
+// every byte of a message depends on its sequence number
+void fill(uint8_t *data, size_t size, uint32_t seq) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] = seq * 7 + i;
+  }
+}
+
+bool check(const LogRing::Entry &e, uint32_t seq, size_t size) {
+  if (e.service != seq % 100 || e.recv_time != seq * 1000ULL || e.size != size) return false;
+  for (size_t i = 0; i < size; i++) {
+    if (e.data[i] != (uint8_t)(seq * 7 + i)) return false;
+  }
+  return true;
+}
+
+bool push(LogRing &ring, uint32_t seq, size_t size) {
+  std::vector<uint8_t> data(size);
+  fill(data.data(), size, seq);
+  return ring.push(seq % 100, seq * 1000ULL, data.data(), size);
+}
+
+void pop(LogRing &ring, uint32_t seq, size_t size) {
+  LogRing::Entry e;
+  assert(ring.front(&e, 0));
+  assert(check(e, seq, size));
+  ring.pop();
+}
+
+void test_empty() {
+  LogRing ring(1000);
+  // rounded up to the alignment
+  assert(ring.capacity() == 1008);
+  LogRing::Entry e;
+  assert(!ring.front(&e, 0));
+  assert(!ring.front(&e, 10));
+
+  // empty messages are entries too
+  assert(push(ring, 1, 0));
+  pop(ring, 1, 0);
+  assert(!ring.front(&e, 0));
+  assert(ring.used() == 0);
+}
+
+void test_wrap() {
+  // a 16 byte header and the data rounded up to 16 per entry
+  LogRing ring(1024);
+
+  // nothing bigger than the ring fits, not even into an empty one
+  assert(!push(ring, 0, 1024 - 16 + 1));
+  assert(ring.used() == 0);
+
+  // sizes that don't divide the ring, so the end of buf gets padded over
+  uint32_t seq = 0, popped = 0;
+  const size_t sizes[] = {40, 100, 3, 600, 17};
+  for (size_t size : sizes) {
+    for (int i = 0; i < 200; i++) {
+      assert(push(ring, seq++, size));
+      pop(ring, popped++, size);
+    }
+  }
+
+  assert(ring.used() == 0);
+}
+
+void test_full() {
+  LogRing ring(1024);
+  uint32_t seq = 0, popped = 0;
+
+  // fills up to the byte: 8 entries of 128 in 1024
+  for (int i = 0; i < 8; i++) {
+    assert(push(ring, seq++, 100));
+  }
+  assert(ring.used() == 1024);
+  assert(!push(ring, seq, 1));
+
+  // room for one again, but not for a bigger one
+  pop(ring, popped++, 100);
+  assert(!push(ring, seq, 200));
+  assert(push(ring, seq++, 112));
+  for (int i = 0; i < 8; i++) {
+    pop(ring, popped++, i < 7 ? 100 : 112);
+  }
+  assert(ring.used() == 0);
+}
+
+void test_pad() {
+  LogRing ring(1024);
+  uint32_t seq = 0, popped = 0;
+
+  // with 16 bytes left at the end an entry of 32 goes at the start of buf,
+  // once what's there is gone. the pad counts as used until then
+  for (int i = 0; i < 3; i++) {
+    assert(push(ring, seq++, 320));
+  }
+  assert(ring.used() == 3 * 336);
+  assert(!push(ring, seq, 16));
+  pop(ring, popped++, 320);
+  assert(push(ring, seq++, 16));
+  assert(ring.used() == 2 * 336 + 16 + 32);
+  pop(ring, popped++, 320);
+  pop(ring, popped++, 320);
+  pop(ring, popped++, 16);
+  assert(ring.used() == 0);
+}
+
+void test_reserve() {
+  LogRing ring(1024);
+
+  // a reserve that isn't committed isn't seen and is written over
+  uint8_t *dst = ring.reserve(50);
+  assert(dst);
+  memset(dst, 0xAA, 50);
+  LogRing::Entry e;
+  assert(!ring.front(&e, 0));
+
+  dst = ring.reserve(60);
+  assert(dst);
+  fill(dst, 60, 5);
+  ring.commit(5, 5000);
+  pop(ring, 5, 60);
+
+  assert(ring.reserve(2000) == NULL);
+}
+
+void test_threads() {
+  // small enough to be full and empty all the time
+  LogRing ring(4096);
+  const uint32_t count = 200000;
+
+  std::thread producer([&]() {
+    for (uint32_t seq = 0; seq < count; seq++) {
+      const size_t size = seq % 97 * 7;
+      while (!push(ring, seq, size)) {
+        std::this_thread::yield();
+      }
+      // now and then let the consumer fall asleep
+      if (seq % 5000 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+  });
+
+  for (uint32_t seq = 0; seq < count; seq++) {
+    LogRing::Entry e;
+    while (!ring.front(&e, 100)) {}
+    assert(check(e, seq, seq % 97 * 7));
+    ring.pop();
+  }
+  producer.join();
+  assert(ring.used() == 0);
+}
+
+void test_wakeup() {
+  LogRing ring(4096);
+
+  // a long timeout, the push has to wake it
+  for (int i = 0; i < 20; i++) {
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&]() {
+      LogRing::Entry e;
+      assert(ring.front(&e, 10000));
+      assert(check(e, i, 10));
+      ring.pop();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(i % 3 == 0 ? 0 : 5));
+    assert(push(ring, i, 10));
+    consumer.join();
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+  }
+}
+
+int main() {
+  test_empty();
+  test_wrap();
+  test_full();
+  test_pad();
+  test_reserve();
+  test_threads();
+  test_wakeup();
+  printf("log ring ok\n");
+  return 0;
+}
@@ -0,0 +1,233 @@
+// Feeds QlogFilter ten seconds of messages at 100Hz and checks what reaches
+// the qlog of which segment: decimations, rate limits, the before and after
+// of windows, held messages written to the segment they came in after a
+// rotation, and rules reloaded while messages are held. LoggerHandles are
+// stubs that record what they're given.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common/aligned_buffer.h"
+#include "logger.h"
+#include "qlog_filter.h"
+
+#define MS 1000000ULL
+#define T0 (100 * 1000 * MS)
+
+enum {
+  CONTROLS_STATE,
+  CAR_STATE,
+  RADAR_STATE,
+  THERMAL,
+  HEALTH,
+};
+
+const std::vector<std::string> names = {"controlsState", "carState", "radarState", "thermal", "health"};
+const std::vector<int> decimations = {10, 5, 0, 1, 2};
+
+// a message is its service and the step it was logged at
+typedef std::pair<int, int> MsgId;
+
+std::map<MsgId, std::string> sent;
+std::map<LoggerHandle*, std::set<MsgId>> written;
+
+uint64_t step_time(int i) {
+  return T0 + i * 10 * MS;
+}
+
+// controlsState is parsed for triggers, the rest are can events that carry
+// their service in the first address and vary in size
+std::string make_msg(int service, int i, bool enabled = false, const char *alert = "") {
+  capnp::MallocMessageBuilder msg;
+  cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(step_time(i));
+  if (service == CONTROLS_STATE) {
+    auto controls = event.initControlsState();
+    controls.setEnabled(enabled);
+    controls.setAlertType(alert);
+  } else {
+    // up to about 2KB, so the held bytes wrap and grow
+    const int frames = 1 + (i * 7 + service * 13) % 80;
+    auto cans = event.initCan(frames);
+    for (int j = 0; j < frames; j++) {
+      cans[j].setAddress(service);
+      cans[j].setBusTime(i);
+    }
+  }
+
+  auto words = capnp::messageToFlatArray(msg);
+  auto bytes = words.asBytes();
+  std::string data((const char*)bytes.begin(), bytes.size());
+  sent[MsgId(service, i)] = data;
+  return data;
+}
+
+// stubs for logger.c, a write has to go to a handle that's still open
+void lh_log_qlog(LoggerHandle* h, uint8_t* data, size_t data_size) {
+  assert(h->refcnt > 0);
+
+  static AlignedBuffer buf;
+  capnp::FlatArrayMessageReader cmsg(buf.align(data, data_size));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+  const int i = (event.getLogMonoTime() - T0) / (10 * MS);
+  const int service = event.isControlsState() ? CONTROLS_STATE : event.getCan()[0].getAddress();
+
+  const MsgId id(service, i);
+  assert(sent.count(id) && sent[id] == std::string((const char*)data, data_size));
+  assert(written[h].insert(id).second);
+}
+
+void lh_close(LoggerHandle* h) {
+  assert(h->refcnt > 0);
+  h->refcnt--;
+}
+
+void write_rules(const char *path, const char *rules) {
+  FILE *f = fopen(path, "w");
+  assert(f);
+  fputs(rules, f);
+  fclose(f);
+}
+
+void test_rules() {
+  char path[] = "/tmp/test_qlog_rules_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  write_rules(path,
+    "services:\n"
+    "  thermal: {rate: 2}\n"
+    "  health: {decimation: 0}\n"
+    "windows:\n"
+    "  - {trigger: disengage, before: 1, after: 0.5, services: [carState, radarState]}\n"
+    "  - {trigger: alert, before: 0, after: 1, services: [health]}\n");
+
+  QlogFilter f(names, decimations);
+  assert(f.load_rules(path));
+
+  LoggerHandle h1 = {}, h2 = {}, h3 = {};
+  h1.refcnt = h2.refcnt = h3.refcnt = 1;
+  f.rotate(&h1);
+
+  // engaged until step 400, an alert from 700 to 800. the segment
+  // rotates at 370, while carState and radarState are held for the
+  // disengage, and at 850
+  for (int i = 0; i < 1000; i++) {
+    if (i == 370) f.rotate(&h2);
+    if (i == 850) f.rotate(&h3);
+
+    const uint64_t t = step_time(i);
+    std::string data = make_msg(CONTROLS_STATE, i, i < 400, (i >= 700 && i < 800) ? "steerSaturated" : "");
+    f.log(CONTROLS_STATE, t, (const uint8_t*)data.data(), data.size());
+    for (int service = CAR_STATE; service <= HEALTH; service++) {
+      data = make_msg(service, i);
+      f.log(service, t, (const uint8_t*)data.data(), data.size());
+    }
+
+    // nothing is held back unless a window might want it
+    if (i == 200) {
+      assert(written[&h1].count(MsgId(CAR_STATE, 200)) && written[&h1].count(MsgId(THERMAL, 200)));
+    }
+  }
+
+  // h1 was let go once nothing held could go to it anymore
+  assert(h1.refcnt == 0 && h2.refcnt == 0 && h3.refcnt == 1);
+
+  std::map<LoggerHandle*, std::set<MsgId>> expected;
+  for (int i = 0; i < 1000; i++) {
+    LoggerHandle *h = i < 370 ? &h1 : i < 850 ? &h2 : &h3;
+    const bool disengage_window = i >= 300 && i <= 450;
+
+    if (i % 10 == 0) expected[h].insert(MsgId(CONTROLS_STATE, i));
+    if (i % 5 == 0 || disengage_window) expected[h].insert(MsgId(CAR_STATE, i));
+    if (disengage_window) expected[h].insert(MsgId(RADAR_STATE, i));
+    // 2 a second
+    if (i % 50 == 0) expected[h].insert(MsgId(THERMAL, i));
+    if (i >= 700 && i <= 800) expected[h].insert(MsgId(HEALTH, i));
+  }
+  assert(written == expected);
+
+  written.clear();
+  sent.clear();
+  unlink(path);
+}
+
+void test_reload() {
+  char path[] = "/tmp/test_qlog_rules_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  write_rules(path,
+    "windows:\n"
+    "  - {trigger: disengage, before: 1, after: 0, services: [radarState]}\n");
+
+  QlogFilter f(names, {0, 0, 0, 0, 0});
+  assert(f.load_rules(path));
+  LoggerHandle h = {};
+  h.refcnt = 1;
+  f.rotate(&h);
+
+  // the windows change while radarState is held. what's held from before
+  // belonged to the old windows and isn't kept by the new ones
+  for (int i = 0; i <= 100; i++) {
+    if (i == 50) {
+      write_rules(path,
+        "windows:\n"
+        "  - {trigger: alert, before: 1, after: 0, services: [radarState]}\n");
+      assert(f.load_rules(path));
+    }
+
+    const uint64_t t = step_time(i);
+    std::string data = make_msg(CONTROLS_STATE, i, i < 60, i == 100 ? "steerSaturated" : "");
+    f.log(CONTROLS_STATE, t, (const uint8_t*)data.data(), data.size());
+    data = make_msg(RADAR_STATE, i);
+    f.log(RADAR_STATE, t, (const uint8_t*)data.data(), data.size());
+  }
+
+  // the disengage at 60 has no window anymore, the alert at 100 keeps
+  // what came since the reload
+  std::set<MsgId> expected;
+  for (int i = 50; i <= 100; i++) {
+    expected.insert(MsgId(RADAR_STATE, i));
+  }
+  assert(written[&h] == expected);
+
+  // a bad file leaves the rules as they are. the next alert looks back
+  // over what's been written already and only adds what's new
+  write_rules(path, "windows:\n  - {trigger: nope, before: 1, after: 0, services: [radarState]}\n");
+  assert(!f.load_rules(path));
+  for (int i = 101; i <= 150; i++) {
+    const uint64_t t = step_time(i);
+    std::string data = make_msg(CONTROLS_STATE, i, false, i == 150 ? "steerSaturated" : "");
+    f.log(CONTROLS_STATE, t, (const uint8_t*)data.data(), data.size());
+    data = make_msg(RADAR_STATE, i);
+    f.log(RADAR_STATE, t, (const uint8_t*)data.data(), data.size());
+    expected.insert(MsgId(RADAR_STATE, i));
+  }
+  assert(written[&h] == expected);
+
+  written.clear();
+  sent.clear();
+  unlink(path);
+}
+
+int main() {
+  test_rules();
+  test_reload();
+  printf("qlog filter ok\n");
+  return 0;
+}
@@ -0,0 +1,368 @@
+// Shm rings from both ends: messages come out whole and in order around the
+// wrap and its padding, a lapped reader counts the overrun and carries on
+// from the newest, a copy the writer raced is never taken as good, and a
+// message too big for the ring is counted as skipped. Then a publisher, a
+// zmq socket that drops what it has queued on unsubscribe, and loggerd's
+// handover between the two, through publisher restarts and a skip: every
+// message is logged exactly once, except skipped ones zmq wasn't
+// subscribed for.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/shm_ring.h"
+#include "shm_handover.h"
+
+// a message is its logMonoTime followed by bytes that depend on it
+std::string make_msg(uint64_t mono_time, size_t size) {
+  std::string data(size, 0);
+  memcpy(&data[0], &mono_time, sizeof(mono_time));
+  for (size_t i = sizeof(mono_time); i < size; i++) {
+    data[i] = mono_time * 13 + i;
+  }
+  return data;
+}
+
+uint64_t msg_mono_time(const std::string &data) {
+  uint64_t mono_time;
+  memcpy(&mono_time, data.data(), sizeof(mono_time));
+  return mono_time;
+}
+
+bool check_msg(const std::string &data) {
+  return data.size() >= sizeof(uint64_t) && data == make_msg(msg_mono_time(data), data.size());
+}
+
+size_t msg_size(uint64_t mono_time) {
+  return sizeof(uint64_t) + mono_time * 37 % 300;
+}
+
+void write(ShmRingWriter &w, uint64_t mono_time, size_t size) {
+  const std::string data = make_msg(mono_time, size);
+  w.write(data.data(), data.size());
+}
+
+// false if there's nothing new or the copy was overwritten
+bool read(ShmRingReader &r, std::string &out) {
+  const size_t size = r.next_size();
+  if (size == 0) return false;
+  out.resize(size);
+  return r.read(&out[0]);
+}
+
+void test_order() {
+  ShmRingWriter w;
+  assert(w.open("test_shm_ring", 4096));
+  ShmRingReader r;
+  assert(r.open("test_shm_ring"));
+  std::string data;
+  assert(!read(r, data));
+
+  // in lock step, sizes that don't divide the ring so the end gets padded
+  for (uint64_t t = 1; t < 2000; t++) {
+    write(w, t, msg_size(t));
+    assert(read(r, data) && check_msg(data) && msg_mono_time(data) == t);
+    assert(!read(r, data));
+  }
+
+  // a few at a time, never more than a ring
+  uint64_t t = 10000, next = t;
+  for (int i = 0; i < 500; i++) {
+    for (int j = 0; j < i % 7; j++, t++) write(w, t, msg_size(t));
+    while (read(r, data)) {
+      assert(check_msg(data) && msg_mono_time(data) == next++);
+    }
+    assert(next == t);
+  }
+  assert(r.overruns == 0 && r.skipped() == 0);
+}
+
+void test_open() {
+  ShmRingWriter w;
+  assert(w.open("test_shm_ring", 4096));
+
+  // what was written before opening is there until the ring wraps
+  for (uint64_t t = 1; t <= 10; t++) write(w, t, 100);
+  ShmRingReader r;
+  assert(r.open("test_shm_ring"));
+  std::string data;
+  for (uint64_t t = 1; t <= 10; t++) {
+    assert(read(r, data) && msg_mono_time(data) == t);
+  }
+  r.close();
+
+  // 112 byte records, 36 in a lap, from the start of the current one
+  for (uint64_t t = 11; t <= 50; t++) write(w, t, 100);
+  assert(r.open("test_shm_ring"));
+  for (uint64_t t = 37; t <= 50; t++) {
+    assert(read(r, data) && msg_mono_time(data) == t);
+  }
+  assert(!read(r, data) && r.overruns == 0);
+}
+
+void test_overrun() {
+  ShmRingWriter w;
+  assert(w.open("test_shm_ring", 4096));
+  ShmRingReader r;
+  assert(r.open("test_shm_ring"));
+
+  // lapped, the reader starts again at what's newest
+  write(w, 1, 100);
+  for (uint64_t t = 2; t <= 100; t++) write(w, t, 100);
+  std::string data;
+  assert(!read(r, data) && r.overruns == 1);
+  write(w, 101, 100);
+  assert(read(r, data) && msg_mono_time(data) == 101 && r.overruns == 1);
+
+  // overwritten between next_size and read, the copy isn't good
+  for (uint64_t t = 102; t <= 105; t++) write(w, t, 100);
+  assert(r.next_size() == 100);
+  for (uint64_t t = 106; t <= 150; t++) write(w, t, 100);
+  data.resize(100);
+  assert(!r.read(&data[0]) && r.overruns == 2);
+  assert(!read(r, data));
+}
+
+void test_threads() {
+  ShmRingWriter w;
+  assert(w.open("test_shm_ring", 4096));
+  ShmRingReader r;
+  assert(r.open("test_shm_ring"));
+
+  // a writer that doesn't wait laps the reader all the time, what the
+  // reader takes is still whole and in order
+  const uint64_t count = 1000000;
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    for (uint64_t t = 1; t <= count; t++) {
+      write(w, t, msg_size(t));
+      // let the reader in on one core too
+      if (t % 8 == 0) std::this_thread::yield();
+    }
+    done = true;
+  });
+
+  uint64_t last = 0, got = 0;
+  std::string data;
+  while (!done || r.next_size() > 0) {
+    if (!read(r, data)) {
+      std::this_thread::yield();
+      continue;
+    }
+    assert(check_msg(data) && msg_mono_time(data) > last);
+    last = msg_mono_time(data);
+    got++;
+  }
+  writer.join();
+  assert(got > 0 && (got == count || r.overruns > 0));
+
+  // caught up, the end of the last lap isn't lost
+  write(w, count + 1, 100);
+  assert(read(r, data) && msg_mono_time(data) == count + 1);
+}
+
+void test_skip() {
+  ShmRingWriter w;
+  assert(w.open("test_shm_ring", 4096));
+  ShmRingReader r;
+  assert(r.open("test_shm_ring"));
+
+  // a quarter of the ring at most
+  assert(w.reserve(4096 / 4 - 8) != NULL);
+  w.commit();
+  assert(r.skipped() == 0);
+  assert(w.reserve(4096 / 4) == NULL);
+  write(w, 1, 2000);
+  assert(r.skipped() == 2);
+
+  // the rest still goes in the ring, but nothing new reads it
+  write(w, 2, 100);
+  std::string data;
+  assert(read(r, data) && data.size() == 4096 / 4 - 8);
+  assert(read(r, data) && msg_mono_time(data) == 2);
+  ShmRingReader r2;
+  assert(!r2.open("test_shm_ring"));
+
+  // the publisher restarting is a new ring
+  assert(!r.stale());
+  ShmRingWriter w2;
+  assert(w2.open("test_shm_ring", 4096));
+  assert(r.stale());
+  assert(r2.open("test_shm_ring"));
+}
+
+// a SUB socket. what's queued is dropped on unsubscribe, and a subscribe
+// only gets what's sent after it reached the publisher
+struct Sub {
+  bool subscribed = true;
+  int subscribe_lag = 0;
+  std::deque<std::string> queue;
+
+  void send(const std::string &data) {
+    if (subscribe_lag > 0 && --subscribe_lag == 0) subscribed = true;
+    if (subscribed) queue.push_back(data);
+  }
+  void subscribe() {
+    assert(!subscribed && subscribe_lag == 0);
+    subscribe_lag = 1 + rand() % 5;
+  }
+  void unsubscribe() {
+    subscribed = false;
+    subscribe_lag = 0;
+    queue.clear();
+  }
+};
+
+// loggerd's side of one service
+struct Loggerd {
+  Sub sub;
+  ShmRingReader ring;
+  ShmHandover handover;
+  // logMonoTime to times logged
+  std::map<uint64_t, int> logged;
+  uint32_t skipped = 0;
+
+  Loggerd(uint64_t since) : handover(since) {}
+
+  void log(const std::string &data) {
+    assert(check_msg(data));
+    logged[msg_mono_time(data)]++;
+  }
+
+  void read_ring() {
+    if (!ring.is_open()) return;
+
+    std::string data;
+    while (ring.next_size() > 0) {
+      data.resize(ring.next_size());
+      if (!ring.read(&data[0])) continue;
+      if (!handover.ring_msg(msg_mono_time(data))) {
+        if (handover.ring_done()) break;
+        continue;
+      }
+      log(data);
+    }
+    if (handover.ring_done()) {
+      ring.close();
+      handover.closed();
+    }
+
+    const ShmHandover::State state = handover.state();
+    if (ring.is_open() && ring.skipped() && (state == ShmHandover::TO_RING || state == ShmHandover::RING)) {
+      skipped += ring.skipped();
+      if (state == ShmHandover::RING) sub.subscribe();
+      handover.to_zmq();
+    }
+  }
+
+  // after reading what's new, like loggerd
+  void check_ring() {
+    read_ring();
+    if (ring.is_open() && ring.stale()) {
+      ring.close();
+      if (handover.state() == ShmHandover::RING) sub.subscribe();
+      handover.closed();
+    }
+    if (!ring.is_open() && ring.open("test_shm_handover")) {
+      handover.to_ring();
+    }
+  }
+
+  // zmq may be behind, it delivers only some of what it has
+  void recv(size_t n) {
+    while (n-- > 0 && !sub.queue.empty()) {
+      const std::string data = sub.queue.front();
+      sub.queue.pop_front();
+      const bool to_ring = handover.state() == ShmHandover::TO_RING;
+      if (to_ring) read_ring();
+      const bool log_it = handover.zmq_msg(msg_mono_time(data));
+      if (to_ring && handover.state() == ShmHandover::RING) {
+        sub.unsubscribe();
+      }
+      if (handover.ring_done()) {
+        read_ring();
+      }
+      if (log_it) log(data);
+    }
+  }
+};
+
+void test_handover() {
+  srand(1);
+  ShmRingWriter *w = new ShmRingWriter();
+  assert(w->open("test_shm_handover", 64*1024));
+
+  // sent before loggerd started, it doesn't want them
+  uint64_t t = 1;
+  for (; t <= 100; t++) write(*w, t, msg_size(t));
+
+  Loggerd l(t - 1);
+  std::map<uint64_t, bool> sent;
+  for (int step = 0; step < 20000; step++) {
+    // the publisher restarts, with a new ring before it sends anything
+    if (step < 15000 && step % 3000 == 1500) {
+      delete w;
+      w = new ShmRingWriter();
+      assert(w->open("test_shm_handover", 64*1024));
+    }
+
+    // it puts a message in the ring first
+    for (int i = rand() % 4; i > 0; i--, t++) {
+      const bool too_big = step == 17000 && i == 1;
+      const std::string data = make_msg(t, too_big ? 20000 : msg_size(t));
+      w->write(data.data(), data.size());
+      l.sub.send(data);
+      sent[t] = too_big;
+    }
+
+    if (rand() % 3 == 0) l.read_ring();
+    if (rand() % 50 == 0) l.check_ring();
+    l.recv(rand() % 6);
+  }
+
+  // logged once, the skipped one may be lost
+  l.read_ring();
+  l.recv(SIZE_MAX);
+  assert(l.skipped == 1);
+  for (const auto &it : sent) {
+    const int times = l.logged.count(it.first) ? l.logged[it.first] : 0;
+    assert(times == 1 || (times == 0 && it.second));
+  }
+  assert(l.logged.size() >= sent.size() - 1);
+  assert(l.logged.begin()->first == 101);
+
+  // the ring was used, and isn't anymore after the skip
+  assert(l.handover.state() == ShmHandover::ZMQ && !l.ring.is_open());
+  delete w;
+}
+
+int main() {
+  char dir[] = "/tmp/test_shm_ring_XXXXXX";
+  assert(mkdtemp(dir));
+  setenv("SHM_RING_DIR", dir, 1);
+
+  test_order();
+  test_open();
+  test_overrun();
+  test_threads();
+  test_skip();
+  test_handover();
+
+  unlink((std::string(dir) + "/test_shm_ring").c_str());
+  unlink((std::string(dir) + "/test_shm_handover").c_str());
+  rmdir(dir);
+  printf("shm ring ok\n");
+  return 0;
+}
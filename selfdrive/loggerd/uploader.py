@@ -142,13 +142,13 @@ class Uploader(object):
   def next_file_to_upload(self, with_raw):
     # try to upload qlog files first
     for name, key, fn in self.gen_upload_files():
-      if name  == "qlog.bz2":
+      if name in ("qlog.bz2", "qlog.zst", "qlog.blk"):
         return (key, fn, 0)
 
     if with_raw:
       # then upload the full log files, rear and front camera files
       for name, key, fn in self.gen_upload_files():
-        if name  == "rlog.bz2":
+        if name in ("rlog.bz2", "rlog.zst", "rlog.blk"):
           return (key, fn, 1)
         elif name == "fcamera.hevc":
           return (key, fn, 2)